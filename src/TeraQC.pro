@@ -1,44 +1,32 @@
+# the Vaa3D plugin, a thin shim over the processing core
+# qmake V3D_SRC=... PLUGIN_DEST=... OPENCV=..., or set them in the environment
 TEMPLATE = lib
 CONFIG += qt plugin warn_off
 #CONFIG	+= x86_64
 
-PLUGIN_DEST = D:/Vaa3D/Vaa3D_V4.001_Windows_MSVC_64bit/plugins
-V3D_SRC = D:/Vaa3D/v3d_external
-OPENCV = D:/opencv/build
-#OPENCV = D:/libs/opencv-3.4
+isEmpty(V3D_SRC):V3D_SRC = $$(V3D_SRC)
+isEmpty(V3D_SRC):error("Set V3D_SRC to the v3d_external source folder.")
+isEmpty(PLUGIN_DEST):PLUGIN_DEST = $$(PLUGIN_DEST)
+isEmpty(PLUGIN_DEST):PLUGIN_DEST = $$PWD/../build/plugins
+
+# images of the core are the vaa3d basic data types
+DEFINES += TERAQC_V3D
+
+include(core.pri)
 
 #include necessary paths
 INCLUDEPATH	+= $$V3D_SRC/v3d_main/basic_c_fun \
-    $$V3D_SRC/v3d_main/common_lib/include \
-    $$OPENCV/include \
-    $$OPENCV/include/opencv \
-    $$OPENCV/include/opencv2
+    $$V3D_SRC/v3d_main/common_lib/include
 
 LIBS += -L. \
     -L$$V3D_SRC/v3d_main/common_lib/lib
 
-CONFIG(debug, debug|release){
-    LIBS += -L$$OPENCV/x64/vc12/lib -lopencv_world310d
-} else {
-    LIBS += -L$$OPENCV/x64/vc12/lib -lopencv_world310
-}
-
-#LIBS += -L$$OPENCV/x64/vc12/lib \
-#    -lopencv_core340 -lopencv_imgproc340
-
 #include the headers used in the project
-HEADERS	+= TeraQCPlugin.h \
-    TeraQCTypes.h \
-    loadUtils.h \
-    preprocessing.h \
-    roiSampling.h
+HEADERS	+= TeraQCPlugin.h
 
 #include the source files used in the project
 SOURCES	+= TeraQCPlugin.cpp \
-    loadUtils.cpp \
-    $$V3D_SRC/v3d_main/basic_c_fun/v3d_message.cpp \
-    preprocessing.cpp \
-    roiSampling.cpp
+    $$V3D_SRC/v3d_main/basic_c_fun/v3d_message.cpp
 
 #specify target name and directory
 TARGET	= $$qtLibraryTarget(TeraQC)
@@ -8,7 +8,7 @@
 
 #include <QObject>
 #include <v3d_interface.h>
-#include "TeraQCTypes.h"
+#include "commands.h"
 
 class TeraQCPlugin : public QObject, public V3DPluginInterface2_1
 {
@@ -31,7 +31,8 @@ public:
                 QWidget* parent);
 
 protected:
-    QcImage imgInput, imgMarker, imgMasked, imgMaxima;
+    // volumes & decoded teraconvert blocks kept between calls
+    QcSession session;
 
 };
 
@@ -6,13 +6,51 @@
 #ifndef TERAQCTYPES_H
 #define TERAQCTYPES_H
 
-#include <v3d_interface.h>
+#include "qcBasic.h"
+#include <stdexcept>
+#include <cstddef>
+
+// bytes of a pixel type
+inline int qcTypeSize(int datatype)
+{
+    switch (datatype)
+    {
+    case V3D_UINT8:
+        return 1;
+    case V3D_UINT16:
+        return 2;
+    case V3D_FLOAT32:
+        return 4;
+    default:
+        return 1;
+    };
+}
+
+/*
+ * Header of a raw volume file
+ *
+ * The voxels start at QC_RAW_OFFSET, so they are page aligned when mapped.
+ * complete is set only after the volume is fully written.
+ */
+struct QcRawHeader
+{
+    char magic[8];
+    qint64 sz[4];
+    qint32 datatype;
+    qint32 complete;
+};
+
+// account for heap image buffers, see qcImageBytes in trace.h
+void qcTrackImageBytes(qint64 delta);
+
+static const char QC_RAW_MAGIC[8] = {'T', 'E', 'R', 'A', 'Q', 'C', 'R', '1'};
+static const qint64 QC_RAW_OFFSET = 4096;
 
 struct QcImage
 {
     // initialization
     QcImage():
-        buffer(NULL), datatype(V3D_UNKNOWN)
+        buffer(NULL), datatype(V3D_UNKNOWN), file(NULL), writable(true), heapBytes(0)
     {
         for(int i = 0; i < 4; ++i) sz[i] = 0;
     }
@@ -20,36 +58,113 @@ struct QcImage
     {
         clear();
     }
+    /*
+     * Back the buffers created afterwards by a memory mapped raw volume file,
+     * so the page cache manages residency. Empty path for heap buffers.
+     */
+    void setBacking(const QString& path)
+    {
+        backing = path;
+    }
     void create(const V3DLONG sz[4], int datatype)
     {
         for(int i = 0; i < 4; ++i) this->sz[i] = sz[i];
         this->datatype = datatype;
-        int t;
-        switch (datatype)
-        {
-        case V3D_UINT8:
-            t = 1;
-            break;
-        case V3D_UINT16:
-            t = 2;
-            break;
-        case V3D_FLOAT32:
-            t = 4;
-            break;
-        default:
-            t = 1;
-        };
-        buffer = new uchar[ sz[0] * sz[1] * sz[2] * sz[3] * t ];
-    }
-    void clear() // shallow, doesn't deal with memory dealloc
+        qint64 bytes = sz[0] * sz[1] * sz[2] * sz[3] * qcTypeSize(datatype);
+        if (backing.isEmpty())
+        {
+            buffer = new uchar[ bytes ];
+            trackBuffer();
+            return;
+        }
+        file = new QFile(backing);
+        writable = true;
+        uchar* base = NULL;
+        if (file->open(QIODevice::ReadWrite | QIODevice::Truncate) &&
+                file->resize(QC_RAW_OFFSET + bytes))
+            base = file->map(0, QC_RAW_OFFSET + bytes);
+        if (base == NULL)
+        {
+            delete file;
+            file = NULL;
+            for(int i = 0; i < 4; ++i) this->sz[i] = 0;
+            this->datatype = V3D_UNKNOWN;
+            throw std::runtime_error("Failed to map the raw volume file " + backing.toStdString());
+        }
+        auto header = (QcRawHeader*)base;
+        memcpy(header->magic, QC_RAW_MAGIC, sizeof(QC_RAW_MAGIC));
+        for(int i = 0; i < 4; ++i) header->sz[i] = sz[i];
+        header->datatype = datatype;
+        header->complete = 0;
+        buffer = base + QC_RAW_OFFSET;
+    }
+    /*
+     * Map an existing raw volume file, only if it was completely written.
+     * Read only mappings must not be written through buffer.
+     */
+    bool open(const QString& path, bool writable=false)
+    {
+        clear();
+        file = new QFile(path);
+        uchar* base = NULL;
+        if (file->open(writable ? QIODevice::ReadWrite : QIODevice::ReadOnly) &&
+                file->size() >= QC_RAW_OFFSET)
+            base = file->map(0, file->size());
+        auto header = (const QcRawHeader*)base;
+        if (base == NULL || memcmp(header->magic, QC_RAW_MAGIC, sizeof(QC_RAW_MAGIC)) != 0 ||
+                !header->complete || file->size() != QC_RAW_OFFSET + header->sz[0] * header->sz[1] *
+                header->sz[2] * header->sz[3] * qcTypeSize(header->datatype))
+        {
+            delete file;
+            file = NULL;
+            return false;
+        }
+        for(int i = 0; i < 4; ++i) sz[i] = header->sz[i];
+        datatype = header->datatype;
+        buffer = base + QC_RAW_OFFSET;
+        this->writable = writable;
+        return true;
+    }
+    // mark a mapped volume as completely written, so it can be opened later
+    // written through the file rather than the mapping to update its modification time.
+    void markComplete()
+    {
+        if (file != NULL && writable)
+        {
+            qint32 complete = 1;
+            file->seek(offsetof(QcRawHeader, complete));
+            file->write((const char*)&complete, sizeof(complete));
+            file->flush();
+        }
+    }
+    // account for the heap buffer, also for buffers allocated by loader callbacks
+    void trackBuffer()
     {
+        if (buffer == NULL || file != NULL || heapBytes > 0) return;
+        heapBytes = sz[0] * sz[1] * sz[2] * sz[3] * qcTypeSize(datatype);
+        qcTrackImageBytes(heapBytes);
+    }
+    bool isMapped() const { return file != NULL; }
+    bool isWritable() const { return writable; }
+    void clear() // releases the buffer, keeps the backing file setting
+    {
+        if (file != NULL)
+        {
+            file->unmap(buffer - QC_RAW_OFFSET);
+            delete file;
+            file = NULL;
+            buffer = NULL;
+        }
         if (buffer != NULL)
         {
             delete [] buffer;
             buffer = NULL;
+            qcTrackImageBytes(-heapBytes);
+            heapBytes = 0;
         }
-        for(int i = 0; i < 4; ++i) sz[i] = 0;sizeof(QcImage);
+        for(int i = 0; i < 4; ++i) sz[i] = 0;
         datatype = V3D_UNKNOWN;
+        writable = true;
     }
     // pointer to image
     uchar* buffer;
@@ -57,6 +172,57 @@ struct QcImage
     V3DLONG sz[4];
     // pixel type
     int datatype;
+    // mapped raw volume file, NULL for heap buffers
+    QFile* file;
+    QString backing;
+    bool writable;
+    // bytes of the heap buffer accounted for
+    qint64 heapBytes;
+};
+
+// 3D box in voxels, from start (inclusive) to end (exclusive) in x, y, z
+struct QcRoi
+{
+    QcRoi()
+    {
+        for(int i = 0; i < 3; ++i) start[i] = end[i] = 0;
+    }
+    QcRoi(V3DLONG x0, V3DLONG y0, V3DLONG z0, V3DLONG x1, V3DLONG y1, V3DLONG z1)
+    {
+        start[0] = x0; start[1] = y0; start[2] = z0;
+        end[0] = x1; end[1] = y1; end[2] = z1;
+    }
+    V3DLONG size(int i) const
+    {
+        return end[i] > start[i] ? end[i] - start[i] : 0;
+    }
+    bool isEmpty() const
+    {
+        return size(0) == 0 || size(1) == 0 || size(2) == 0;
+    }
+    // the box in coordinates starting from origin
+    QcRoi relativeTo(const V3DLONG origin[3]) const
+    {
+        QcRoi roi;
+        for(int i = 0; i < 3; ++i)
+        {
+            roi.start[i] = start[i] - origin[i];
+            roi.end[i] = end[i] - origin[i];
+        }
+        return roi;
+    }
+    QcRoi intersected(const QcRoi& other) const
+    {
+        QcRoi roi;
+        for(int i = 0; i < 3; ++i)
+        {
+            roi.start[i] = qMax(start[i], other.start[i]);
+            roi.end[i] = qMax(roi.start[i], qMin(end[i], other.end[i]));
+        }
+        return roi;
+    }
+    V3DLONG start[3];
+    V3DLONG end[3];
 };
 
 #endif // TERAQCTYPES_H
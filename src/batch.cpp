@@ -0,0 +1,244 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "batch.h"
+#include "teraPyramid.h"
+#include "onePot.h"
+#include "parallelUtils.h"
+#include <iostream>
+#include <algorithm>
+#include <mutex>
+
+using namespace std;
+
+/*
+ * Find the brains of a batch
+ *
+ * path: a brain directory, a directory of brain directories, or a text file
+ * listing brain directories one per line, relative to the file or absolute.
+ * Empty lines & lines starting with # in the list are ignored.
+ *
+ */
+
+bool listBrains(const QString& path, QStringList& brains)
+{
+    brains.clear();
+    QFileInfo info(path);
+    if (info.isFile())
+    {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        {
+            cerr << "ERROR: Failed to read " << path.toStdString() << endl;
+            return false;
+        }
+        QTextStream in(&file);
+        auto base = QDir(info.absolutePath());
+        while (!in.atEnd())
+        {
+            auto line = in.readLine().trimmed();
+            if (line.isEmpty() || line.startsWith('#')) continue;
+            brains.append(QDir::cleanPath(base.absoluteFilePath(line)));
+        }
+    }
+    else if (info.isDir() && TeraPyramid::isPyramid(path))
+        brains.append(QDir(path).absolutePath());
+    else if (info.isDir())
+    {
+        auto dir = QDir(path);
+        auto subdirs = dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
+        for (int i = 0; i < subdirs.size(); ++i)
+            if (TeraPyramid::isPyramid(dir.filePath(subdirs.at(i))))
+                brains.append(dir.absoluteFilePath(subdirs.at(i)));
+    }
+    if (brains.isEmpty())
+    {
+        cerr << "ERROR: No brain directory found in " << path.toStdString() << endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Run the one-pot QC on many brains in one process
+ *
+ * Brains are taken by a fixed number of workers, the largest (by voxels of
+ * the QC level) first, so a big brain doesn't start last & hold up the end
+ * of the batch. The core budget is split evenly between the workers for
+ * detection, while each brain also gets its own loading threads, which
+ * mostly wait on the disk & are not counted in the budget. This way one
+ * brain's loading overlaps another's detection. The tile cache & the
+ * manifest cache (manifestDir) are shared across the batch. A failed brain
+ * is recorded & doesn't stop the others. The results of a brain are saved
+ * as soon as it's done, prefixed by outPrefix & its name, see writeOnePot.
+ * Brains of the same name also get a hash of their path in the prefix, so
+ * they don't overwrite each other's results.
+ *
+ * Params (besides those of runOnePot):
+ *
+ * jobs: number of brains processed at a time, 2 by default;
+ *
+ * threads: cores for detection over all the brains, all cores by default;
+ *
+ * loadThreads: loading threads of each brain, 1 by default. The workers
+ * call the loader concurrently only if it's declared reentrant by
+ * loadThreads > 1, e.g. loadTiff of the command line tool; otherwise, as
+ * for the Vaa3D callbacks, a block is loaded at a time over the batch;
+ *
+ * level & sampleLevel: levels of each brain to run the QC on & to sample,
+ * the coarsest & the finest by default;
+ *
+ * datatype: pixel type of the brains;
+ *
+ * resume: y to skip the brains whose report is already saved, n by default.
+ *
+ * Output: a job per brain, in the order of brains.
+ *
+ */
+
+bool runBatch(const QStringList& brains, const QString& outPrefix, const QcIO& io, const QVariantMap& params,
+              QVector<QcBatchJob>& jobs, TileCache* cache)
+{
+    jobs.clear();
+    auto n = brains.size();
+    if (n == 0)
+    {
+        cerr << "ERROR: No brain to run." << endl;
+        return false;
+    }
+    jobs.resize(n);
+    auto workers = qBound(1, params.value("jobs", 2).toInt(), n);
+    auto brainParams = params;
+    brainParams["threads"] = qMax(1, threadCount(params) / workers);
+    brainParams["loadThreads"] = qMax(1, params.value("loadThreads", 1).toInt());
+    auto datatype = params.value("datatype", V3D_UINT16).toInt();
+    auto sampleLevel = params.value("sampleLevel", 0).toInt();
+    auto resume = params.value("resume", "n").toString().toLower().startsWith("y");
+
+    // the saver of a callback isn't assumed reentrant, nor the loaders unless loadThreads > 1
+    mutex loadMutex, saveMutex, logMutex;
+    auto loader = io.loader;
+    auto planes = io.planeLoader;
+    if (workers > 1 && brainParams["loadThreads"].toInt() == 1)
+    {
+        loader = [&](const char* path, QcImage& output) -> bool {
+            lock_guard<mutex> lk(loadMutex);
+            return io.loader(path, output);
+        };
+        if (planes)
+            planes = [&](const char* path, V3DLONG z0, V3DLONG z1, QcImage& output) -> bool {
+                lock_guard<mutex> lk(loadMutex);
+                return io.planeLoader(path, z0, z1, output);
+            };
+    }
+
+    // brains are only listed here, nothing is read until they run
+    QScopedArrayPointer<TeraPyramid> pyramids(new TeraPyramid[n]);
+    QVector<int> levels(n, -1);
+    QVector<qint64> voxels(n, 0);
+    QHash<QString, int> names;
+    for (int i = 0; i < n; ++i)
+        ++names[QDir(brains.at(i)).dirName()];
+    QSet<QString> prefixes;
+    for (int i = 0; i < n; ++i)
+    {
+        auto& job = jobs[i];
+        job.path = brains.at(i);
+        auto& pyramid = pyramids[i];
+        pyramid.setCache(cache);
+        if (!pyramid.open(job.path, loader, datatype, brainParams))
+        {
+            job.error = "Not a teraconvert brain directory.";
+            continue;
+        }
+        if (planes)
+            pyramid.setPlaneLoader(planes);
+        levels[i] = params.value("level", pyramid.coarsest()).toInt();
+        if (levels[i] < 0 || levels[i] > pyramid.coarsest())
+        {
+            job.error = "Illegal level.";
+            continue;
+        }
+        const auto& sz = pyramid.level(levels[i]).sz;
+        voxels[i] = sz[0] * sz[1] * sz[2];
+        // brains of the same name in different dirs are told apart by a hash of their path,
+        // which stays the same over runs to resume
+        auto name = QDir(job.path).dirName();
+        if (names.value(name) > 1)
+            name += '_' + QString(QCryptographicHash::hash(QDir(job.path).absolutePath().toUtf8(),
+                                                           QCryptographicHash::Md5).toHex().left(8));
+        job.prefix = outPrefix + name + '_' + QDir(pyramid.level(levels[i]).path).dirName();
+        if (prefixes.contains(job.prefix))
+        {
+            job.error = "Listed more than once.";
+            continue;
+        }
+        prefixes.insert(job.prefix);
+    }
+    QVector<int> order(n);
+    for (int i = 0; i < n; ++i) order[i] = i;
+    stable_sort(order.begin(), order.end(), [&](int a, int b) { return voxels[a] > voxels[b]; });
+
+    int finished = 0;
+    parallelFor(0, n, workers, [&](V3DLONG k) {
+        auto i = order[k];
+        auto& job = jobs[i];
+        QElapsedTimer timer;
+        timer.start();
+        // brains failed to open already have their error
+        if (job.error.isEmpty() && resume && QFileInfo(job.prefix + "_qc.csv").isFile())
+            job.ok = job.skipped = true;
+        else if (job.error.isEmpty())
+        {
+            QcOnePotResult result;
+            if (!runOnePot(pyramids[i], levels[i], sampleLevel, brainParams, result))
+                job.error = "The one-pot pipeline failed.";
+            else
+            {
+                lock_guard<mutex> lk(saveMutex);
+                if (writeOnePot(job.prefix, result, io.saver))
+                    job.ok = true;
+                else
+                    job.error = "Saving failed.";
+            }
+            job.report = result.report;
+        }
+        job.ms = timer.elapsed();
+
+        lock_guard<mutex> lk(logMutex);
+        cout << "\t[" << ++finished << "/" << n << "] " << QDir(job.path).dirName().toStdString() << ": ";
+        if (job.skipped)
+            cout << "skipped, already done." << endl;
+        else if (job.ok)
+            cout << "done in " << job.ms / 1000.0 << " s." << endl;
+        else
+            cout << job.error.toStdString() << endl;
+    });
+    return true;
+}
+
+// save the outcome of a batch as csv, a row per brain
+bool writeBatchReport(const QString& path, const QVector<QcBatchJob>& jobs)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+        cerr << "ERROR: Failed to write " << path.toStdString() << endl;
+        return false;
+    }
+    QTextStream out(&file);
+    out << "brain,status,ms,regions,peaks,samples,p50,p99,snr,markerVoxels,prefix,error\n";
+    for (int i = 0; i < jobs.size(); ++i)
+    {
+        const auto& job = jobs.at(i);
+        const auto& r = job.report;
+        out << job.path << ',' << (job.skipped ? "skipped" : job.ok ? "ok" : "failed") << ',' << job.ms << ','
+            << r.value("regions").toString() << ',' << r.value("peaks").toString() << ','
+            << r.value("samples").toString() << ',' << r.value("p50").toString() << ','
+            << r.value("p99").toString() << ',' << r.value("snr").toString() << ','
+            << r.value("markerVoxels").toString() << ',' << job.prefix << ',' << job.error << '\n';
+    }
+    return true;
+}
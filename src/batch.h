@@ -0,0 +1,34 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "qcBasic.h"
+#include "TeraQCTypes.h"
+#include "loadUtils.h"
+#include "tileCache.h"
+
+// a brain of a batch & how its QC went
+struct QcBatchJob
+{
+    QcBatchJob(): ok(false), skipped(false), ms(0) {}
+    // brain directory & the prefix of its results
+    QString path, prefix;
+    bool ok, skipped;
+    QString error;
+    qint64 ms;
+    // the one-pot report, see runOnePot
+    QVariantMap report;
+};
+
+bool listBrains(const QString& path, QStringList& brains);
+
+bool runBatch(const QStringList& brains, const QString& outPrefix, const QcIO& io, const QVariantMap& params,
+              QVector<QcBatchJob>& jobs, TileCache* cache=NULL);
+
+bool writeBatchReport(const QString& path, const QVector<QcBatchJob>& jobs);
+
+#endif // BATCH_H
@@ -0,0 +1,505 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "benchmark.h"
+#include "preprocessing.h"
+#include "histogram.h"
+#include "parallelUtils.h"
+#include "teraPyramid.h"
+#include "imageView.h"
+#include "opencv2/opencv.hpp"
+#include <QElapsedTimer>
+#include <iostream>
+#include "trace.h"
+#include <cmath>
+
+using namespace std;
+using namespace cv;
+
+/*
+ * Reference 16bit canny, a scalar implementation of Canny16bit
+ *
+ * Kept to measure the speedup of Canny16bit and to check its edge maps.
+ * Each pixel branches on the sector of its gradient phase, folded into
+ * [-pi/2, pi/2) as the suppression is symmetric to the opposite direction,
+ * and weighs its neighbours by tan(phase - sector start) worked out from
+ * dx & dy, the same float arithmetic as Canny16bit, so the edge maps must
+ * be equal. Strong pixels are linked by a breadth-first search.
+ *
+ */
+static void Canny16bitReference(InputArray in, OutputArray edges, double threshold1, double threshold2)
+{
+    assert(threshold1 < threshold2 && threshold1 >= 0 && threshold2 <= 1);
+    int di[5] = {1, 1, 0,-1,-1};
+    int dj[5] = {0,-1,-1,-1, 0};
+    Mat dx, dy, mag;
+    Sobel(in, dx, CV_32F, 1, 0);
+    Sobel(in, dy, CV_32F, 0, 1);
+    magnitude(dx, dy, mag);
+    double min, max;
+    minMaxLoc(mag, &min, &max);
+    auto low = float(max * threshold1);
+    auto high = float(max * threshold2);
+    // NMS
+    Mat nms = mag.clone();
+    for (int i = 1; i < mag.rows - 1; ++i)
+    {
+        for (int j = 1; j < mag.cols - 1; ++j)
+        {
+            auto g = mag.at<float>(i, j);
+            if (g == 0.0f) continue;
+            float x = dx.at<float>(i, j), y = dy.at<float>(i, j);
+            auto t = atan2(double(y), double(x));
+            // fold into [-pi/2, pi/2)
+            if (t >= CV_PI/2)
+            {
+                t -= CV_PI;
+                x = -x;
+                y = -y;
+            }
+            else if (t < -CV_PI/2)
+            {
+                t += CV_PI;
+                x = -x;
+                y = -y;
+            }
+            int ind;
+            float k;
+            if (t < -CV_PI/4)
+            {
+                // tan(t + pi/2)
+                k = -x / y;
+                ind = 0;
+            }
+            else if (t < 0)
+            {
+                // tan(t + pi/4)
+                k = (y + x) / (x - y);
+                ind = 1;
+            }
+            else if (t < CV_PI/4)
+            {
+                k = y / x;
+                ind = 2;
+            }
+            else
+            {
+                // tan(t - pi/4)
+                k = (y - x) / (x + y);
+                ind = 3;
+            }
+            auto g0u = mag.at<float>(i+di[ind+1], j+dj[ind+1]);
+            auto g0d = mag.at<float>(i+di[ind], j+dj[ind]);
+            auto g1u = mag.at<float>(i-di[ind+1], j-dj[ind+1]);
+            auto g1d = mag.at<float>(i-di[ind], j-dj[ind]);
+            float g0 = k * (g0u - g0d) + g0d;
+            float g1 = k * (g1u - g1d) + g1d;
+            if (g <= g0 || g <= g1) nms.at<float>(i, j) = 0.0f;
+        }
+    }
+
+    // double threshold
+    QQueue<QPoint> q;
+    for (int i = 0; i < nms.rows; ++i)
+    {
+        for (int j = 0; j < nms.cols; ++j)
+        {
+            auto& x = nms.ptr<float>(i)[j];
+            if (x > high)
+            {
+                x = FLT_MAX;
+                // seeds, x as the column & y as the row
+                q.enqueue(QPoint(j, i));
+            }
+            if (x < low)
+                x = 0.0f;
+        }
+    }
+
+    // linking
+    while (!q.isEmpty())
+    {
+        auto h = q.dequeue();
+        for (int m = -1; m <= 1; ++m)
+            for (int n = -1; n <= 1; ++n)
+            {
+                auto i = h.y() + m;
+                auto j = h.x() + n;
+                if (i < 0 || i >= nms.rows || j < 0 || j >= nms.cols) continue;
+                auto& x = nms.ptr<float>(i)[j];
+                if (x == FLT_MAX || x == 0.0f) continue;
+                x = FLT_MAX;
+                q.enqueue(QPoint(j, i));
+            }
+    }
+
+    // clearing
+    for (int i = 0; i < nms.rows; ++i)
+        for (int j = 0; j < nms.cols; ++j)
+        {
+            auto& x = nms.ptr<float>(i)[j];
+            if (x < FLT_MAX) x = 0.0f;
+        }
+
+    convertScaleAbs(nms, edges, UCHAR_MAX / FLT_MAX);
+}
+
+
+// synthetic 16bit slice, noise with some bright lines and blobs
+static Mat syntheticSlice(int size, int seed)
+{
+    RNG rng(seed);
+    Mat slice(size, size, CV_16U);
+    rng.fill(slice, RNG::NORMAL, 1000, 200);
+    for (int i = 0; i < 20; ++i)
+    {
+        Point p1(rng.uniform(0, size), rng.uniform(0, size));
+        Point p2(rng.uniform(0, size), rng.uniform(0, size));
+        line(slice, p1, p2, Scalar(rng.uniform(3000, 20000)), rng.uniform(1, 4));
+        circle(slice, p1, rng.uniform(2, 10), Scalar(rng.uniform(3000, 20000)), -1);
+    }
+    GaussianBlur(slice, slice, Size(5, 5), 1.0);
+    return slice;
+}
+
+// best wall time of repeated runs in ms
+template <class Func>
+static double bestTime(int repeat, const Func& func)
+{
+    double best = 0;
+    for (int i = 0; i < repeat; ++i)
+    {
+        QElapsedTimer timer;
+        timer.start();
+        func();
+        auto t = timer.nsecsElapsed() / 1e6;
+        if (i == 0 || t < best) best = t;
+    }
+    return best;
+}
+
+/*
+ * Micro-benchmark of Canny16bit against its reference implementation
+ *
+ * Params:
+ *
+ * benchSize: width & height of the synthetic slice;
+ *
+ * benchRepeat: number of runs, the best time is reported;
+ *
+ * seed: seed of the synthetic slice;
+ *
+ * cannyMin & cannyMax: canny thresholds.
+ *
+ * Report: referenceMs, cannyMs, speedup, cannyMismatch (edge pixels that differ,
+ * the benchmark fails unless it's 0)
+ *
+ */
+
+bool benchmarkCanny(const QVariantMap& params, QVariantMap& report)
+{
+    try
+    {
+        auto size = params.value("benchSize", 2048).toInt();
+        auto repeat = params.value("benchRepeat", 5).toInt();
+        auto cannyMin = params.value("cannyMin", 0.05).toDouble();
+        auto cannyMax = params.value("cannyMax", 0.15).toDouble();
+        auto slice = syntheticSlice(size, params.value("seed", 0).toInt());
+
+        Mat ref, edges;
+        auto referenceMs = bestTime(repeat, [&]() { Canny16bitReference(slice, ref, cannyMin, cannyMax); });
+        auto cannyMs = bestTime(repeat, [&]() { Canny16bit(slice, edges, cannyMin, cannyMax); });
+
+        Mat diff;
+        compare(ref, edges, diff, CMP_NE);
+        report["referenceMs"] = referenceMs;
+        report["cannyMs"] = cannyMs;
+        report["speedup"] = referenceMs / cannyMs;
+        auto mismatch = countNonZero(diff);
+        report["cannyMismatch"] = mismatch;
+        if (mismatch != 0)
+        {
+            cerr << "ERROR: Canny16bit differs from the reference in " << mismatch << " pixels." << endl;
+            return false;
+        }
+        return true;
+    }
+    catch (...)
+    {
+        cerr << "ERROR: Unkown exception, probably related to OPENCV functions." << endl;
+        return false;
+    }
+}
+
+/*
+ * Micro-benchmark of the histogram engine
+ *
+ * A synthetic 16bit volume, mostly flat background with noisy patches &
+ * sparse bright voxels, is counted by a plain single histogram loop & by
+ * computeHistogram, and copied by memcpy as the memory bandwidth reference.
+ *
+ * Params:
+ *
+ * benchSize & benchDepth: width & height, and depth of the volume;
+ *
+ * benchRepeat: number of runs, the best time is reported;
+ *
+ * seed: seed of the synthetic volume;
+ *
+ * threads: number of threads of computeHistogram.
+ *
+ * Report: naiveGBps, histogramGBps, memcpyGBps (bytes of the volume per second), histogramMismatch
+ * (bins that differ, the benchmark fails unless it's 0)
+ *
+ */
+
+bool benchmarkHistogram(const QVariantMap& params, QVariantMap& report)
+{
+    try
+    {
+        auto size = params.value("benchSize", 1024).toLongLong();
+        auto depth = params.value("benchDepth", 64).toLongLong();
+        auto repeat = params.value("benchRepeat", 5).toInt();
+        auto threads = threadCount(params);
+        V3DLONG sz[4] = {size, size, depth, 1};
+        QcImage img;
+        img.create(sz, V3D_UINT16);
+        auto data = (v3d_uint16*)img.buffer;
+        qint64 n = sz[0] * sz[1] * sz[2];
+        RNG rng(params.value("seed", 0).toInt());
+        for (qint64 i = 0; i < n; ++i)
+        {
+            auto patch = (i >> 12) % 8 == 0;
+            data[i] = v3d_uint16(patch ? 100 + rng.uniform(0, 50) : 120);
+            if (rng.uniform(0, 1000) == 0) data[i] = v3d_uint16(rng.uniform(1000, 30000));
+        }
+
+        vector<qint64> naive(65536);
+        auto naiveMs = bestTime(repeat, [&]() {
+            fill(naive.begin(), naive.end(), 0);
+            for (qint64 i = 0; i < n; ++i)
+                ++naive[data[i]];
+        });
+        auto hist = QcHistogram::forType(V3D_UINT16);
+        auto histMs = bestTime(repeat, [&]() {
+            hist.reset();
+            computeHistogram(img, hist, NULL, true, threads);
+        });
+        vector<char> copy(n * sizeof(v3d_uint16));
+        auto copyMs = bestTime(repeat, [&]() { memcpy(copy.data(), img.buffer, copy.size()); });
+
+        auto mismatch = 0;
+        for (int i = 0; i < 65536; ++i)
+            mismatch += naive[i] != hist.counts[i];
+        auto gbps = [&](double ms) { return n * sizeof(v3d_uint16) / ms / 1e6; };
+        report["naiveGBps"] = gbps(naiveMs);
+        report["histogramGBps"] = gbps(histMs);
+        report["memcpyGBps"] = gbps(copyMs);
+        report["histogramMismatch"] = mismatch;
+        if (mismatch != 0)
+        {
+            cerr << "ERROR: computeHistogram differs from the plain loop in " << mismatch << " bins." << endl;
+            return false;
+        }
+        return true;
+    }
+    catch (...)
+    {
+        cerr << "ERROR: Unkown exception in the histogram benchmark." << endl;
+        return false;
+    }
+}
+
+/*
+ * Benchmark of the pipeline stages on a level of a teraconvert brain
+ *
+ * Each stage is run with each thread count: loadTeraconvert (loadThreads,
+ * only if the loader is declared reentrant by loadThreads > 1, 1 otherwise),
+ * findMarkers & maxProjection8bit (threads), and Canny16bit on the middle
+ * plane (by the OpenCV threads of its filters). The best of the repeated
+ * runs is kept, so loading is timed with the blocks in the page cache after
+ * the first run. The manifest is cached as usual, so scanning & probing the
+ * blocks only count in the first run. Feed it a synthetic brain (see
+ * writeSynthetic) for numbers comparable between changes.
+ *
+ * Params:
+ *
+ * level: level of the brain, the coarsest by default;
+ *
+ * datatype: pixel type of the brain;
+ *
+ * benchThreads: thread counts separated by commas, 1 & all cores by default;
+ *
+ * benchRepeat: number of runs, the best time is reported, 3 by default;
+ *
+ * and the params of the stages.
+ *
+ * Report: level, size, voxels, bytes, peakRssMB & stages, a list of runs with
+ * stage, threads, ms, voxelsPerSec, MBps, speedup (to the first thread count)
+ * & peakRssMB (of the process so far).
+ *
+ */
+
+bool benchmarkStages(const QString& brain, const Loader& loader, const QVariantMap& params, QVariantMap& report)
+{
+    auto cvThreads = getNumThreads();
+    try
+    {
+        auto datatype = params.value("datatype", V3D_UINT16).toInt();
+        TeraPyramid pyramid;
+        if (!pyramid.open(brain, loader, datatype, params))
+            throw runtime_error("Not a teraconvert brain directory.");
+        auto level = params.value("level", pyramid.coarsest()).toInt();
+        if (level < 0 || level > pyramid.coarsest())
+            throw runtime_error("Illegal level.");
+        auto path = pyramid.level(level).path;
+        auto repeat = qMax(1, params.value("benchRepeat", 3).toInt());
+        QList<int> threadList;
+        auto items = params.value("benchThreads", QString("1,%1").arg(QThread::idealThreadCount())).toString().split(',');
+        for (int i = 0; i < items.size(); ++i)
+        {
+            auto t = items.at(i).trimmed().toInt();
+            if (t > 0 && !threadList.contains(t)) threadList.append(t);
+        }
+        if (threadList.isEmpty())
+            throw invalid_argument("Illegal benchThreads.");
+
+        QVariantList stages;
+        QMap<QString, double> firstMs;
+        auto record = [&](const QString& stage, int threads, double ms, qint64 voxels, qint64 bytes) {
+            if (!firstMs.contains(stage)) firstMs[stage] = ms;
+            QVariantMap run;
+            run["stage"] = stage;
+            run["threads"] = threads;
+            run["ms"] = ms;
+            run["voxelsPerSec"] = voxels / ms * 1e3;
+            run["MBps"] = bytes / ms / 1e3;
+            run["speedup"] = firstMs[stage] / ms;
+            run["peakRssMB"] = qcPeakRssMB();
+            stages.append(run);
+            cout << "\t" << stage.toStdString() << ", " << threads << " threads: " << ms << " ms, "
+                 << bytes / ms / 1e3 << " MB/s" << endl;
+        };
+
+        // the loader only runs on several threads if it's said to be reentrant, see Loader
+        auto reentrant = params.value("loadThreads", 1).toInt() > 1;
+        auto stageParams = params;
+        QcImage img, proj;
+        QcMask mask;
+        Mat edges;
+        for (int i = 0; i < threadList.size(); ++i)
+        {
+            auto threads = threadList.at(i);
+            stageParams["threads"] = threads;
+            auto loadThreads = reentrant ? threads : 1;
+            stageParams["loadThreads"] = loadThreads;
+            setNumThreads(threads);
+
+            auto loadMs = bestTime(repeat, [&]() {
+                if (!loadTeraconvert(path, img, loader, datatype, stageParams))
+                    throw runtime_error("Loading failed.");
+            });
+            qint64 voxels = img.sz[0] * img.sz[1] * img.sz[2];
+            qint64 bytes = voxels * qcTypeSize(img.datatype);
+            record("loadTeraconvert", loadThreads, loadMs, voxels, bytes);
+
+            auto markerMs = bestTime(repeat, [&]() {
+                if (!findMarkers(img, mask, stageParams))
+                    throw runtime_error("Finding markers failed.");
+            });
+            record("findMarkers", threads, markerMs, voxels, bytes);
+
+            auto projMs = bestTime(repeat, [&]() {
+                if (!maxProjection8bit(img, proj, threads))
+                    throw runtime_error("Projection failed.");
+            });
+            record("maxProjection8bit", threads, projMs, voxels, bytes);
+
+            auto plane = qcPlane(img, img.sz[2] / 2);
+            auto cannyMs = bestTime(repeat, [&]() {
+                Canny16bit(plane, edges, params.value("cannyMin", 0.05).toDouble(),
+                           params.value("cannyMax", 0.15).toDouble());
+            });
+            record("Canny16bit", threads, cannyMs, qint64(plane.total()), qint64(plane.total() * plane.elemSize()));
+        }
+        setNumThreads(cvThreads);
+
+        report["level"] = level;
+        report["size"] = QString("%1,%2,%3").arg(img.sz[0]).arg(img.sz[1]).arg(img.sz[2]);
+        report["voxels"] = qint64(img.sz[0] * img.sz[1] * img.sz[2]);
+        report["bytes"] = qint64(img.sz[0] * img.sz[1] * img.sz[2] * qcTypeSize(img.datatype));
+        report["stages"] = stages;
+        report["markerVoxels"] = mask.count();
+        report["maskBytes"] = mask.bytes();
+        report["peakRssMB"] = qcPeakRssMB();
+        return true;
+    }
+    catch (exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        setNumThreads(cvThreads);
+        return false;
+    }
+}
+
+// json text of a value, maps as objects & lists as arrays
+static QString jsonValue(const QVariant& value)
+{
+    switch (int(value.type()))
+    {
+    case QVariant::Map:
+    {
+        auto map = value.toMap();
+        QStringList items;
+        for (auto it = map.constBegin(); it != map.constEnd(); ++it)
+            items << jsonValue(it.key()) + ": " + jsonValue(it.value());
+        return '{' + items.join(", ") + '}';
+    }
+    case QVariant::List:
+    case QVariant::StringList:
+    {
+        auto list = value.toList();
+        QStringList items;
+        for (int i = 0; i < list.size(); ++i)
+            items << jsonValue(list.at(i));
+        return '[' + items.join(", ") + ']';
+    }
+    case QVariant::Bool:
+        return value.toBool() ? "true" : "false";
+    case QVariant::Int:
+    case QVariant::UInt:
+    case QVariant::LongLong:
+    case QVariant::ULongLong:
+        return value.toString();
+    case QVariant::Double:
+    case QMetaType::Float:
+    {
+        auto d = value.toDouble();
+        return (std::isnan(d) || std::isinf(d)) ? QString("null") : QString::number(d, 'g', 10);
+    }
+    case QVariant::Invalid:
+        return "null";
+    default:
+    {
+        auto text = value.toString();
+        text.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n").replace('\t', "\\t");
+        return '"' + text + '"';
+    }
+    }
+}
+
+// save a benchmark report as json, to be tracked over time
+bool writeBenchmarkJson(const QString& path, const QVariantMap& report)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+        cerr << "ERROR: Failed to write " << path.toStdString() << endl;
+        return false;
+    }
+    QTextStream out(&file);
+    out << jsonValue(report) << '\n';
+    return true;
+}
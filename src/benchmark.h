@@ -0,0 +1,20 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "qcBasic.h"
+#include "loadUtils.h"
+
+bool benchmarkCanny(const QVariantMap& params, QVariantMap& report);
+
+bool benchmarkHistogram(const QVariantMap& params, QVariantMap& report);
+
+bool benchmarkStages(const QString& brain, const Loader& loader, const QVariantMap& params, QVariantMap& report);
+
+bool writeBenchmarkJson(const QString& path, const QVariantMap& report);
+
+#endif // BENCHMARK_H
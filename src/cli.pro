@@ -0,0 +1,21 @@
+# teraqc, the command line tool for headless nodes
+TEMPLATE = app
+CONFIG += console warn_on
+CONFIG -= app_bundle
+QT = core
+
+# only the settings of the core, its sources come from the library
+CORE_SOURCES = $$SOURCES
+CORE_HEADERS = $$HEADERS
+include(core.pri)
+SOURCES = $$CORE_SOURCES
+HEADERS = $$CORE_HEADERS
+
+SOURCES += teraqcMain.cpp
+
+LIBS = -L$$OUT_PWD/lib -lteraqc $$LIBS
+win32:PRE_TARGETDEPS += $$OUT_PWD/lib/teraqc.lib
+else:PRE_TARGETDEPS += $$OUT_PWD/lib/libteraqc.a
+
+TARGET = teraqc
+DESTDIR = $$OUT_PWD/bin
@@ -0,0 +1,635 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "commands.h"
+#include "teraManifest.h"
+#include "teraPyramid.h"
+#include "preprocessing.h"
+#include "roiSampling.h"
+#include "regions.h"
+#include "benchmark.h"
+#include "synthetic.h"
+#include "projection.h"
+#include "onePot.h"
+#include "batch.h"
+#include "slabWriter.h"
+#include "parallelUtils.h"
+#include "trace.h"
+#include <iostream>
+#include <mutex>
+
+using namespace std;
+
+QStringList commandList()
+{
+    return QStringList()
+            << "preprocess"
+            << "findLocalMaxima"
+            << "findRegions"
+            << "sample"
+            << "one-pot"
+            << "batch"
+            << "project"
+            << "synthesize"
+            << "benchmark"
+            << "help";
+}
+
+// usage of the commands, params are given as key value pairs
+QString commandHelp()
+{
+    return QString(
+        "Commands (input, output prefix, params):\n"
+        "  preprocess       image, brain or teraconvert dir; remove the markers, mode=default|onlyMarker|onlyRemove|validation,\n"
+        "                   outputFormat=tiff|teraconvert streams a brain dir, saving the volumes slab by slab\n"
+        "  findLocalMaxima  image, brain or teraconvert dir; save the peaks as csv, preprocessing=y|n\n"
+        "  findRegions      image, brain or teraconvert dir; save the strong signal regions as csv, preprocessing=y|n\n"
+        "  sample           brain dir; sample blocks of the regions at sampleLevel, saveBlocks=y|n\n"
+        "  one-pot          brain dir; stream a level through all the QC steps, saveMask=y|n saveRemoved=y|n,\n"
+        "                   histRange=lo,hi for float levels\n"
+        "  batch            dir of brains or a list file; run one-pot on each brain, jobs=2, resume=y|n,\n"
+        "                   brains load concurrently only with loadThreads > 1, for a reentrant loader\n"
+        "  project          image, brain or teraconvert dir; axis=xy,xz,yz op=max|min|mean slab=start,end\n"
+        "  synthesize       none, the output is the brain dir; write a synthetic teraconvert brain,\n"
+        "                   synthSize=x,y,z synthTile=x,y,z synthLevels markers somas seed\n"
+        "  benchmark        brain dir or none for a synthetic one; bench=all|canny|histogram|stages,\n"
+        "                   benchThreads=1,2,4 benchRepeat, the report is saved as json\n"
+        "  help             none; print this\n"
+        "Common params: threads, loadThreads, level, datatype, roi=x0,y0,z0,x1,y1,z1, cacheSize (MB), mmapDir,\n"
+        "               trace=y|<json file> to save a Chrome trace of the stages,\n"
+        "               outputFormat=tiff|teraconvert outputTile=x,y,z compression=none|lzw|deflate|packbits|zstd\n"
+        "               for the streamed volumes & masks, maskFormat=image|runs to save masks as .qcmask runs\n");
+}
+
+// plane loader of the I/O, adapted from the whole image loader if not given
+static PlaneLoader planesOf(const QcIO& io)
+{
+    return io.planeLoader ? io.planeLoader : planeLoader(io.loader);
+}
+
+// I/O recording the images loaded & saved in the trace
+static QcIO tracedIO(const QcIO& io)
+{
+    auto bytes = [](const QcImage& img) { return img.sz[0] * img.sz[1] * img.sz[2] * img.sz[3] * qcTypeSize(img.datatype); };
+    QcIO traced;
+    auto loader = io.loader;
+    traced.loader = [loader, bytes](const char* path, QcImage& img) -> bool {
+        QcTraceScope traceScope("load image");
+        if (!loader(path, img)) return false;
+        traceScope.addRead(bytes(img));
+        return true;
+    };
+    auto planes = io.planeLoader;
+    if (planes)
+        traced.planeLoader = [planes, bytes](const char* path, V3DLONG z0, V3DLONG z1, QcImage& img) -> bool {
+            QcTraceScope traceScope("load planes");
+            if (!planes(path, z0, z1, img)) return false;
+            traceScope.addRead(bytes(img));
+            return true;
+        };
+    auto saver = io.saver;
+    traced.saver = [saver, bytes](const char* path, const QcImage& img) -> bool {
+        QcTraceScope traceScope("save image");
+        traceScope.addWritten(bytes(img));
+        return saver(path, img);
+    };
+    return traced;
+}
+
+// marker masks are saved as runs with maskFormat=runs, as images otherwise
+static bool maskAsRuns(const QVariantMap& params)
+{
+    return params.value("maskFormat", "image").toString().toLower() == "runs";
+}
+
+// volumes of a level saved slab by slab by one-pot, the writers are kept alive with the sinks
+struct StreamedOutputs
+{
+    QSharedPointer<SlabWriter> mask, removed;
+    QcMask maskRuns;
+    QcOnePotSinks sinks;
+};
+
+// writers of the marker mask & the image without markers, named by prefix, see openSlabWriter
+static bool openStreamedOutputs(TeraPyramid& pyramid, int level, const QString& prefix, bool saveMask,
+                                bool saveRemoved, const QVariantMap& params, const Saver& saver,
+                                StreamedOutputs& outputs)
+{
+    TeraManifest manifest;
+    if (!pyramid.manifest(level, manifest))
+        return false;
+    V3DLONG sz[4] = {manifest.sz[0], manifest.sz[1], manifest.sz[2], qMax(V3DLONG(1), manifest.sz[3])};
+    if (saveMask && maskAsRuns(params))
+        outputs.sinks.maskRuns = &outputs.maskRuns;
+    else if (saveMask)
+    {
+        V3DLONG msz[4] = {sz[0], sz[1], sz[2], 1};
+        outputs.mask = openSlabWriter(prefix + "_mask", msz, V3D_UINT8, params, saver);
+        if (outputs.mask.isNull())
+            return false;
+        outputs.sinks.mask = outputs.mask.data();
+    }
+    if (saveRemoved)
+    {
+        outputs.removed = openSlabWriter(prefix + "_removed", sz, manifest.datatype, params, saver);
+        if (outputs.removed.isNull())
+            return false;
+        outputs.sinks.removed = outputs.removed.data();
+    }
+    return true;
+}
+
+// save what's kept whole after one-pot, the mask as runs
+static bool finishStreamedOutputs(const QString& prefix, const StreamedOutputs& outputs)
+{
+    return outputs.sinks.maskRuns == NULL || saveMask(prefix + "_mask.qcmask", outputs.maskRuns);
+}
+
+static bool execute(const QString& name, const QString& input, const QString& output, const QVariantMap& params,
+                    const QcIO& io, QcSession& session)
+{
+    const auto& loader = io.loader;
+    const auto& saver = io.saver;
+    auto& imgInput = session.imgInput;
+    auto& imgMarker = session.imgMarker;
+    auto& imgMasked = session.imgMasked;
+    auto& tileCache = session.tileCache;
+    auto path = input.toStdString();
+
+    // procedures
+    auto LOAD_IMAGE = [&]() {
+        auto info = QFileInfo(input);
+        if (info.isFile())
+        {
+            cout << "\tLoading image " << path << ".." << endl;
+            imgInput.clear();
+            if(!loader(path.c_str(), imgInput))
+                throw runtime_error("Loading failed.");
+            return info.baseName();
+        }
+        else if (info.isDir() && TeraPyramid::isPyramid(input))
+        {
+            // a brain directory, load the chosen level (coarsest by default)
+            TeraPyramid pyramid;
+            pyramid.setCache(&tileCache);
+            if (!pyramid.open(input, loader, params.value("datatype", V3D_UINT16).toInt(), params))
+                throw runtime_error("Loading failed.");
+            pyramid.setPlaneLoader(planesOf(io));
+            auto level = params.value("level", pyramid.coarsest()).toInt();
+            if (level < 0 || level > pyramid.coarsest())
+                throw runtime_error("Illegal level. Levels are numbered from 0 (finest) to the coarsest.");
+            cout << "\tLoading teraconverted images in " << pyramid.level(level).path.toStdString() << ".." << endl;
+            if (!pyramid.loadLevel(level, imgInput))
+                throw runtime_error("Loading failed.");
+            return QDir(input).dirName() + '_' + QDir(pyramid.level(level).path).dirName();
+        }
+        else if (info.isDir())
+        {
+            auto datatype = params.value("datatype", V3D_UINT16).toInt();
+            if (params.contains("roi"))
+            {
+                // x0,y0,z0,x1,y1,z1 in voxels of the resolution
+                auto box = params.value("roi").toString().split(',');
+                if (box.size() != 6)
+                    throw runtime_error("Illegal roi. It should be given as x0,y0,z0,x1,y1,z1.");
+                auto roi = QcRoi(box[0].toLongLong(), box[1].toLongLong(), box[2].toLongLong(),
+                                 box[3].toLongLong(), box[4].toLongLong(), box[5].toLongLong());
+                cout << "\tLoading the roi of teraconverted images in " << path << ".." << endl;
+                TeraManifest manifest;
+                if (!getTeraManifest(input, manifest, loader, datatype, params.value("manifestDir").toString(),
+                                     params.value("manifest", "y").toString().toLower().startsWith("y")) ||
+                    !loadTeraconvertRoi(manifest, roi, imgInput, planesOf(io), params.value("loadThreads", 1).toInt(),
+                                        &tileCache))
+                    throw runtime_error("Loading failed.");
+                cout << "\tTile cache: " << tileCache.hits() << " hits, " << tileCache.misses() << " misses, "
+                     << tileCache.evictions() << " evictions." << endl;
+                return QDir(input).dirName() + "_roi";
+            }
+            cout << "\tLoading teraconverted images in " << path << ".." << endl;
+            if (!loadTeraconvert(input, imgInput, loader, datatype, params))
+                throw runtime_error("Loading failed.");
+            return QDir(input).dirName();
+        } else
+            throw runtime_error("Illegal loading path. Neither an image nor teraconvert data.");
+    };
+
+    auto FIND_MARKERS = [&]() {
+        cout << "\tFinding markers.." << endl;
+        if(!findMarkers(imgInput, imgMarker, params))
+            throw runtime_error("Finding markers failed.");
+    };
+
+    auto SAVE_IMAGE = [&](const QcImage& img, const QString& path) {
+        cout << "\tSaving the mask to path " << path.toStdString() << endl;
+        if (!saver(path.toStdString().c_str(), img))
+            throw runtime_error("Saving failed");
+    };
+
+    auto SAVE_MASK = [&](const QcMask& mask, const QString& prefix) {
+        if (maskAsRuns(params))
+        {
+            cout << "\tSaving the mask to path " << prefix.toStdString() << ".qcmask" << endl;
+            if (!saveMask(prefix + ".qcmask", mask))
+                throw runtime_error("Saving failed");
+            return;
+        }
+        // expanded to 8bit a plane at a time, see openSlabWriter for the format
+        cout << "\tSaving the mask to path " << prefix.toStdString() << endl;
+        V3DLONG sz[4] = {mask.sz[0], mask.sz[1], mask.sz[2], 1};
+        auto writer = openSlabWriter(prefix, sz, V3D_UINT8, params, saver);
+        if (writer.isNull())
+            throw runtime_error("Saving failed");
+        QcImage plane;
+        for (V3DLONG z = 0; z < sz[2]; ++z)
+            if (!mask.toImage(plane, z, z + 1) || !writer->write(plane))
+                throw runtime_error("Saving failed");
+        if (!writer->finish())
+            throw runtime_error("Saving failed");
+    };
+
+    auto APPLY_MARKERS = [&](bool invert=true) {
+        cout << "\tRemove markers from the input image.." << endl;
+        if(!masking(imgInput, imgMasked, imgMarker, invert))
+            throw runtime_error("Removing markers failed.");
+    };
+
+    auto FIND_LOCAL_MAXIMA = [&](const QcImage& img, QVector<QcPeak>& peaks) {
+        cout << "\tFinding local maxima.." << endl;
+        if (!findLocalMaxima(img, peaks, params))
+            throw runtime_error("Finding local maxima failed.");
+        cout << "\t" << peaks.size() << " peaks found." << endl;
+    };
+
+    // tile cache size in MB
+    tileCache.setCapacity(params.value("cacheSize", 1024).toLongLong() << 20);
+    // back the intermediate volumes by memory mapped files to save RAM
+    auto mmapDir = params.value("mmapDir").toString();
+    auto backing = [&](const QString& file) {
+        return mmapDir.isEmpty() ? QString() : QDir(mmapDir).filePath(file);
+    };
+    imgMasked.setBacking(backing("masked.raw"));
+
+    // commands
+    try
+    {
+        if (name == "preprocess")
+        {
+            cout << "[TeraQC: Preprocessing]" << endl;
+            auto mode = params.value("mode", "default").toString();
+            /* mode
+             * default: output the mask & image wo mask
+             * onlyMarker: only the 8bit marker mask
+             * onlyRemove: only the image wo markers
+             * validation: same as default but also output 8bit xy projection to see the effect
+            */
+            if (params.contains("outputFormat") && QFileInfo(input).isDir() && TeraPyramid::isPyramid(input))
+            {
+                /* a level of a brain directory is streamed through marker removal, & the
+                 * volumes are saved slab by slab as tiff or teraconvert, see runOnePot
+                */
+                TeraPyramid pyramid;
+                pyramid.setCache(&tileCache);
+                if (!pyramid.open(input, loader, params.value("datatype", V3D_UINT16).toInt(), params))
+                    throw runtime_error("Loading failed.");
+                pyramid.setPlaneLoader(planesOf(io));
+                auto level = params.value("level", pyramid.coarsest()).toInt();
+                if (level < 0 || level > pyramid.coarsest())
+                    throw runtime_error("Illegal level. Levels are numbered from 0 (finest) to the coarsest.");
+                auto prefix = output + QDir(input).dirName() + '_' + QDir(pyramid.level(level).path).dirName();
+                StreamedOutputs outputs;
+                if (!openStreamedOutputs(pyramid, level, prefix, mode != "onlyRemove", mode != "onlyMarker",
+                                         params, saver, outputs))
+                    throw runtime_error("Failed to create the outputs.");
+                cout << "\tStreaming " << pyramid.level(level).path.toStdString() << " to "
+                     << prefix.toStdString() << "*.." << endl;
+                auto streamParams = params;
+                streamParams["analyze"] = "n";
+                QcOnePotResult result;
+                if (!runOnePot(pyramid, level, level, streamParams, result, outputs.sinks))
+                    throw runtime_error("Removing markers failed.");
+                if (!finishStreamedOutputs(prefix, outputs))
+                    throw runtime_error("Saving failed");
+                if (mode == "validation")
+                {
+                    SAVE_IMAGE(result.markerProj, prefix + "_marker_2d.tif");
+                    SAVE_IMAGE(result.removedProj, prefix + "_removed_2d.tif");
+                }
+                cout << "Done." << endl;
+                return true;
+            }
+            auto prefix = output + LOAD_IMAGE();
+            FIND_MARKERS();
+            if (mode != "onlyRemove")
+                SAVE_MASK(imgMarker, prefix + "_mask");
+            if (mode != "onlyMarker")
+            {
+                if (mode == "validation")
+                {
+                    // masking & both projections in one pass
+                    QcImage markerProj, removedProj;
+                    cout << "\tRemove markers from the input image & project.." << endl;
+                    if (!maskProject8bit(imgInput, imgMasked, imgMarker, markerProj, removedProj,
+                                         threadCount(params)))
+                        throw runtime_error("Something wrong with projection.");
+                    SAVE_IMAGE(markerProj, prefix + "_marker_2d.tif");
+                    SAVE_IMAGE(removedProj, prefix + "_removed_2d.tif");
+                }
+                else
+                    APPLY_MARKERS();
+                SAVE_IMAGE(imgMasked, prefix + "_removed.tif");
+            }
+            cout << "Done." << endl;
+        }
+        else if (name == "findLocalMaxima")
+        {
+            cout << "[TeraQC: Find Local Maxima]" << endl;
+            auto prefix = output + LOAD_IMAGE();
+            QcImage* pImg;
+            if (params.value("preprocessing", "y").toString().toLower().startsWith("y"))
+            {
+                FIND_MARKERS();
+                APPLY_MARKERS();
+                pImg = &imgMasked;
+            }
+            else pImg = &imgInput;
+            QVector<QcPeak> peaks;
+            FIND_LOCAL_MAXIMA(*pImg, peaks);
+            if (!writePeaks(prefix + "_maxima.csv", peaks))
+                throw runtime_error("Saving failed");
+            cout << "Done." << endl;
+        }
+        else if (name == "findRegions")
+        {
+            cout << "[TeraQC: Find Regions]" << endl;
+            auto prefix = output + LOAD_IMAGE();
+            QcImage* pImg;
+            if (params.value("preprocessing", "y").toString().toLower().startsWith("y"))
+            {
+                FIND_MARKERS();
+                APPLY_MARKERS();
+                pImg = &imgMasked;
+            }
+            else pImg = &imgInput;
+            cout << "\tExtracting strong signal regions.." << endl;
+            QVector<QcRegion> regions;
+            if (!findRegions(*pImg, regions, params))
+                throw runtime_error("Finding regions failed.");
+            cout << "\t" << regions.size() << " regions found." << endl;
+            if (!writeRegions(prefix + "_regions.csv", regions))
+                throw runtime_error("Saving failed");
+            cout << "Done." << endl;
+        }
+        else if (name == "sample")
+        {
+            /* regions are found at the loaded level (coarsest by default) of a brain directory,
+             * and blocks are sampled at sampleLevel (0, the finest, by default)
+            */
+            cout << "[TeraQC: Sample Blocks]" << endl;
+            TeraPyramid pyramid;
+            pyramid.setCache(&tileCache);
+            auto datatype = params.value("datatype", V3D_UINT16).toInt();
+            if (!QFileInfo(input).isDir() || !pyramid.open(input, loader, datatype, params))
+                throw runtime_error("Sampling needs a teraconvert brain directory.");
+            pyramid.setPlaneLoader(planesOf(io));
+            auto prefix = output + LOAD_IMAGE();
+            auto regionLevel = params.value("level", pyramid.coarsest()).toInt();
+            auto sampleLevel = params.value("sampleLevel", 0).toInt();
+            FIND_MARKERS();
+            APPLY_MARKERS();
+            cout << "\tExtracting strong signal regions.." << endl;
+            QVector<QcRegion> regions;
+            if (!findRegions(imgMasked, regions, params))
+                throw runtime_error("Finding regions failed.");
+            QVector<QcBlockSample> samples;
+            if (!planBlockSamples(pyramid, regions, regionLevel, sampleLevel, params, samples))
+                throw runtime_error("Planning samples failed.");
+            cout << "\tFetching " << samples.size() << " blocks from " << regions.size() << " regions.." << endl;
+            // a histogram per block, blocks are saved as well with saveBlocks=y
+            auto saveBlocks = params.value("saveBlocks", "n").toString().toLower().startsWith("y");
+            mutex saveMutex;
+            QVector<QcBlockStats> stats;
+            QVariantMap report;
+            BlockConsumer save;
+            if (saveBlocks)
+                save = [&](const QcBlockSample& sample, const QcImage& block) {
+                    lock_guard<mutex> lk(saveMutex);
+                    SAVE_IMAGE(block, prefix + QString("_r%1_b%2.tif").arg(sample.region).arg(sample.index));
+                };
+            if (!sampleBlockStats(pyramid, sampleLevel, samples, params.value("histBins", 0).toInt(),
+                                  threadCount(params), stats, &report, save))
+                throw runtime_error("Fetching samples failed.");
+            cout << "\t" << report["touchedTiles"].toInt() << " of " << report["tiles"].toInt()
+                 << " blocks touched." << endl;
+            if (!writeBlockStats(prefix + "_samples.csv", stats))
+                throw runtime_error("Saving failed");
+            cout << "Done." << endl;
+        }
+        else if (name == "one-pot")
+        {
+            /* the level (coarsest by default) of a brain directory is streamed through
+             * marker removal, region & local maxima finding, then blocks are sampled
+             * at sampleLevel (0, the finest, by default), see runOnePot
+            */
+            cout << "[TeraQC: One-pot]" << endl;
+            TeraPyramid pyramid;
+            pyramid.setCache(&tileCache);
+            auto datatype = params.value("datatype", V3D_UINT16).toInt();
+            if (!QFileInfo(input).isDir() || !pyramid.open(input, loader, datatype, params))
+                throw runtime_error("The one-pot pipeline needs a teraconvert brain directory.");
+            pyramid.setPlaneLoader(planesOf(io));
+            auto level = params.value("level", pyramid.coarsest()).toInt();
+            if (level < 0 || level > pyramid.coarsest())
+                throw runtime_error("Illegal level. Levels are numbered from 0 (finest) to the coarsest.");
+            auto prefix = output + QDir(input).dirName() + '_' +
+                    QDir(pyramid.level(level).path).dirName();
+            // the marker mask & the image without markers are saved as they're made if asked
+            StreamedOutputs outputs;
+            if (!openStreamedOutputs(pyramid, level, prefix,
+                                     params.value("saveMask", "n").toString().toLower().startsWith("y"),
+                                     params.value("saveRemoved", "n").toString().toLower().startsWith("y"),
+                                     params, saver, outputs))
+                throw runtime_error("Failed to create the outputs.");
+            cout << "\tStreaming " << pyramid.level(level).path.toStdString() << ".." << endl;
+            QcOnePotResult result;
+            if (!runOnePot(pyramid, level, params.value("sampleLevel", 0).toInt(), params, result, outputs.sinks))
+                throw runtime_error("The one-pot pipeline failed.");
+            if (!finishStreamedOutputs(prefix, outputs))
+                throw runtime_error("Saving failed");
+            cout << "\t" << result.regions.size() << " regions, " << result.peaks.size() << " peaks & "
+                 << result.samples.size() << " sampled blocks found." << endl;
+            cout << "\tSaving the results to " << prefix.toStdString() << "*" << endl;
+            if (!writeOnePot(prefix, result, saver))
+                throw runtime_error("Saving failed");
+            cout << "Done." << endl;
+        }
+        else if (name == "batch")
+        {
+            /* the input is a directory of brain directories or a list file of them,
+             * each brain is run by one-pot & saved with the output prefix, see runBatch
+            */
+            cout << "[TeraQC: Batch]" << endl;
+            QStringList brains;
+            if (!listBrains(input, brains))
+                throw runtime_error("Listing brains failed.");
+            cout << "\tRunning " << brains.size() << " brains.." << endl;
+            QVector<QcBatchJob> jobs;
+            if (!runBatch(brains, output, io, params, jobs, &tileCache))
+                throw runtime_error("The batch failed.");
+            auto failed = 0;
+            for (int i = 0; i < jobs.size(); ++i)
+                if (!jobs.at(i).ok) ++failed;
+            if (!writeBatchReport(output + QString("batch.csv"), jobs))
+                throw runtime_error("Saving failed");
+            cout << "\t" << jobs.size() - failed << " of " << jobs.size() << " brains done." << endl;
+            cout << "Done." << endl;
+        }
+        else if (name == "project")
+        {
+            /* params
+             * axis: xy, xz or yz, several ones separated by commas, xy by default
+             * op: max, min or mean, max by default
+             * slab: start,end along the projected axis, the whole axis by default
+            */
+            cout << "[TeraQC: Projection]" << endl;
+            auto prefix = output + LOAD_IMAGE();
+            auto axes = params.value("axis", "xy").toString().split(',');
+            auto op = params.value("op", "max").toString();
+            QVector<QcProjection> projections(axes.size());
+            for (int i = 0; i < axes.size(); ++i)
+                if (!parseProjection(axes.at(i), op, params.value("slab").toString(), projections[i]))
+                    throw runtime_error("Illegal projection. Check axis, op & slab.");
+            QScopedArrayPointer<QcImage> proj(new QcImage[axes.size()]);
+            cout << "\tProjecting.." << endl;
+            if (!project(imgInput, projections, proj.data(), threadCount(params)))
+                throw runtime_error("Projection failed.");
+            for (int i = 0; i < axes.size(); ++i)
+                SAVE_IMAGE(proj[i], prefix + '_' + axes.at(i) + '_' + op + ".tif");
+            cout << "Done." << endl;
+        }
+        else if (name == "synthesize")
+        {
+            // a reproducible teraconvert brain for tests & benchmarks, with its markers & somas listed
+            cout << "[TeraQC: Synthesize]" << endl;
+            QcSynthetic synth;
+            if (!makeSynthetic(params, synth))
+                throw runtime_error("Illegal synthetic brain.");
+            cout << "\tWriting a synthetic brain of " << synth.sz[0] << "x" << synth.sz[1] << "x" << synth.sz[2]
+                 << " voxels to " << output.toStdString() << ".." << endl;
+            QVariantMap report;
+            if (!writeSynthetic(output, synth, saver, threadCount(params), &report) ||
+                    !writeSyntheticTruth(QDir(output).filePath("synthetic.csv"), synth))
+                throw runtime_error("Saving failed");
+            cout << "\t" << report["tiles"].toInt() << " blocks written in " << report["ms"].toDouble() / 1000
+                 << " s." << endl;
+            cout << "Done." << endl;
+        }
+        else if (name == "benchmark")
+        {
+            cout << "[TeraQC: Benchmark]" << endl;
+            // canny, histogram, stages or all
+            auto bench = params.value("bench", "all").toString();
+            QVariantMap report;
+            report["bench"] = bench;
+            report["time"] = QDateTime::currentDateTime().toString(Qt::ISODate);
+            report["idealThreads"] = QThread::idealThreadCount();
+            report["qt"] = qVersion();
+            if (bench == "all" || bench == "canny")
+            {
+                if (!benchmarkCanny(params, report))
+                    throw runtime_error("Something wrong with the canny benchmark.");
+                cout << "\tCanny16bit: " << report["cannyMs"].toDouble() << " ms, reference: "
+                     << report["referenceMs"].toDouble() << " ms, speedup: " << report["speedup"].toDouble()
+                     << "x, mismatched edge pixels: " << report["cannyMismatch"].toInt() << endl;
+            }
+            if (bench == "all" || bench == "histogram")
+            {
+                if (!benchmarkHistogram(params, report))
+                    throw runtime_error("Something wrong with the histogram benchmark.");
+                cout << "\tHistogram: " << report["histogramGBps"].toDouble() << " GB/s, plain loop: "
+                     << report["naiveGBps"].toDouble() << " GB/s, memcpy: " << report["memcpyGBps"].toDouble()
+                     << " GB/s, mismatched bins: " << report["histogramMismatch"].toInt() << endl;
+            }
+            if (bench == "all" || bench == "stages")
+            {
+                // on a synthetic brain written beside the report if no brain is given
+                auto brain = input;
+                if (brain.isEmpty())
+                {
+                    brain = output + "synthetic";
+                    QcSynthetic synth;
+                    QVariantMap synthReport;
+                    cout << "\tWriting a synthetic brain to " << brain.toStdString() << ".." << endl;
+                    if (!makeSynthetic(params, synth) ||
+                            !writeSynthetic(brain, synth, saver, threadCount(params), &synthReport))
+                        throw runtime_error("Writing the synthetic brain failed.");
+                    report["synthetic"] = synthReport;
+                }
+                QVariantMap stages;
+                if (!benchmarkStages(brain, loader, params, stages))
+                    throw runtime_error("Something wrong with the stage benchmark.");
+                report["brain"] = brain;
+                report["pipeline"] = stages;
+            }
+            if (!writeBenchmarkJson(output + "benchmark.json", report))
+                throw runtime_error("Saving failed");
+            cout << "Done." << endl;
+        }
+        else if (name == "help")
+            cout << commandHelp().toStdString();
+        else
+            throw invalid_argument(("Unknown command " + name + ". See help.").toStdString());
+        return true;
+    }
+    catch(exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        return false;
+    }
+}
+
+/*
+ * Run a command of TeraQC
+ *
+ * Shared by the Vaa3D plugin & the command line tool, which differ only in
+ * the I/O they run with. Intermediate volumes & the tile cache are kept in
+ * the session between commands.
+ *
+ * Params:
+ *
+ * name: one of commandList
+ *
+ * input: image, brain or teraconvert directory, or list of brains
+ *
+ * output: prefix of the saved results
+ *
+ * params: key value pairs, see commandHelp & the commands in execute
+ *
+ * io: loader & saver of images
+ *
+ * session: state kept between commands
+ *
+ * trace: a json file to save the Chrome trace of the command, or y for
+ * <output>trace.json, see QcTrace. Off by default.
+ *
+ */
+
+bool runCommand(const QString& name, const QString& input, const QString& output, const QVariantMap& params,
+                const QcIO& io, QcSession& session)
+{
+    auto trace = params.value("trace", "n").toString();
+    if (trace.isEmpty() || trace.toLower() == "n" || trace.toLower() == "no")
+        return execute(name, input, output, params, io, session);
+    if (trace.toLower() == "y" || trace.toLower() == "yes")
+        trace = output + "trace.json";
+    QcTrace::start();
+    bool ok;
+    {
+        QcTraceScope traceScope(name);
+        ok = execute(name, input, output, params, tracedIO(io), session);
+    }
+    QcTrace::stop();
+    cout << "\tSaving the trace to " << trace.toStdString() << endl;
+    return QcTrace::save(trace) && ok;
+}
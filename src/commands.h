@@ -0,0 +1,30 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include "qcBasic.h"
+#include "TeraQCTypes.h"
+#include "loadUtils.h"
+#include "tileCache.h"
+#include "runMask.h"
+
+// volumes & decoded blocks kept between the commands of a host
+struct QcSession
+{
+    QcImage imgInput, imgMasked;
+    QcMask imgMarker;
+    TileCache tileCache;
+};
+
+QStringList commandList();
+
+QString commandHelp();
+
+bool runCommand(const QString& name, const QString& input, const QString& output, const QVariantMap& params,
+                const QcIO& io, QcSession& session);
+
+#endif // COMMANDS_H
@@ -0,0 +1,79 @@
+# processing core of TeraQC, shared by the Vaa3D plugin, the library & the command line tool
+# it only needs QtCore, OpenCV & libtiff
+
+# OpenCV: OPENCV as the install folder on windows (qmake var or environment),
+# pkg-config package OPENCV_PKG (opencv by default) elsewhere
+isEmpty(OPENCV):OPENCV = $$(OPENCV)
+win32 {
+    isEmpty(OPENCV):error("Set OPENCV to the opencv build folder.")
+    INCLUDEPATH += $$OPENCV/include \
+        $$OPENCV/include/opencv \
+        $$OPENCV/include/opencv2
+    CONFIG(debug, debug|release){
+        LIBS += -L$$OPENCV/x64/vc12/lib -lopencv_world310d
+    } else {
+        LIBS += -L$$OPENCV/x64/vc12/lib -lopencv_world310
+    }
+} else {
+    isEmpty(OPENCV_PKG):OPENCV_PKG = opencv
+    CONFIG += link_pkgconfig
+    PKGCONFIG += $$OPENCV_PKG
+}
+
+# libtiff, LIBTIFF as its install folder if not on the default paths
+isEmpty(LIBTIFF):LIBTIFF = $$(LIBTIFF)
+!isEmpty(LIBTIFF) {
+    INCLUDEPATH += $$LIBTIFF/include
+    LIBS += -L$$LIBTIFF/lib
+}
+LIBS += -ltiff
+# peak memory & cpu time of the benchmarks & the trace
+win32:LIBS += -lpsapi
+
+# let gcc/clang vectorize the branch-free pixel kernels
+!win32-msvc*:QMAKE_CXXFLAGS += -fno-trapping-math
+!win32-msvc*:CONFIG += c++11
+
+INCLUDEPATH += $$PWD
+
+HEADERS += $$PWD/qcBasic.h \
+    $$PWD/TeraQCTypes.h \
+    $$PWD/runMask.h \
+    $$PWD/loadUtils.h \
+    $$PWD/tiffIO.h \
+    $$PWD/teraManifest.h \
+    $$PWD/teraPyramid.h \
+    $$PWD/tileCache.h \
+    $$PWD/parallelUtils.h \
+    $$PWD/imageView.h \
+    $$PWD/preprocessing.h \
+    $$PWD/projection.h \
+    $$PWD/roiSampling.h \
+    $$PWD/regions.h \
+    $$PWD/histogram.h \
+    $$PWD/onePot.h \
+    $$PWD/batch.h \
+    $$PWD/benchmark.h \
+    $$PWD/synthetic.h \
+    $$PWD/trace.h \
+    $$PWD/slabWriter.h \
+    $$PWD/commands.h
+
+SOURCES += $$PWD/runMask.cpp \
+    $$PWD/loadUtils.cpp \
+    $$PWD/tiffIO.cpp \
+    $$PWD/teraManifest.cpp \
+    $$PWD/teraPyramid.cpp \
+    $$PWD/tileCache.cpp \
+    $$PWD/preprocessing.cpp \
+    $$PWD/projection.cpp \
+    $$PWD/roiSampling.cpp \
+    $$PWD/regions.cpp \
+    $$PWD/histogram.cpp \
+    $$PWD/onePot.cpp \
+    $$PWD/batch.cpp \
+    $$PWD/benchmark.cpp \
+    $$PWD/synthetic.cpp \
+    $$PWD/trace.cpp \
+    $$PWD/slabWriter.cpp \
+    $$PWD/commands.cpp
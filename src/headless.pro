@@ -0,0 +1,10 @@
+# library & command line tool of TeraQC, no Vaa3D needed
+# qmake headless.pro && make, the tool is built as bin/teraqc
+TEMPLATE = subdirs
+SUBDIRS = lib cli
+lib.file = lib.pro
+cli.file = cli.pro
+cli.depends = lib
+# both projects are in this folder
+lib.makefile = Makefile.lib
+cli.makefile = Makefile.cli
@@ -0,0 +1,417 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "histogram.h"
+#include "parallelUtils.h"
+#include "trace.h"
+#include <iostream>
+#include <limits>
+#include <cmath>
+
+using namespace std;
+
+// sub-histograms per thread, so consecutive voxels of the same value hit different counters
+static const int HIST_LANES = 4;
+// rows taken by a thread at a time
+static const V3DLONG HIST_CHUNK_VOXELS = 1 << 16;
+// the 32bit lane counters are flushed before they may overflow
+static const qint64 HIST_FLUSH_VOXELS = qint64(1) << 31;
+
+QcHistogram::QcHistogram(int bins, double lo, double hi, bool integer):
+    lo(lo), hi(hi), integer(integer), counts(qMax(bins, 1), 0), total(0)
+{
+}
+
+QcHistogram QcHistogram::forType(int datatype, int bins, double lo, double hi)
+{
+    switch (datatype)
+    {
+    case V3D_UINT8:
+        return QcHistogram(bins > 0 ? bins : 256, 0, 256, true);
+    case V3D_UINT16:
+        return QcHistogram(bins > 0 ? bins : 65536, 0, 65536, true);
+    default:
+        if (!(hi > lo))
+            throw invalid_argument("Float pixels need the range of the histogram.");
+        return QcHistogram(bins > 0 ? bins : 4096, lo, hi, false);
+    }
+}
+
+QcHistogram QcHistogram::forImage(const QcImage& image, int bins)
+{
+    if (image.datatype != V3D_FLOAT32)
+        return forType(image.datatype, bins);
+    auto data = (const v3d_float32*)image.buffer;
+    auto n = image.sz[0] * image.sz[1] * image.sz[2] * image.sz[3];
+    auto lo = numeric_limits<float>::max(), hi = -numeric_limits<float>::max();
+    for (V3DLONG i = 0; i < n; ++i)
+        if (std::isfinite(data[i]))
+        {
+            lo = min(lo, data[i]);
+            hi = max(hi, data[i]);
+        }
+    // the maximum falls in the last bin as values out of the range do
+    if (lo > hi)
+        lo = hi = 0;
+    return forType(image.datatype, bins, lo, hi > lo ? hi : lo + 1);
+}
+
+double QcHistogram::value(int bin) const
+{
+    auto w = binWidth();
+    return lo + bin * w + (integer ? qMax(w - 1, 0.0) / 2 : w / 2);
+}
+
+bool QcHistogram::isCompatible(const QcHistogram& other) const
+{
+    return lo == other.lo && hi == other.hi && counts.size() == other.counts.size();
+}
+
+void QcHistogram::merge(const QcHistogram& other)
+{
+    if (!isCompatible(other))
+        throw invalid_argument("Histograms of different binnings can't be merged.");
+    for (int i = 0; i < counts.size(); ++i)
+        counts[i] += other.counts[i];
+    total += other.total;
+}
+
+void QcHistogram::reset()
+{
+    counts.fill(0);
+    total = 0;
+}
+
+// the value below which p percent of the voxels fall, by the nearest rank
+double QcHistogram::percentile(double p) const
+{
+    if (total == 0) return 0;
+    auto rank = qMax(qint64(1), qint64(ceil(qBound(0.0, p, 100.0) / 100 * total)));
+    qint64 sum = 0;
+    for (int i = 0; i < counts.size(); ++i)
+    {
+        sum += counts[i];
+        if (sum >= rank) return value(i);
+    }
+    return value(counts.size() - 1);
+}
+
+double QcHistogram::mean() const
+{
+    if (total == 0) return 0;
+    double sum = 0;
+    for (int i = 0; i < counts.size(); ++i)
+        sum += counts[i] * value(i);
+    return sum / total;
+}
+
+double QcHistogram::stddev() const
+{
+    if (total == 0) return 0;
+    auto m = mean();
+    double sum = 0;
+    for (int i = 0; i < counts.size(); ++i)
+        sum += counts[i] * (value(i) - m) * (value(i) - m);
+    return sqrt(sum / total);
+}
+
+double QcHistogram::entropy() const
+{
+    if (total == 0) return 0;
+    double h = 0;
+    for (int i = 0; i < counts.size(); ++i)
+        if (counts[i] > 0)
+        {
+            auto p = double(counts[i]) / total;
+            h -= p * log2(p);
+        }
+    return h;
+}
+
+/*
+ * The background sigma is estimated by the distance of the median to the
+ * 15.87 percentile, i.e. from the lower half of the distribution only, so
+ * the bright signal doesn't inflate it.
+ */
+double QcHistogram::snr(double signalPct) const
+{
+    auto median = percentile(50);
+    auto sigma = median - percentile(15.87);
+    return (percentile(signalPct) - median) / qMax(sigma, binWidth());
+}
+
+// maps values of an integer pixel type to bins through a lookup table
+template <class T>
+struct HistBinner
+{
+    explicit HistBinner(const QcHistogram& hist):
+        lut(size_t(numeric_limits<T>::max()) + 1)
+    {
+        auto w = hist.binWidth();
+        for (size_t v = 0; v < lut.size(); ++v)
+            lut[v] = quint32(qBound(0.0, floor((v - hist.lo) / w), double(hist.bins() - 1)));
+    }
+    quint32 operator()(T v) const { return lut[v]; }
+    vector<quint32> lut;
+};
+
+// integer values binned by a shift, when the bins are of a power of 2 width from 0
+template <class T>
+struct HistShiftBinner
+{
+    explicit HistShiftBinner(int shift): shift(shift) {}
+    quint32 operator()(T v) const { return quint32(v) >> shift; }
+    int shift;
+};
+
+// the shift of a binning if it has one, -1 otherwise
+template <class T>
+static int binShift(const QcHistogram& hist)
+{
+    if (!numeric_limits<T>::is_integer || hist.lo != 0 ||
+            hist.hi != double(numeric_limits<T>::max()) + 1)
+        return -1;
+    for (int s = 0; s < 16; ++s)
+        if (hist.bins() << s == int(hist.hi))
+            return s;
+    return -1;
+}
+
+// float pixels are binned arithmetically
+template <>
+struct HistBinner<v3d_float32>
+{
+    explicit HistBinner(const QcHistogram& hist):
+        lo(float(hist.lo)), scale(float(1 / hist.binWidth())), last(float(hist.bins() - 1)) {}
+    quint32 operator()(v3d_float32 v) const
+    {
+        auto b = (v - lo) * scale;
+        // NaN goes to the first bin as well
+        return quint32(b >= 0 ? (b < last ? b : last) : 0);
+    }
+    float lo, scale, last;
+};
+
+// counters of a thread
+struct HistLanes
+{
+    vector<quint32> lanes;
+    vector<qint64> counts;
+    qint64 pending;
+
+    void init(int bins)
+    {
+        lanes.assign(size_t(bins) * HIST_LANES, 0);
+        counts.assign(bins, 0);
+        pending = 0;
+    }
+    void flush()
+    {
+        auto bins = counts.size();
+        for (int l = 0; l < HIST_LANES; ++l)
+            for (size_t i = 0; i < bins; ++i)
+            {
+                counts[i] += lanes[l * bins + i];
+                lanes[l * bins + i] = 0;
+            }
+        pending = 0;
+    }
+};
+
+/*
+ * Count a row into the lanes, 4 voxels at a time each to its own lane
+ *
+ * Masked voxels are added as 0 rather than skipped, so there's no branch
+ * on the mask.
+ */
+template <class T, class Binner>
+static void countRow(const T* row, V3DLONG stride, const v3d_uint8* m, V3DLONG mstride, bool invert,
+                     V3DLONG n, const Binner& bin, HistLanes& h)
+{
+    auto bins = h.counts.size();
+    auto h0 = h.lanes.data(), h1 = h0 + bins, h2 = h1 + bins, h3 = h2 + bins;
+    V3DLONG x = 0;
+    if (m == NULL)
+    {
+        if (stride == 1)
+            for (; x + 4 <= n; x += 4)
+            {
+                ++h0[bin(row[x])];
+                ++h1[bin(row[x + 1])];
+                ++h2[bin(row[x + 2])];
+                ++h3[bin(row[x + 3])];
+            }
+        for (; x < n; ++x)
+            ++h0[bin(row[x * stride])];
+        return;
+    }
+    // 1 for the voxels to count
+    auto keep = [&](V3DLONG i) { return quint32((m[i * mstride] == 0) == invert); };
+    if (stride == 1)
+        for (; x + 4 <= n; x += 4)
+        {
+            h0[bin(row[x])] += keep(x);
+            h1[bin(row[x + 1])] += keep(x + 1);
+            h2[bin(row[x + 2])] += keep(x + 2);
+            h3[bin(row[x + 3])] += keep(x + 3);
+        }
+    for (; x < n; ++x)
+        h0[bin(row[x * stride])] += keep(x);
+}
+
+// count the spans of a row off (invert) or on (not invert) the runs of a mask row
+template <class T, class Binner>
+static void countRuns(const T* row, V3DLONG stride, const QcRun* r, const QcRun* end, bool invert,
+                      V3DLONG n, const Binner& bin, HistLanes& h)
+{
+    V3DLONG x = 0;
+    for (; r != end; x = r->x1, ++r)
+        if (invert)
+            countRow(row + x * stride, stride, (const v3d_uint8*)NULL, 0, invert, r->x0 - x, bin, h);
+        else
+            countRow(row + r->x0 * stride, stride, (const v3d_uint8*)NULL, 0, invert, r->x1 - r->x0, bin, h);
+    if (invert)
+        countRow(row + x * stride, stride, (const v3d_uint8*)NULL, 0, invert, n - x, bin, h);
+}
+
+// count a view on threads, see accumulateHistogram, with a dense or a run-length mask if any
+template <class T, class Binner>
+static void countView(const QcView<T>& view, QcHistogram& hist, const QcView<v3d_uint8>* mask,
+                      const QcMask* runs, bool invert, int threads, const Binner& bin)
+{
+    vector<HistLanes> lanes(threads);
+    for (int i = 0; i < threads; ++i)
+        lanes[i].init(hist.bins());
+
+    auto rows = view.sz[1] * view.sz[2];
+    auto chunkRows = qMax(V3DLONG(1), HIST_CHUNK_VOXELS / qMax(V3DLONG(1), view.sz[0]));
+    auto chunks = (rows + chunkRows - 1) / chunkRows;
+    parallelForWorker(0, chunks, threads, [&](V3DLONG c, int worker) {
+        auto& h = lanes[worker];
+        for (auto r = c * chunkRows; r < qMin(rows, (c + 1) * chunkRows); ++r)
+        {
+            auto y = r % view.sz[1], z = r / view.sz[1];
+            if (h.pending + view.sz[0] >= HIST_FLUSH_VOXELS)
+                h.flush();
+            if (runs)
+                countRuns(view.row(y, z), view.stride[0], runs->planes[z].begin(y), runs->planes[z].end(y),
+                          invert, view.sz[0], bin, h);
+            else
+                countRow(view.row(y, z), view.stride[0], mask ? mask->row(y, z) : (const v3d_uint8*)NULL,
+                         mask ? mask->stride[0] : 0, invert, view.sz[0], bin, h);
+            h.pending += view.sz[0];
+        }
+    });
+
+    for (int i = 0; i < threads; ++i)
+    {
+        lanes[i].flush();
+        for (int b = 0; b < hist.bins(); ++b)
+        {
+            hist.counts[b] += lanes[i].counts[b];
+            hist.total += lanes[i].counts[b];
+        }
+    }
+}
+
+// check the mask & count, see accumulateHistogram
+template <class T>
+static bool countMasked(const QcView<T>& view, QcHistogram& hist, const QcView<v3d_uint8>* mask,
+                        const QcMask* runs, bool invert, int threads)
+{
+    if ((mask && (mask->sz[0] != view.sz[0] || mask->sz[1] != view.sz[1] || mask->sz[2] != view.sz[2])) ||
+            (runs && (runs->sz[0] != view.sz[0] || runs->sz[1] != view.sz[1] || runs->sz[2] != view.sz[2])))
+    {
+        cerr << "ERROR: The mask doesn't match the image." << endl;
+        return false;
+    }
+    threads = qMax(threads, 1);
+    auto shift = binShift<T>(hist);
+    if (shift >= 0)
+        countView(view, hist, mask, runs, invert, threads, HistShiftBinner<T>(shift));
+    else
+        countView(view, hist, mask, runs, invert, threads, HistBinner<T>(hist));
+    return true;
+}
+
+/*
+ * Add the voxels of a view to a histogram
+ *
+ * Rows are spread over threads in chunks, each thread counting into 4
+ * interleaved 32bit sub-histograms so that runs of equal values don't
+ * serialize on the same counter, then merged into the histogram. Integer
+ * pixels are binned by a shift when bins are of a power of 2 width from 0
+ * (a bin per value included), otherwise by a lookup table.
+ *
+ * mask: if not NULL, of the same size as the view, only the voxels where it's
+ * off (invert) or on (not invert) are counted.
+ *
+ */
+
+template <class T>
+bool accumulateHistogram(const QcView<T>& view, QcHistogram& hist,
+                         const QcView<v3d_uint8>* mask, bool invert, int threads)
+{
+    return countMasked(view, hist, mask, NULL, invert, threads);
+}
+
+// same as with a dense mask, but only the spans off or on the runs are counted
+template <class T>
+bool accumulateHistogram(const QcView<T>& view, QcHistogram& hist, const QcMask& mask, bool invert, int threads)
+{
+    return countMasked(view, hist, NULL, &mask, invert, threads);
+}
+
+template bool accumulateHistogram<v3d_uint8>(const QcView<v3d_uint8>&, QcHistogram&,
+                                             const QcView<v3d_uint8>*, bool, int);
+template bool accumulateHistogram<v3d_uint16>(const QcView<v3d_uint16>&, QcHistogram&,
+                                              const QcView<v3d_uint8>*, bool, int);
+template bool accumulateHistogram<v3d_float32>(const QcView<v3d_float32>&, QcHistogram&,
+                                               const QcView<v3d_uint8>*, bool, int);
+template bool accumulateHistogram<v3d_uint8>(const QcView<v3d_uint8>&, QcHistogram&, const QcMask&, bool, int);
+template bool accumulateHistogram<v3d_uint16>(const QcView<v3d_uint16>&, QcHistogram&, const QcMask&, bool, int);
+template bool accumulateHistogram<v3d_float32>(const QcView<v3d_float32>&, QcHistogram&, const QcMask&, bool, int);
+
+struct HistogramKernel
+{
+    const QcImage& input;
+    QcHistogram& hist;
+    const QcMask* mask;
+    bool invert;
+    int threads;
+    bool ok;
+
+    template <class T>
+    void operator()(QcTypeTag<T>)
+    {
+        ok = mask ? accumulateHistogram(QcView<T>(input), hist, *mask, invert, threads) :
+                    accumulateHistogram(QcView<T>(input), hist, (const QcView<v3d_uint8>*)NULL, invert, threads);
+    }
+};
+
+/*
+ * Add the voxels of an image to a histogram, see accumulateHistogram
+ *
+ * The binning of hist is kept, so call it on several blocks to get their
+ * overall histogram.
+ *
+ */
+
+bool computeHistogram(const QcImage& input, QcHistogram& hist, const QcMask* mask, bool invert, int threads)
+{
+    QcTraceScope traceScope("histogram");
+    try
+    {
+        HistogramKernel kernel = {input, hist, mask, invert, threads, false};
+        if (!dispatchType(input.datatype, kernel))
+            throw invalid_argument("Unsupported pixel type.");
+        return kernel.ok;
+    }
+    catch(exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        return false;
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "qcBasic.h"
+#include "TeraQCTypes.h"
+#include "imageView.h"
+#include "runMask.h"
+
+/*
+ * Grayscale histogram of equal bins over [lo, hi)
+ *
+ * Values out of the range are counted in the first or the last bin. For
+ * integer pixel types, bins hold whole values, e.g. bin i of width 1 is the
+ * value lo + i. Histograms of the same binning are merged by adding counts,
+ * so blocks & threads are accumulated separately.
+ */
+struct QcHistogram
+{
+    QcHistogram(int bins=256, double lo=0, double hi=256, bool integer=true);
+
+    // default binning of a pixel type, a bin per value for integers; floats have no default
+    // range, they're binned over [lo, hi), which must be given
+    static QcHistogram forType(int datatype, int bins=0, double lo=0, double hi=0);
+    // binning of an image, floats over the range of its finite values
+    static QcHistogram forImage(const QcImage& image, int bins=0);
+
+    double binWidth() const { return (hi - lo) / counts.size(); }
+    int bins() const { return counts.size(); }
+    // representative value of a bin
+    double value(int bin) const;
+    bool isCompatible(const QcHistogram& other) const;
+    void merge(const QcHistogram& other);
+    void reset();
+
+    // summary statistics
+    double percentile(double p) const;
+    double mean() const;
+    double stddev() const;
+    // Shannon entropy of the bins in bits
+    double entropy() const;
+    // signal (the signalPct percentile) over the median, in units of the background sigma
+    double snr(double signalPct=99) const;
+
+    double lo, hi;
+    bool integer;
+    QVector<qint64> counts;
+    qint64 total;
+};
+
+template <class T>
+bool accumulateHistogram(const QcView<T>& view, QcHistogram& hist,
+                         const QcView<v3d_uint8>* mask=NULL, bool invert=true, int threads=1);
+
+template <class T>
+bool accumulateHistogram(const QcView<T>& view, QcHistogram& hist, const QcMask& mask, bool invert=true,
+                         int threads=1);
+
+bool computeHistogram(const QcImage& input, QcHistogram& hist,
+                      const QcMask* mask=NULL, bool invert=true, int threads=1);
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef IMAGEVIEW_H
+#define IMAGEVIEW_H
+
+#include "qcBasic.h"
+#include <cstring>
+#include <stdexcept>
+#include "opencv2/core/core.hpp"
+#include "TeraQCTypes.h"
+
+// pixel type traits, mapping a C++ type to the Vaa3D & OpenCV pixel types
+template <class T> struct QcPixel;
+template <> struct QcPixel<v3d_uint8> { enum { datatype = V3D_UINT8, cvtype = CV_8U }; };
+template <> struct QcPixel<v3d_uint16> { enum { datatype = V3D_UINT16, cvtype = CV_16U }; };
+template <> struct QcPixel<v3d_float32> { enum { datatype = V3D_FLOAT32, cvtype = CV_32F }; };
+
+// OpenCV type of a Vaa3D pixel type
+inline int qcCvType(int datatype)
+{
+    switch (datatype)
+    {
+    case V3D_UINT8:
+        return CV_8U;
+    case V3D_UINT16:
+        return CV_16U;
+    case V3D_FLOAT32:
+        return CV_32F;
+    default:
+        return CV_8U;
+    }
+}
+
+// OpenCV header of a z plane of an image, for kernels not specialized by pixel type
+inline cv::Mat qcPlane(const QcImage& img, V3DLONG z, int channel=0)
+{
+    return cv::Mat(int(img.sz[1]), int(img.sz[0]), qcCvType(img.datatype),
+                   img.buffer + (channel * img.sz[2] + z) * img.sz[0] * img.sz[1] * qcTypeSize(img.datatype));
+}
+
+// type tag to pass a pixel type to a functor
+template <class T> struct QcTypeTag { typedef T type; };
+
+/*
+ * Call a functor with the pixel type of a Vaa3D pixel type
+ *
+ * The functor has a template operator()(QcTypeTag<T>), instantiated for each
+ * supported pixel type, so its inner loops are compiled per type.
+ * Returns false for unsupported pixel types.
+ */
+template <class Func>
+bool dispatchType(int datatype, Func& func)
+{
+    switch (datatype)
+    {
+    case V3D_UINT8:
+        func(QcTypeTag<v3d_uint8>());
+        return true;
+    case V3D_UINT16:
+        func(QcTypeTag<v3d_uint16>());
+        return true;
+    case V3D_FLOAT32:
+        func(QcTypeTag<v3d_float32>());
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Typed, strided, non-owning view of a 3D image
+ *
+ * Strides are in pixels, in x, y, z order. Sub-volumes, slices and slabs of
+ * a view are views of the same buffer, so they're passed around without
+ * copying. A view of a QcImage covers one of its channels.
+ */
+template <class T>
+struct QcView
+{
+    QcView():
+        data(NULL)
+    {
+        for(int i = 0; i < 3; ++i) sz[i] = stride[i] = 0;
+    }
+    QcView(T* data, V3DLONG nx, V3DLONG ny, V3DLONG nz, V3DLONG stx, V3DLONG sty, V3DLONG stz):
+        data(data)
+    {
+        sz[0] = nx; sz[1] = ny; sz[2] = nz;
+        stride[0] = stx; stride[1] = sty; stride[2] = stz;
+    }
+    explicit QcView(const QcImage& img, int channel=0)
+    {
+        if (img.datatype != QcPixel<T>::datatype)
+            throw std::invalid_argument("The pixel type of the view doesn't match the image.");
+        for(int i = 0; i < 3; ++i) sz[i] = img.sz[i];
+        stride[0] = 1;
+        stride[1] = img.sz[0];
+        stride[2] = img.sz[0] * img.sz[1];
+        data = (T*)img.buffer + stride[2] * img.sz[2] * channel;
+    }
+
+    T& at(V3DLONG x, V3DLONG y, V3DLONG z) const
+    {
+        return data[x * stride[0] + y * stride[1] + z * stride[2]];
+    }
+    // start of a row, pixels of the row are stride[0] apart
+    T* row(V3DLONG y, V3DLONG z) const
+    {
+        return data + y * stride[1] + z * stride[2];
+    }
+    V3DLONG count() const
+    {
+        return sz[0] * sz[1] * sz[2];
+    }
+    bool isContiguous() const
+    {
+        return stride[0] == 1 && stride[1] == sz[0] && stride[2] == sz[0] * sz[1];
+    }
+
+    QcView sub(const QcRoi& roi) const
+    {
+        return QcView(&at(roi.start[0], roi.start[1], roi.start[2]),
+                      roi.size(0), roi.size(1), roi.size(2), stride[0], stride[1], stride[2]);
+    }
+    QcView slab(V3DLONG z0, V3DLONG z1) const
+    {
+        return QcView(data + z0 * stride[2], sz[0], sz[1], z1 - z0, stride[0], stride[1], stride[2]);
+    }
+    QcView slice(V3DLONG z) const
+    {
+        return slab(z, z + 1);
+    }
+
+    // OpenCV header of a z plane, rows must be contiguous
+    cv::Mat plane(V3DLONG z) const
+    {
+        if (stride[0] != 1)
+            throw std::invalid_argument("Only planes with contiguous rows can be used as cv::Mat.");
+        return cv::Mat(int(sz[1]), int(sz[0]), QcPixel<T>::cvtype,
+                       (void*)row(0, z), size_t(stride[1] * sizeof(T)));
+    }
+
+    // first pixel
+    T* data;
+    // dimensions in x, y, z
+    V3DLONG sz[3];
+    // distance between neighbouring pixels along x, y, z, in pixels
+    V3DLONG stride[3];
+};
+
+// copy between views of the same size
+template <class T>
+void copyView(const QcView<T>& src, const QcView<T>& dst)
+{
+    if (src.sz[0] != dst.sz[0] || src.sz[1] != dst.sz[1] || src.sz[2] != dst.sz[2])
+        throw std::invalid_argument("Views to copy between are of different sizes.");
+    for (V3DLONG z = 0; z < src.sz[2]; ++z)
+        for (V3DLONG y = 0; y < src.sz[1]; ++y)
+        {
+            auto s = src.row(y, z);
+            auto d = dst.row(y, z);
+            if (src.stride[0] == 1 && dst.stride[0] == 1)
+                memcpy(d, s, src.sz[0] * sizeof(T));
+            else
+                for (V3DLONG x = 0; x < src.sz[0]; ++x)
+                    d[x * dst.stride[0]] = s[x * src.stride[0]];
+        }
+}
+
+#endif // IMAGEVIEW_H
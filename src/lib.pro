@@ -0,0 +1,9 @@
+# the processing core as a static library, without Vaa3D or Qt GUI
+TEMPLATE = lib
+CONFIG += staticlib warn_on
+QT = core
+
+include(core.pri)
+
+TARGET = teraqc
+DESTDIR = $$OUT_PWD/lib
@@ -4,10 +4,210 @@
 */
 
 #include "loadUtils.h"
+#include "teraManifest.h"
+#include "parallelUtils.h"
+#include "tileCache.h"
+#include "imageView.h"
+#include "trace.h"
 #include <iostream>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 using namespace std;
 
+/*
+ * Copy the part of a decoded block inside a box to the output image buffer
+ * origins and the box are all in voxels of the resolution.
+ * can have a conversion here if the data type differs.
+ */
+struct CopyBox
+{
+    const QcImage& block;
+    const V3DLONG* blockOrigin;
+    QcImage& output;
+    const V3DLONG* outputOrigin;
+    const QcRoi& box;
+
+    template <class T>
+    void operator()(QcTypeTag<T>)
+    {
+        copyView(QcView<T>(block).sub(box.relativeTo(blockOrigin)),
+                 QcView<T>(output).sub(box.relativeTo(outputOrigin)));
+    }
+};
+
+static void copyBox(const QcImage& block, const V3DLONG blockOrigin[3],
+                    QcImage& output, const V3DLONG outputOrigin[3], const QcRoi& box)
+{
+    QcTraceScope traceScope("copy tile");
+    traceScope.addWritten(box.size(0) * box.size(1) * box.size(2) * qcTypeSize(output.datatype));
+    CopyBox copy = {block, blockOrigin, output, outputOrigin, box};
+    if (!dispatchType(output.datatype, copy))
+        throw runtime_error("Unsupported pixel type in teraconvert data.");
+}
+
+// copy a whole decoded block to its place in the output image buffer
+static void copyBlock(const QcImage& block, QcImage& output, V3DLONG xLen, V3DLONG yLen, V3DLONG zLen)
+{
+    if (xLen + block.sz[0] > output.sz[0] ||
+            yLen + block.sz[1] > output.sz[1] ||
+            zLen + block.sz[2] > output.sz[2])
+        throw runtime_error("Image block exceeds the size inferred from the teraconvert folder name.");
+    V3DLONG blockOrigin[3] = {xLen, yLen, zLen}, outputOrigin[3] = {0, 0, 0};
+    copyBox(block, blockOrigin, output, outputOrigin,
+            QcRoi(xLen, yLen, zLen, xLen + block.sz[0], yLen + block.sz[1], zLen + block.sz[2]));
+}
+
+/*
+ * Plane loader from a whole image loader
+ *
+ * For loaders without random access to pages, the whole image is decoded
+ * and the planes outside [z0, z1) are dropped by moving the wanted planes
+ * to the start of the buffer.
+ *
+ */
+
+PlaneLoader planeLoader(const Loader& loader)
+{
+    return [loader](const char* path, V3DLONG z0, V3DLONG z1, QcImage& img) {
+        if (!loader(path, img))
+            return false;
+        z0 = qMax(z0, V3DLONG(0));
+        z1 = qMin(z1, img.sz[2]);
+        if (z0 >= z1)
+        {
+            img.clear();
+            return false;
+        }
+        if (z0 > 0 || z1 < img.sz[2])
+        {
+            V3DLONG bytes = img.sz[0] * img.sz[1] * img.sz[3] * qcTypeSize(img.datatype);
+            memmove(img.buffer, img.buffer + z0 * bytes, (z1 - z0) * bytes);
+            img.sz[2] = z1 - z0;
+        }
+        return true;
+    };
+}
+
+/*
+ * Ordered prefetching of teraconvert blocks
+ *
+ * Worker threads claim blocks in reading order and decode them into a ring
+ * of slots, staying at most `window` blocks ahead of the consumer. The
+ * consumer takes the blocks in the same order, so the running offsets
+ * are inferred exactly as in sequential loading, and only `window`
+ * decoded blocks are in memory at any time.
+ */
+class BlockPrefetcher
+{
+public:
+    BlockPrefetcher(const TeraManifest& manifest, const Loader& loader, int datatype,
+                    int threads, int window):
+        manifest(manifest), loader(loader), datatype(datatype), slots(window), ready(window, 0),
+        next(0), consumed(0), failed(false)
+    {
+        for (int i = 0; i < threads; ++i)
+            workers.push_back(thread(&BlockPrefetcher::work, this));
+    }
+    ~BlockPrefetcher()
+    {
+        {
+            lock_guard<mutex> lk(m);
+            failed = true;
+        }
+        cv.notify_all();
+        for (auto& w: workers) w.join();
+    }
+    // wait for the n-th block, throw if any worker failed
+    QcImage& acquire(size_t n)
+    {
+        unique_lock<mutex> lk(m);
+        cv.wait(lk, [&] { return failed || ready[n % slots.size()]; });
+        if (failed)
+            throw runtime_error(error);
+        return slots[n % slots.size()];
+    }
+    // free the slot of the n-th block for prefetching
+    void release(size_t n)
+    {
+        {
+            lock_guard<mutex> lk(m);
+            slots[n % slots.size()].clear();
+            ready[n % slots.size()] = 0;
+            ++consumed;
+        }
+        cv.notify_all();
+    }
+
+private:
+    void work()
+    {
+        unique_lock<mutex> lk(m);
+        for (;;)
+        {
+            auto total = (size_t)manifest.tiles.size();
+            cv.wait(lk, [&] { return failed || next >= total || next < consumed + slots.size(); });
+            if (failed || next >= total) return;
+            auto n = next++;
+            auto& slot = slots[n % slots.size()];
+            lk.unlock();
+            string msg;
+            try
+            {
+                // READ IMAGE USING V3D INTERFACE
+                auto imagePath = manifest.tilePath(n);
+                if (!loader(imagePath.toStdString().c_str(), slot))
+                    msg = "Failed to load image at " + imagePath.toStdString();
+                else if (slot.datatype != datatype)
+                    msg = "Found inconsistent image pixel type in teraconvert data.";
+            }
+            catch (exception& e)
+            {
+                msg = e.what();
+            }
+            lk.lock();
+            if (!msg.empty())
+            {
+                if (!failed) error = msg;
+                failed = true;
+            }
+            else
+                ready[n % slots.size()] = 1;
+            cv.notify_all();
+        }
+    }
+
+    const TeraManifest& manifest;
+    const Loader& loader;
+    int datatype;
+    vector<QcImage> slots;
+    vector<char> ready;
+    size_t next, consumed;
+    bool failed;
+    string error;
+    mutex m;
+    condition_variable cv;
+    vector<thread> workers;
+};
+
+// backs an image by a file while in scope, then puts its own backing setting back
+struct ScopedBacking
+{
+    ScopedBacking(QcImage& image, const QString& path) : image(image), previous(image.backing)
+    {
+        image.setBacking(path);
+    }
+    ~ScopedBacking()
+    {
+        image.setBacking(previous);
+    }
+
+    QcImage& image;
+    QString previous;
+};
+
 /*
  * Reassemble teraconvert brain image blocks from their directory
  *
@@ -16,111 +216,153 @@ using namespace std;
  * for its details. Here we need to reassemble them together, since it's in
  * the lowest resolution, it can be easily handled in whole.
  *
- * Params:
+ * With a valid manifest cached, the folders are not listed again and the
+ * offsets of all blocks are known before decoding, so the loading workers
+ * copy blocks to the output in any order. Otherwise the blocks are listed
+ * and consumed in reading order to infer their offsets, and the resulting
+ * manifest is cached.
  *
- * callback: Vaa3D callback used to load images
+ * Params:
  *
  * path: path to the directory storing brain blocks of a resolution (16bit)
  *
- * pBuffer: null pointer to save the loaded image
+ * output: image to save the loaded volume
+ *
+ * loader: callback used to load images, must be reentrant if loadThreads > 1
+ *
+ * datatype: expected pixel type of all blocks
+ *
+ * loadThreads: number of workers decoding blocks concurrently, 1 for sequential loading
  *
- * sz: 4D V3DLONG array to store image size
+ * prefetch: maximal number of decoded blocks held in memory, 0 for twice the workers
+ *
+ * manifest: whether to use & cache the manifest of the resolution (y/n)
+ *
+ * manifestDir: where to cache the manifest, empty for beside the resolution folder
+ *
+ * rawCacheDir: where to keep the assembled volume as a memory mapped raw file,
+ * empty for no raw cache. While the manifest is valid, the raw file is mapped
+ * again instead of loading the blocks. The backing setting of output is kept.
  *
  */
 
-bool loadTeraconvert(const QString& path, QcImage& output, const Loader& loader, int datatype)
+bool loadTeraconvert(const QString& path, QcImage& output, const Loader& loader, int datatype,
+                     const QVariantMap& params)
 {
     QcImage block;
 
     try
     {
-        // 1. JUDGE WHETHER THE FOLDER PATH IS VALID AS A TERACONVERT RES
-        auto dir = QDir(path);
-        if (!dir.exists() && !dir.dirName().contains(QRegExp("^(RES\(\d+x\d+x\d+\))$")))
+        auto threads = params.value("loadThreads", 1).toInt();
+        auto prefetch = params.value("prefetch", 0).toInt();
+        auto useManifest = params.value("manifest", "y").toString().toLower().startsWith("y");
+        auto manifestFile = teraManifestFile(path, params.value("manifestDir").toString());
+        auto rawCacheDir = params.value("rawCacheDir").toString();
+        auto rawFile = rawCacheDir.isEmpty() ? QString() : teraCacheFile(path, rawCacheDir, ".raw");
+        // only this load is backed by the raw cache, the image may be reused for other brains
+        ScopedBacking scopedBacking(output, rawFile);
+
+        // 1. USE THE CACHED MANIFEST (AND RAW VOLUME) IF IT'S STILL VALID
+        TeraManifest manifest;
+        if (useManifest &&
+                readTeraManifest(manifestFile, manifest) &&
+                manifest.root == QDir(path).absolutePath() &&
+                manifest.datatype == datatype &&
+                isTeraManifestValid(manifest))
+        {
+            // the raw volume must be written after the manifest was checked valid
+            if (!rawFile.isEmpty() &&
+                    QFileInfo(rawFile).lastModified() >= QFileInfo(manifestFile).lastModified() &&
+                    output.open(rawFile) && output.datatype == datatype &&
+                    output.sz[0] == manifest.sz[0] && output.sz[1] == manifest.sz[1] &&
+                    output.sz[2] == manifest.sz[2])
+                return true;
+            if (!loadTeraconvert(manifest, output, loader, threads))
+                return false;
+            output.markComplete();
+            return true;
+        }
+
+        // 2. LIST ALL BLOCKS & INFER IMAGE SIZE FROM FOLDER NAME
+        if (!scanTeraconvert(path, manifest))
             throw invalid_argument("The path of the folder to load the "
                                    "teraconvert data doesn't exist or is invalid.");
-
-        // 2. INFER IMAGE SIZE FROM FOLDER NAME & ASSIGN MEMORY FOR OUTPUT IMAGE BUFFER
-        auto res = dir.dirName().mid(4);
-        res.chop(1);
         // here we assume that input images are all 16bit, so we don't do any conversion.
-        V3DLONG sz[4] = {
-            res.section('x', 1, 1).toLongLong(),
-            res.section('x', 0, 0).toLongLong(),
-            res.section('x', 2, 2).toLongLong(),
-            1
-        };
         output.clear();
-        output.create(sz, datatype);
+        output.create(manifest.sz, datatype);
 
         /*
-         * 3. READ IMAGE FROM ALL SUBFOLDERS
-         * Teraconverted images are sorted by y, x, z slicing.
-         * The root folder contains all y slicings folder;
-         * each y folder slicing contains its x slicing folders;
-         * each x slicing folder contains the tif image blocks sorted by their z slicings.
+         * 3. READ THE BLOCKS & COPY THEM TO THE OUTPUT IMAGE BUFFER
+         * The offset of a block is the accumulated size of the blocks before it
+         * in the same x slicing (z), y slicing (x) and the whole image (y).
+         * Blocks are consumed in reading order, either decoded here or
+         * prefetched by the worker threads.
         */
 
-        auto ySlicings = dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
+        QScopedPointer<BlockPrefetcher> prefetcher;
+        if (threads > 1)
+            prefetcher.reset(new BlockPrefetcher(manifest, loader, datatype, threads,
+                                                 prefetch > 0 ? prefetch : threads * 2));
 
-        for (V3DLONG i = 0, yLen = 0;
-             i < ySlicings.size();
-             ++i, yLen += block.sz[1], dir.cdUp())
+        V3DLONG yLen = 0, xLen = 0, zLen = 0, last[3] = {0, 0, 0};
+        for (int n = 0; n < manifest.tiles.size(); ++n)
         {
-            // cd to subfolder for y
-            if (!dir.cd(ySlicings.at(i)))
-                throw runtime_error("Directory " + dir.filePath(ySlicings.at(i)).toStdString() +
-                      " doesn't exist.\nMaybe the directory is modified during reading.");
-
-            auto xSlicings = dir.entryList(QDir::Dirs| QDir::NoDotAndDotDot, QDir::Name);
-
-            for (V3DLONG j = 0, xLen = 0;
-                 j < xSlicings.size();
-                 ++j, xLen += block.sz[0], dir.cdUp())
+            auto& tile = manifest.tiles[n];
+            if (n > 0)
             {
-                // cd to subfolder for x
-                if (!dir.cd(xSlicings.at(j)))
-                    throw runtime_error("Directory " + dir.filePath(xSlicings.at(i)).toStdString() +
-                            " doesn't exist.\nMaybe the directory is modified during reading.");
-
-                auto blocks = dir.entryList(QDir::Files, QDir::Name);
-
-                for (V3DLONG k = 0, zLen = 0;
-                     k < blocks.size();
-                     ++k, zLen += block.sz[2])
+                const auto& prev = manifest.tiles[n - 1];
+                if (tile.grid[1] != prev.grid[1])
+                {
+                    yLen += last[1];
+                    xLen = zLen = 0;
+                }
+                else if (tile.grid[0] != prev.grid[0])
                 {
-                    auto imagePath = dir.filePath(blocks.at(k));
-                    // READ IMAGE USING V3D INTERFACE
-                    if (!loader(imagePath.toStdString().c_str(), block))
-                        throw runtime_error("Failed to load image at " + imagePath.toStdString());
-                    if (block.datatype != datatype)
-                        throw runtime_error("Found inconsistent image pixel type in teraconvert data.");
-
-                    // COPY THE BLOCK TO THE OUTPUT IMAGE BUFFER
-                    // can have a conversion here if the data type is not 16bit.
-                    // we use ii,jj,kk to iterate through z,y,x of the image block.
-                    // note its different from i,j,k, which iterate through y,x,z of the whole image.
-                    for (V3DLONG ii = 0; ii < block.sz[2]; ++ii)
-                    {
-                        for (V3DLONG jj = 0; jj < block.sz[1]; ++jj)
-                        {
-                            // starting point in output buffer
-                            auto dst = output.buffer + (output.sz[0] * output.sz[1] *
-                                    (zLen + ii) + output.sz[0] * (yLen + jj) + xLen) * sizeof(v3d_uint16);
-
-                            // starting point in block buffer
-                            auto src = block.buffer +
-                                    (block.sz[0] * block.sz[1] * ii + block.sz[0] * jj)
-                                    * sizeof(v3d_uint16);
-
-                            memcpy(dst, src, block.sz[0] * sizeof(v3d_uint16));
-                        }
-                    }
-                    delete [] block.buffer;
-                    block.buffer = NULL;
+                    xLen += last[0];
+                    zLen = 0;
                 }
+                else
+                    zLen += last[2];
             }
+
+            QcImage* pBlock;
+            if (prefetcher)
+                pBlock = &prefetcher->acquire(n);
+            else
+            {
+                // READ IMAGE USING V3D INTERFACE
+                auto imagePath = manifest.tilePath(n);
+                if (!loader(imagePath.toStdString().c_str(), block))
+                    throw runtime_error("Failed to load image at " + imagePath.toStdString());
+                if (block.datatype != datatype)
+                    throw runtime_error("Found inconsistent image pixel type in teraconvert data.");
+                pBlock = &block;
+            }
+
+            copyBlock(*pBlock, output, xLen, yLen, zLen);
+            for (int i = 0; i < 3; ++i) last[i] = pBlock->sz[i];
+
+            // record the geometry for the manifest
+            tile.origin[0] = xLen;
+            tile.origin[1] = yLen;
+            tile.origin[2] = zLen;
+            for (int i = 0; i < 3; ++i) tile.sz[i] = last[i];
+            tile.datatype = datatype;
+
+            if (prefetcher)
+                prefetcher->release(n);
+            else
+                block.clear();
         }
+        prefetcher.reset();
+
+        // 4. CACHE THE MANIFEST FOR THE NEXT TIME
+        manifest.datatype = datatype;
+        if (useManifest && !writeTeraManifest(manifestFile, manifest))
+            cerr << "WARNING: Failed to cache the teraconvert manifest at "
+                 << manifestFile.toStdString() << endl;
+        // after the manifest, as the raw volume is checked to be newer than it
+        output.markComplete();
         return true;
     }
     catch (exception& e)
@@ -131,3 +373,155 @@ bool loadTeraconvert(const QString& path, QcImage& output, const Loader& loader,
         return false;
     }
 }
+
+/*
+ * Reassemble teraconvert brain image blocks planned by a manifest
+ *
+ * All block offsets are known, so the workers decode blocks in any order
+ * and copy each straight to its place in the output buffer. At most one
+ * decoded block per worker is in memory.
+ *
+ */
+
+bool loadTeraconvert(const TeraManifest& manifest, QcImage& output, const Loader& loader, int threads)
+{
+    QcTraceScope traceScope("loadTeraconvert");
+    try
+    {
+        output.clear();
+        output.create(manifest.sz, manifest.datatype);
+        parallelFor(0, manifest.tiles.size(), threads, [&](V3DLONG n) {
+            const auto& tile = manifest.tiles[n];
+            QcImage block;
+            auto imagePath = manifest.tilePath(n);
+            if (!loader(imagePath.toStdString().c_str(), block))
+                throw runtime_error("Failed to load image at " + imagePath.toStdString());
+            if (block.datatype != manifest.datatype ||
+                    block.sz[0] != tile.sz[0] || block.sz[1] != tile.sz[1] || block.sz[2] != tile.sz[2])
+                throw runtime_error("Image at " + imagePath.toStdString() +
+                                    " doesn't match the teraconvert manifest.");
+            copyBlock(block, output, tile.origin[0], tile.origin[1], tile.origin[2]);
+        });
+        return true;
+    }
+    catch (exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        output.clear();
+        return false;
+    }
+}
+
+/*
+ * Load a region of interest from teraconvert brain image blocks
+ *
+ * Only the blocks intersecting the region are read, and only the z planes
+ * in the region are decoded for loaders with random access to pages. So the
+ * memory and I/O scale with the region instead of the whole resolution.
+ * Voxels of the region outside the resolution are set to 0.
+ *
+ * With a tile cache, whole blocks are decoded and kept in the cache, so
+ * overlapping regions reuse them instead of decoding again.
+ *
+ * Params:
+ *
+ * path: path to the directory storing brain blocks of a resolution
+ *
+ * roi: region to load, in voxels of the resolution
+ *
+ * output: image to save the loaded region
+ *
+ * loader: callback used to load images, must be reentrant if loadThreads > 1
+ *
+ * datatype: expected pixel type of all blocks
+ *
+ * loadThreads: number of workers decoding blocks concurrently
+ *
+ * manifest: whether to use & cache the manifest of the resolution (y/n)
+ *
+ * manifestDir: where to cache the manifest, empty for beside the resolution folder
+ *
+ * cache: cache of decoded blocks shared between calls, or NULL
+ *
+ */
+
+bool loadTeraconvertRoi(const QString& path, const QcRoi& roi, QcImage& output, const Loader& loader,
+                        int datatype, const QVariantMap& params, TileCache* cache)
+{
+    TeraManifest manifest;
+    if (!getTeraManifest(path, manifest, loader, datatype, params.value("manifestDir").toString(),
+                         params.value("manifest", "y").toString().toLower().startsWith("y")))
+    {
+        output.clear();
+        return false;
+    }
+    return loadTeraconvertRoi(manifest, roi, output, planeLoader(loader),
+                              params.value("loadThreads", 1).toInt(), cache);
+}
+
+bool loadTeraconvertRoi(const TeraManifest& manifest, const QcRoi& roi, QcImage& output,
+                        const PlaneLoader& loader, int threads, TileCache* cache)
+{
+    QcTraceScope traceScope("loadTeraconvertRoi");
+    try
+    {
+        if (roi.isEmpty())
+            throw invalid_argument("The region of interest to load is empty.");
+        V3DLONG sz[4] = {roi.size(0), roi.size(1), roi.size(2), manifest.sz[3]};
+        output.clear();
+        output.create(sz, manifest.datatype);
+        memset(output.buffer, 0, sz[0] * sz[1] * sz[2] * sz[3] * qcTypeSize(manifest.datatype));
+
+        // blocks intersecting the region
+        QVector<int> hits;
+        for (int i = 0; i < manifest.tiles.size(); ++i)
+        {
+            const auto& tile = manifest.tiles[i];
+            auto tileBox = QcRoi(tile.origin[0], tile.origin[1], tile.origin[2],
+                    tile.origin[0] + tile.sz[0], tile.origin[1] + tile.sz[1], tile.origin[2] + tile.sz[2]);
+            if (!tileBox.intersected(roi).isEmpty())
+                hits.append(i);
+        }
+
+        parallelFor(0, hits.size(), threads, [&](V3DLONG n) {
+            const auto& tile = manifest.tiles[hits[n]];
+            auto box = roi.intersected(QcRoi(tile.origin[0], tile.origin[1], tile.origin[2],
+                    tile.origin[0] + tile.sz[0], tile.origin[1] + tile.sz[1], tile.origin[2] + tile.sz[2]));
+            auto imagePath = manifest.tilePath(hits[n]);
+            auto check = [&](const QcImage& block, V3DLONG depth) {
+                if (block.datatype != manifest.datatype ||
+                        block.sz[0] != tile.sz[0] || block.sz[1] != tile.sz[1] || block.sz[2] != depth)
+                    throw runtime_error("Image at " + imagePath.toStdString() +
+                                        " doesn't match the teraconvert manifest.");
+            };
+            if (cache)
+            {
+                // the whole block, shared through the cache
+                TileKey key = {manifest.root, {tile.origin[0], tile.origin[1], tile.origin[2]}};
+                auto block = cache->get(key, [&](QcImage& img) {
+                    return loader(imagePath.toStdString().c_str(), 0, tile.sz[2], img);
+                });
+                if (!block)
+                    throw runtime_error("Failed to load image at " + imagePath.toStdString());
+                check(*block, tile.sz[2]);
+                copyBox(*block, tile.origin, output, roi.start, box);
+                return;
+            }
+            // only the z planes of the block in the region
+            QcImage block;
+            if (!loader(imagePath.toStdString().c_str(), box.start[2] - tile.origin[2],
+                        box.end[2] - tile.origin[2], block))
+                throw runtime_error("Failed to load image at " + imagePath.toStdString());
+            check(block, box.size(2));
+            V3DLONG blockOrigin[3] = {tile.origin[0], tile.origin[1], box.start[2]};
+            copyBox(block, blockOrigin, output, roi.start, box);
+        });
+        return true;
+    }
+    catch (exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        output.clear();
+        return false;
+    }
+}
@@ -6,13 +6,42 @@
 #ifndef LOADUTILS_H
 #define LOADUTILS_H
 
-#include <v3d_interface.h>
+#include "qcBasic.h"
 #include <functional>
 #include "TeraQCTypes.h"
 
 // loader type define (for convenient loading image with any callback)
+// when used with more than one loading thread, it must be reentrant.
 typedef std::function<bool(const char*, QcImage&)> Loader;
 
-bool loadTeraconvert(const QString& path, QcImage& img, const Loader& loader, int datatype);
+// saver type define (for saving an image with any callback)
+typedef std::function<bool(const char*, const QcImage&)> Saver;
+
+// plane loader type define (loading only the z planes [z0, z1) of a multi-page image)
+typedef std::function<bool(const char*, V3DLONG, V3DLONG, QcImage&)> PlaneLoader;
+
+PlaneLoader planeLoader(const Loader& loader);
+
+// the I/O a command runs with, the plane loader is derived from the loader if not given
+struct QcIO
+{
+    Loader loader;
+    PlaneLoader planeLoader;
+    Saver saver;
+};
+
+struct TeraManifest;
+class TileCache;
+
+bool loadTeraconvert(const QString& path, QcImage& img, const Loader& loader, int datatype,
+                     const QVariantMap& params=QVariantMap());
+
+bool loadTeraconvert(const TeraManifest& manifest, QcImage& img, const Loader& loader, int threads=1);
+
+bool loadTeraconvertRoi(const QString& path, const QcRoi& roi, QcImage& img, const Loader& loader,
+                        int datatype, const QVariantMap& params=QVariantMap(), TileCache* cache=NULL);
+
+bool loadTeraconvertRoi(const TeraManifest& manifest, const QcRoi& roi, QcImage& img,
+                        const PlaneLoader& loader, int threads=1, TileCache* cache=NULL);
 
 #endif // LOADUTILS_H
@@ -0,0 +1,375 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "onePot.h"
+#include "preprocessing.h"
+#include "imageView.h"
+#include "parallelUtils.h"
+#include "trace.h"
+#include "opencv2/opencv.hpp"
+#include <iostream>
+#include <deque>
+#include <cstring>
+
+using namespace std;
+using namespace cv;
+
+// a slab passed between the stages, the mask is added by the marker stage
+struct SlabItem
+{
+    V3DLONG z0;
+    QSharedPointer<QcImage> image;
+    QSharedPointer<QcMask> mask;
+};
+
+/*
+ * Estimate the region threshold of a level before streaming it
+ *
+ * The coarsest level is small, so it's loaded whole if it's coarser than
+ * the streamed level, or if it's no deeper than the sample. Otherwise the
+ * streamed level itself is sampled by thresholdSlabs slabs spread over z,
+ * so it isn't read twice. See adaptiveThreshold for the estimate.
+ *
+ */
+
+static double estimateThreshold(TeraPyramid& pyramid, int level, const V3DLONG sz[4], V3DLONG slabDepth,
+                                const QVariantMap& params)
+{
+    auto k = params.value("regionK", 3.0).toDouble();
+    auto depth = sz[2];
+    auto d = qMin(depth, slabDepth);
+    auto n = qMax(V3DLONG(1), params.value("thresholdSlabs", 4).toLongLong());
+    QcImage sample;
+    if (level < pyramid.coarsest() || n * d >= depth)
+    {
+        if (!pyramid.loadLevel(pyramid.coarsest(), sample))
+            throw runtime_error("Failed to load the coarsest level.");
+        return adaptiveThreshold(sample, k);
+    }
+    // the slabs are stacked into one sample
+    QcImage slab;
+    qint64 offset = 0;
+    for (V3DLONG i = 0; i < n; ++i)
+    {
+        auto z0 = n > 1 ? (depth - d) * i / (n - 1) : (depth - d) / 2;
+        if (!pyramid.loadRoi(level, QcRoi(0, 0, z0, sz[0], sz[1], z0 + d), slab))
+            throw runtime_error("Failed to load a slab.");
+        qint64 bytes = slab.sz[0] * slab.sz[1] * slab.sz[2] * slab.sz[3] * qcTypeSize(slab.datatype);
+        if (i == 0)
+        {
+            V3DLONG ssz[4] = {slab.sz[0], slab.sz[1], slab.sz[2] * n, slab.sz[3]};
+            sample.create(ssz, slab.datatype);
+        }
+        memcpy(sample.buffer + offset, slab.buffer, bytes);
+        offset += bytes;
+    }
+    return adaptiveThreshold(sample, k);
+}
+
+/*
+ * Run the whole QC of a brain as a streaming pipeline
+ *
+ * The level is read in z slabs, which flow through stages running on their
+ * own threads & connected by queues of queueDepth slabs:
+ *
+ * 1. Loading, the slabs are loaded from the teraconvert blocks;
+ *
+ * 2. Marker finding, lines are found & drawn per slice, and the mask of a
+ * slab is passed on with it once the z interpolation has enough slices
+ * after it, see MarkerStream;
+ *
+ * 3. Masking, markers are removed in place, and the slab is folded into the
+ * xy projections & the histogram of the voxels off the markers;
+ *
+ * 4. Region extraction, the slab is added to the 3D connected components,
+ * see RegionAccumulator;
+ *
+ * 5. Local maxima finding, in blocks as soon as a block & its halo are
+ * covered, see PeakStream.
+ *
+ * 6. Writing, if there are sinks, the masks & the masked slabs are saved
+ * slab by slab, so saving overlaps the other stages rather than following
+ * them with whole volumes, see SlabWriter. The mask may be kept whole as
+ * runs, which take little memory, see QcMask.
+ *
+ * Stages 4, 5 & 6 share the masked slabs. A full queue holds back the stages
+ * before it, so the stages overlap while only a few slabs are in memory
+ * rather than whole volumes. The results are the same as running the steps
+ * one by one on the whole level. At last blocks are sampled from the
+ * regions at sampleLevel & summarized by their histograms, see
+ * sampleBlockStats. Only the slice marker model works in the pipeline.
+ *
+ * Params (besides those of the steps):
+ *
+ * slabDepth: slices of a slab, the z size of the teraconvert blocks by default;
+ *
+ * queueDepth: the most slabs waiting between 2 stages, 2 by default;
+ *
+ * regionThreshold: threshold of the regions, estimated by regionK if not
+ * given, see estimateThreshold;
+ *
+ * thresholdSlabs: slabs sampled to estimate the threshold when the level is
+ * the coarsest, 4 by default;
+ *
+ * histBins: bins of the histograms, a bin per value for integer pixels by default;
+ *
+ * histRange: lo,hi the histogram of a float level is binned over, required
+ * for floats as the level isn't read ahead for its range;
+ *
+ * analyze: n to only remove the markers, saving the slabs to the sinks &
+ * projecting them, without regions, local maxima & samples. y by default.
+ *
+ */
+
+bool runOnePot(TeraPyramid& pyramid, int level, int sampleLevel, const QVariantMap& params,
+               QcOnePotResult& result, const QcOnePotSinks& sinks)
+{
+    QcTraceScope traceScope("one-pot");
+    try
+    {
+        if (level < 0 || level > pyramid.coarsest() || sampleLevel < 0 || sampleLevel > pyramid.coarsest())
+            throw invalid_argument("Illegal level. Levels are numbered from 0 (finest) to the coarsest.");
+        QElapsedTimer timer;
+        timer.start();
+        result.report.clear();
+        auto threads = threadCount(params);
+        auto histBins = params.value("histBins", 0).toInt();
+        TeraManifest manifest;
+        if (!pyramid.manifest(level, manifest))
+            throw runtime_error("Failed to get the manifest of the level.");
+        const auto& sz = manifest.sz;
+        auto depth = sz[2];
+        if (depth <= 0 || manifest.tiles.isEmpty())
+            throw runtime_error("The level is empty.");
+
+        // slabs as deep as the blocks by default, so a block is decoded once
+        auto blockDepth = manifest.tiles[0].sz[2] > 0 ? manifest.tiles[0].sz[2] : V3DLONG(64);
+        auto slabDepth = qMax(V3DLONG(1), params.value("slabDepth", blockDepth).toLongLong());
+        auto queueDepth = qMax(1, params.value("queueDepth", 2).toInt());
+
+        auto analyze = !params.value("analyze", "y").toString().toLower().startsWith("n");
+        auto writing = sinks.mask != NULL || sinks.removed != NULL || sinks.maskRuns != NULL;
+        if (sinks.maskRuns != NULL)
+        {
+            V3DLONG msz[3] = {sz[0], sz[1], 0};
+            sinks.maskRuns->create(msz);
+        }
+
+        auto threshold = params.value("regionThreshold", 0).toDouble();
+        if (analyze && !params.contains("regionThreshold"))
+            threshold = estimateThreshold(pyramid, level, sz, slabDepth, params);
+
+        MarkerStream markers(sz, params);
+        PeakStream peaks(depth, params);
+        RegionAccumulator regions(threshold);
+        auto cvtype = qcCvType(manifest.datatype);
+        Mat markerMax = Mat::zeros(int(sz[1]), int(sz[0]), cvtype);
+        Mat removedMax = Mat::zeros(int(sz[1]), int(sz[0]), cvtype);
+        auto range = params.value("histRange").toString().split(',');
+        if (manifest.datatype == V3D_FLOAT32 && range.size() != 2)
+            throw invalid_argument("Float levels need histRange=lo,hi for their histogram.");
+        result.histogram = range.size() == 2 ?
+                    QcHistogram::forType(manifest.datatype, histBins, range[0].toDouble(), range[1].toDouble()) :
+                    QcHistogram::forType(manifest.datatype, histBins);
+        qint64 markerVoxels = 0;
+
+        BoundedQueue<SlabItem> loaded(queueDepth), marked(queueDepth), toRegions(queueDepth), toPeaks(queueDepth),
+                toWriter(queueDepth);
+        vector<function<void()> > stages;
+        stages.push_back([&]() {
+            for (V3DLONG z0 = 0; z0 < depth; z0 += slabDepth)
+            {
+                SlabItem item = {z0, QSharedPointer<QcImage>(new QcImage), QSharedPointer<QcMask>()};
+                if (!pyramid.loadRoi(level, QcRoi(0, 0, z0, sz[0], sz[1], qMin(depth, z0 + slabDepth)), *item.image))
+                    throw runtime_error("Failed to load a slab.");
+                if (!loaded.push(item)) return;
+            }
+            loaded.close();
+        });
+        stages.push_back([&]() {
+            // slabs waiting for their masks
+            deque<SlabItem> pending;
+            SlabItem item;
+            while (loaded.pop(item))
+            {
+                if (!markers.addSlab(*item.image, item.z0))
+                    throw runtime_error("Finding markers failed.");
+                pending.push_back(item);
+                while (!pending.empty() && pending.front().z0 + pending.front().image->sz[2] <= markers.finished())
+                {
+                    auto next = pending.front();
+                    pending.pop_front();
+                    next.mask = QSharedPointer<QcMask>(new QcMask);
+                    if (!markers.takeMask(next.z0, next.z0 + next.image->sz[2], *next.mask))
+                        throw runtime_error("Finding markers failed.");
+                    if (!marked.push(next)) return;
+                }
+            }
+            marked.close();
+        });
+        stages.push_back([&]() {
+            SlabItem item;
+            while (marked.pop(item))
+            {
+                if (!maskProjectSlab(*item.image, *item.mask, markerMax, removedMax, threads) ||
+                        !computeHistogram(*item.image, result.histogram, item.mask.data(), true, threads))
+                    throw runtime_error("Removing markers failed.");
+                markerVoxels += item.mask->count();
+                if (writing && !toWriter.push(item)) return;
+                item.mask.clear();
+                if (analyze && (!toRegions.push(item) || !toPeaks.push(item))) return;
+            }
+            toRegions.close();
+            toPeaks.close();
+            toWriter.close();
+        });
+        if (analyze)
+        {
+            stages.push_back([&]() {
+                SlabItem item;
+                while (toRegions.pop(item))
+                    if (!regions.addSlab(*item.image, item.z0))
+                        throw runtime_error("Unsupported pixel type.");
+            });
+            stages.push_back([&]() {
+                SlabItem item;
+                while (toPeaks.pop(item))
+                    if (!peaks.addSlab(item.image, item.z0))
+                        throw runtime_error("Finding local maxima failed.");
+            });
+        }
+        if (writing)
+            stages.push_back([&]() {
+                SlabItem item;
+                QcImage dense;
+                while (toWriter.pop(item))
+                {
+                    // masks are expanded to 8bit a slab at a time
+                    if (sinks.mask != NULL && (!item.mask->toImage(dense) || !sinks.mask->write(dense)))
+                        throw runtime_error("Saving the marker mask failed.");
+                    if (sinks.maskRuns != NULL)
+                    {
+                        auto& runs = *sinks.maskRuns;
+                        runs.planes.insert(runs.planes.end(), item.mask->planes.begin(), item.mask->planes.end());
+                        runs.sz[2] += item.mask->sz[2];
+                    }
+                    if (sinks.removed != NULL && !sinks.removed->write(*item.image))
+                        throw runtime_error("Saving the image without markers failed.");
+                }
+                if ((sinks.mask != NULL && !sinks.mask->finish()) ||
+                        (sinks.removed != NULL && !sinks.removed->finish()))
+                    throw runtime_error("Saving failed.");
+            });
+        runStages(stages, [&]() {
+            loaded.cancel();
+            marked.cancel();
+            toRegions.cancel();
+            toPeaks.cancel();
+            toWriter.cancel();
+        });
+        auto streamMs = timer.elapsed();
+
+        projectionTo8bit(markerMax, result.markerProj);
+        projectionTo8bit(removedMax, result.removedProj);
+        result.regions.clear();
+        result.peaks.clear();
+        result.samples.clear();
+        if (analyze)
+        {
+            regions.regions(result.regions, params.value("regionMinVolume", 27).toLongLong());
+            auto maxRegions = params.value("maxRegions", 0).toInt();
+            if (maxRegions > 0 && result.regions.size() > maxRegions)
+                result.regions.resize(maxRegions);
+            if (!peaks.peaks(result.peaks))
+                throw runtime_error("Finding local maxima failed.");
+
+            QVector<QcBlockSample> samples;
+            if (!planBlockSamples(pyramid, result.regions, level, sampleLevel, params, samples))
+                throw runtime_error("Planning samples failed.");
+            if (!sampleBlockStats(pyramid, sampleLevel, samples, histBins, threads, result.samples,
+                                  &result.report))
+                throw runtime_error("Fetching samples failed.");
+        }
+
+        auto& r = result.report;
+        const auto& h = result.histogram;
+        r["level"] = level;
+        r["sampleLevel"] = sampleLevel;
+        r["slabDepth"] = slabDepth;
+        r["slabs"] = (depth + slabDepth - 1) / slabDepth;
+        r["voxels"] = sz[0] * sz[1] * depth;
+        r["markerVoxels"] = markerVoxels;
+        if (sinks.maskRuns != NULL)
+            r["maskBytes"] = sinks.maskRuns->bytes();
+        r["regionThreshold"] = threshold;
+        r["regions"] = result.regions.size();
+        r["peaks"] = result.peaks.size();
+        r["samples"] = result.samples.size();
+        r["p1"] = h.percentile(1);
+        r["p50"] = h.percentile(50);
+        r["p99"] = h.percentile(99);
+        r["mean"] = h.mean();
+        r["stddev"] = h.stddev();
+        r["snr"] = h.snr();
+        r["entropy"] = h.entropy();
+        r["streamMs"] = streamMs;
+        r["totalMs"] = timer.elapsed();
+        return true;
+    }
+    catch(exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        result.markerProj.clear();
+        result.removedProj.clear();
+        result.peaks.clear();
+        result.regions.clear();
+        result.samples.clear();
+        return false;
+    }
+}
+
+/*
+ * Save the results of the one-pot pipeline, all named by prefix
+ *
+ * _marker_2d.tif & _removed_2d.tif: the projections;
+ *
+ * _maxima.csv, _regions.csv & _samples.csv: see writePeaks, writeRegions & writeBlockStats;
+ *
+ * _qc.csv: the report, see writeQcReport.
+ *
+ */
+
+bool writeOnePot(const QString& prefix, const QcOnePotResult& result, const Saver& saver)
+{
+    QcTraceScope traceScope("write one-pot");
+    auto save = [&](const QcImage& img, const QString& path) {
+        if (saver(path.toStdString().c_str(), img))
+            return true;
+        cerr << "ERROR: Failed to write " << path.toStdString() << endl;
+        return false;
+    };
+    return save(result.markerProj, prefix + "_marker_2d.tif") &&
+            save(result.removedProj, prefix + "_removed_2d.tif") &&
+            writePeaks(prefix + "_maxima.csv", result.peaks) &&
+            writeRegions(prefix + "_regions.csv", result.regions) &&
+            writeBlockStats(prefix + "_samples.csv", result.samples) &&
+            writeQcReport(prefix + "_qc.csv", result.report);
+}
+
+// save a report as csv, a key & its value per row
+bool writeQcReport(const QString& path, const QVariantMap& report)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+        cerr << "ERROR: Failed to write " << path.toStdString() << endl;
+        return false;
+    }
+    QTextStream out(&file);
+    out << "key,value\n";
+    for (auto it = report.constBegin(); it != report.constEnd(); ++it)
+        out << it.key() << ',' << it.value().toString() << '\n';
+    return true;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef ONEPOT_H
+#define ONEPOT_H
+
+#include "qcBasic.h"
+#include "TeraQCTypes.h"
+#include "teraPyramid.h"
+#include "histogram.h"
+#include "regions.h"
+#include "roiSampling.h"
+#include "slabWriter.h"
+#include "runMask.h"
+
+// everything the one-pot pipeline gets from a brain
+struct QcOnePotResult
+{
+    // 8bit xy maximum projections of the markers & of the rest
+    QcImage markerProj, removedProj;
+    // histogram of the voxels off the markers
+    QcHistogram histogram;
+    QVector<QcPeak> peaks;
+    QVector<QcRegion> regions;
+    QVector<QcBlockStats> samples;
+    // counters & summary statistics
+    QVariantMap report;
+};
+
+// volumes saved slab by slab as the pipeline makes them, none if null
+struct QcOnePotSinks
+{
+    QcOnePotSinks(): mask(NULL), removed(NULL), maskRuns(NULL) {}
+    // 8bit marker mask & the image without the markers
+    SlabWriter* mask;
+    SlabWriter* removed;
+    // the whole marker mask as runs
+    QcMask* maskRuns;
+};
+
+bool runOnePot(TeraPyramid& pyramid, int level, int sampleLevel, const QVariantMap& params,
+               QcOnePotResult& result, const QcOnePotSinks& sinks=QcOnePotSinks());
+
+bool writeOnePot(const QString& prefix, const QcOnePotResult& result, const Saver& saver);
+
+bool writeQcReport(const QString& path, const QVariantMap& report);
+
+#endif // ONEPOT_H
@@ -0,0 +1,194 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef PARALLELUTILS_H
+#define PARALLELUTILS_H
+
+#include "qcBasic.h"
+#include "trace.h"
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <condition_variable>
+#include <exception>
+
+/*
+ * Run func(i, worker) for every i in [begin, end) on a number of threads
+ *
+ * Indices are handed out one at a time, so uneven work is balanced.
+ * worker is the index of the thread in [0, threads), so each thread can
+ * keep its own scratch buffers. The first exception thrown by func stops
+ * the other threads from taking new indices and is rethrown in the calling
+ * thread. With threads <= 1 the loop runs in the calling thread. While
+ * tracing, the CPU time of the other threads is added to the open scope.
+ */
+template <class Func>
+void parallelForWorker(V3DLONG begin, V3DLONG end, int threads, const Func& func)
+{
+    if (threads <= 1 || end - begin <= 1)
+    {
+        for (V3DLONG i = begin; i < end; ++i) func(i, 0);
+        return;
+    }
+    std::atomic<V3DLONG> next(begin);
+    std::atomic<bool> failed(false);
+    std::exception_ptr error;
+    std::mutex m;
+    auto tracing = QcTrace::isEnabled();
+    double workerCpuMs = 0;
+    auto work = [&](int worker) {
+        auto cpuStart = tracing && worker > 0 ? qcThreadCpuMs() : 0.0;
+        for (V3DLONG i = next++; i < end && !failed; i = next++)
+        {
+            try
+            {
+                func(i, worker);
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lk(m);
+                if (!failed) error = std::current_exception();
+                failed = true;
+            }
+        }
+        if (tracing && worker > 0)
+        {
+            std::lock_guard<std::mutex> lk(m);
+            workerCpuMs += qcThreadCpuMs() - cpuStart;
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads && t < end - begin; ++t)
+        workers.push_back(std::thread(work, t));
+    work(0);
+    for (auto& w: workers) w.join();
+    if (tracing) QcTrace::addCpu(workerCpuMs);
+    if (error) std::rethrow_exception(error);
+}
+
+// run func(i) for every i in [begin, end) on a number of threads, see parallelForWorker
+template <class Func>
+void parallelFor(V3DLONG begin, V3DLONG end, int threads, const Func& func)
+{
+    parallelForWorker(begin, end, threads, [&func](V3DLONG i, int) { func(i); });
+}
+
+// number of threads to use, from the threads param or all cores by default
+inline int threadCount(const QVariantMap& params, const QString& key="threads")
+{
+    auto n = params.value(key, QThread::idealThreadCount()).toInt();
+    return n > 0 ? n : 1;
+}
+
+/*
+ * Queue of a bounded number of items between pipeline stages
+ *
+ * push blocks while the queue is full & pop while it's empty, so a fast
+ * producer is held back by a slow consumer and the items in flight stay
+ * bounded. A closed queue is drained before pop returns false; a cancelled
+ * queue makes both push & pop return false at once.
+ */
+template <class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity):
+        capacity(capacity > 0 ? capacity : 1), closed(false), cancelled(false), peak(0) {}
+
+    bool push(const T& item)
+    {
+        std::unique_lock<std::mutex> lk(m);
+        notFull.wait(lk, [this]() { return items.size() < capacity || cancelled; });
+        if (cancelled) return false;
+        items.push_back(item);
+        if (items.size() > peak) peak = items.size();
+        notEmpty.notify_one();
+        return true;
+    }
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lk(m);
+        notEmpty.wait(lk, [this]() { return !items.empty() || closed || cancelled; });
+        if (cancelled || items.empty()) return false;
+        item = items.front();
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+    // no more items will be pushed
+    void close()
+    {
+        std::lock_guard<std::mutex> lk(m);
+        closed = true;
+        notEmpty.notify_all();
+    }
+    // drop the items & wake up all waiting stages
+    void cancel()
+    {
+        std::lock_guard<std::mutex> lk(m);
+        cancelled = true;
+        items.clear();
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+    // the most items queued at once
+    size_t peakSize() const { std::lock_guard<std::mutex> lk(m); return peak; }
+
+private:
+    std::deque<T> items;
+    size_t capacity;
+    bool closed, cancelled;
+    size_t peak;
+    mutable std::mutex m;
+    std::condition_variable notEmpty, notFull;
+};
+
+/*
+ * Run pipeline stages, each on its own thread, until all of them return
+ *
+ * The first exception thrown by a stage calls cancel, which should cancel
+ * the queues between the stages so the others return, and is rethrown in
+ * the calling thread. While tracing, the CPU time of the stages is added to
+ * the open scope.
+ */
+inline void runStages(const std::vector<std::function<void()> >& stages, const std::function<void()>& cancel)
+{
+    std::exception_ptr error;
+    std::mutex m;
+    auto tracing = QcTrace::isEnabled();
+    double stageCpuMs = 0;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < stages.size(); ++i)
+        threads.push_back(std::thread([&, i]() {
+            auto cpuStart = tracing ? qcThreadCpuMs() : 0.0;
+            try
+            {
+                stages[i]();
+            }
+            catch (...)
+            {
+                bool first;
+                {
+                    std::lock_guard<std::mutex> lk(m);
+                    first = !error;
+                    if (first) error = std::current_exception();
+                }
+                if (first) cancel();
+            }
+            if (tracing)
+            {
+                std::lock_guard<std::mutex> lk(m);
+                stageCpuMs += qcThreadCpuMs() - cpuStart;
+            }
+        }));
+    for (auto& t: threads) t.join();
+    if (tracing) QcTrace::addCpu(stageCpuMs);
+    if (error) std::rethrow_exception(error);
+}
+
+#endif // PARALLELUTILS_H
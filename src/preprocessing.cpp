@@ -4,11 +4,186 @@
 */
 
 #include "preprocessing.h"
+#include "imageView.h"
+#include "parallelUtils.h"
+#include "projection.h"
+#include "trace.h"
+#include <algorithm>
 #include "opencv2/opencv.hpp"
 
 using namespace std;
 using namespace cv;
 
+// rows of a block read by a thread at each z in maskProject8bit
+static const V3DLONG MASK_PROJECT_BLOCK_ROWS = 64;
+
+/*
+ * Non-maximum suppression of a row of gradient magnitudes
+ *
+ * The gradient direction is folded into [-90, 90), since the suppression is
+ * symmetric to the opposite direction, and then falls in one of 4 sectors
+ * of 45 degrees, [-90, -45), [-45, 0), [0, 45), [45, 90). In each sector the
+ * magnitudes on both sides are interpolated between 2 neighbours, with the
+ * weight tan(angle - sector start) computed from dx & dy directly, e.g.
+ * tan(t - 45) = (dy - dx) / (dx + dy). The sector is chosen by selects
+ * rather than branches, so the loop can be vectorized by the compiler
+ * (gcc needs -fno-trapping-math to if-convert the float comparisons).
+ *
+ * m0, m1, m2: magnitude rows above, at and below the row;
+ *
+ * gx, gy: gradient of the row;
+ *
+ * out: output row, magnitudes that are not local maxima are set to 0.
+ *
+ */
+
+static void nmsRow(const float* m0, const float* m1, const float* m2,
+                   const float* gx, const float* gy, float* out, int cols)
+{
+    for (int j = 1; j < cols - 1; ++j)
+    {
+        // neighbours
+        float a0 = m0[j - 1], a1 = m0[j], a2 = m0[j + 1];
+        float b0 = m1[j - 1], g = m1[j], b2 = m1[j + 1];
+        float c0 = m2[j - 1], c1 = m2[j], c2 = m2[j + 1];
+
+        // 90 degrees is folded to -90
+        bool flip = (gx[j] < 0) | ((gx[j] == 0) & (gy[j] > 0));
+        float x = flip ? -gx[j] : gx[j];
+        float y = flip ? -gy[j] : gy[j];
+
+        // sector [-90, -45), [-45, 0), [45, 90), otherwise [0, 45)
+        bool s0 = -y > x;
+        bool s1 = !s0 & (y < 0);
+        bool s3 = !s0 & !s1 & (y >= x);
+
+        // weight as num / den & the neighbours to interpolate, selected by sector
+        float num = y, den = x, g0u = a0, g0d = b0, g1u = c2, g1d = b2;
+        num = s3 ? y - x : num; den = s3 ? x + y : den;
+        g0u = s3 ? a1 : g0u; g0d = s3 ? a0 : g0d; g1u = s3 ? c1 : g1u; g1d = s3 ? c2 : g1d;
+        num = s1 ? y + x : num; den = s1 ? x - y : den;
+        g0u = s1 ? b0 : g0u; g0d = s1 ? c0 : g0d; g1u = s1 ? b2 : g1u; g1d = s1 ? a2 : g1d;
+        num = s0 ? -x : num; den = s0 ? y : den;
+        g0u = s0 ? c0 : g0u; g0d = s0 ? c1 : g0d; g1u = s0 ? a2 : g1u; g1d = s0 ? a1 : g1d;
+        // NaN only for a zero gradient, where g is 0 anyway
+        float k = num / den;
+
+        float g0 = k * (g0u - g0d) + g0d;
+        float g1 = k * (g1u - g1d) + g1d;
+        out[j] = ((g > g0) & (g > g1)) ? g : 0.0f;
+    }
+}
+
+// a horizontal run of candidate edge pixels, a node of the union-find forest
+struct EdgeRun
+{
+    // first & past the last column
+    int start, end;
+    // index of the parent run, itself for a root
+    int parent;
+    // whether the component holds a strong pixel, only valid for roots
+    bool strong;
+};
+
+// buffers of the hysteresis, kept by a thread across slices
+struct HysteresisScratch
+{
+    vector<EdgeRun> runs;
+    vector<int> rowStart;
+};
+
+static int findRoot(vector<EdgeRun>& runs, int i)
+{
+    while (runs[i].parent != i)
+    {
+        // path halving
+        runs[i].parent = runs[runs[i].parent].parent;
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+static void unionRuns(vector<EdgeRun>& runs, int a, int b)
+{
+    a = findRoot(runs, a);
+    b = findRoot(runs, b);
+    if (a == b) return;
+    // the earlier run stays the root, keeping the forest shallow in scan order
+    if (b < a) swap(a, b);
+    runs[b].parent = a;
+    runs[a].strong = runs[a].strong || runs[b].strong;
+}
+
+/*
+ * Hysteresis thresholding by connected components of pixel runs
+ *
+ * Candidate pixels are nonzero & no less than the low threshold, and a
+ * component of candidates in 8-connectivity is kept if it has a pixel above
+ * the high threshold. Each row is scanned into runs of candidates, runs
+ * touching those of the previous row are merged in a union-find forest, and
+ * the runs of strong components are painted at last. The runs grow with the
+ * candidates in the buffers of scratch, which keep their capacity, so a
+ * thread only allocates them for its first slices.
+ *
+ * nms: float32 magnitudes after non-maximum suppression;
+ *
+ * edges: 8bit output, 255 for edges & 0 otherwise.
+ *
+ */
+
+static void hysteresis(const Mat& nms, float low, float high, OutputArray edges, HysteresisScratch& scratch)
+{
+    auto& runs = scratch.runs;
+    auto& rowStart = scratch.rowStart;
+    runs.clear();
+    rowStart.assign(nms.rows + 1, 0);
+    for (int i = 0; i < nms.rows; ++i)
+    {
+        rowStart[i] = int(runs.size());
+        auto row = nms.ptr<float>(i);
+        for (int j = 0; j < nms.cols;)
+        {
+            if (row[j] < low || row[j] == 0.0f)
+            {
+                ++j;
+                continue;
+            }
+            EdgeRun run;
+            run.start = j;
+            run.parent = int(runs.size());
+            run.strong = false;
+            for (; j < nms.cols && row[j] >= low && row[j] != 0.0f; ++j)
+                run.strong = run.strong || row[j] > high;
+            run.end = j;
+            runs.push_back(run);
+        }
+
+        // merge with the runs of the previous row, diagonal neighbours included
+        if (i == 0) continue;
+        int a = rowStart[i - 1], aEnd = rowStart[i];
+        int b = rowStart[i], bEnd = int(runs.size());
+        while (a < aEnd && b < bEnd)
+        {
+            if (runs[a].start <= runs[b].end && runs[b].start <= runs[a].end)
+                unionRuns(runs, a, b);
+            // advance the run ending first
+            if (runs[a].end < runs[b].end) ++a;
+            else ++b;
+        }
+    }
+    rowStart[nms.rows] = int(runs.size());
+
+    edges.create(nms.size(), CV_8U);
+    auto out = edges.getMat();
+    out.setTo(0);
+    for (int i = 0; i < nms.rows; ++i)
+    {
+        auto row = out.ptr<uchar>(i);
+        for (int r = rowStart[i]; r < rowStart[i + 1]; ++r)
+            if (runs[findRoot(runs, r)].strong)
+                memset(row + runs[r].start, UCHAR_MAX, runs[r].end - runs[r].start);
+    }
+}
 
 /*
  * Custom Canny Edge Detection
@@ -17,107 +192,38 @@ using namespace cv;
  * qt-4.8.6 and msvc120, it has to be realized with functions in opencv 3.1.
  * It assumes the pixel type to be 16bit and calculate gradient using float32.
  * The thresholds are defined as ratios of the maxiumal magnitude, not fixed values.
+ * The maximum is gradientMax if it's positive, e.g. that of the whole slice when
+ * only a part of it is given, or else that of the input. It's returned.
  *
  */
-void Canny16bit(InputArray in, OutputArray edges, double threshold1, double threshold2)
+static double Canny16bit(InputArray in, OutputArray edges, double threshold1, double threshold2,
+                         double gradientMax, HysteresisScratch& scratch)
 {
+    QcTraceScope traceScope("canny");
     assert(threshold1 < threshold2 && threshold1 >= 0 && threshold2 <= 1);
-    int di[5] = {1, 1, 0,-1,-1};
-    int dj[5] = {0,-1,-1,-1, 0};
-    Mat dx, dy, phi, mag;
+    Mat dx, dy, mag;
     Sobel(in, dx, CV_32F, 1, 0);
     Sobel(in, dy, CV_32F, 0, 1);
     magnitude(dx, dy, mag);
-    phase(dx, dy, phi);
-    double min, max;
-    minMaxLoc(mag, &min, &max);
+    double min, max = gradientMax;
+    if (max <= 0)
+        minMaxLoc(mag, &min, &max);
     auto low = max * threshold1;
     auto high = max * threshold2;
-    // NMS
+    // NMS, the borders are kept as they are
     Mat nms = mag.clone();
     for (int i = 1; i < mag.rows - 1; ++i)
-    {
-        for (int j = 1; j < mag.cols - 1; ++j)
-        {
-            auto g = mag.at<float>(i, j);
-            if (g == 0.0f) continue;
-            auto t = phi.at<float>(i, j);
-            int ind;
-            double k;
-            if (t >= -CV_PI/2 && t < -CV_PI/4)
-            {
-                k = tan(t + CV_PI/2);
-                ind = 0;
-            }
-            else if (t >= -CV_PI/4 && t < 0)
-            {
-                k = tan(t + CV_PI/4);
-                ind = 1;
-            }
-            else if (t >= 0 && t < CV_PI/4)
-            {
-                k = tan(t);
-                ind = 2;
-            }
-            else
-            {
-                k = tan(t - CV_PI/4);
-                ind = 3;
-            }
-            auto g0u = mag.at<float>(i+di[ind+1], j+dj[ind+1]);
-            auto g0d = mag.at<float>(i+di[ind], j+dj[ind]);
-            auto g1u = mag.at<float>(i-di[ind+1], j-dj[ind+1]);
-            auto g1d = mag.at<float>(i-di[ind], j-dj[ind]);
-            auto g0 = k * (g0u - g0d) + g0d;
-            auto g1 = k * (g1u - g1d) + g1d;
-            if (g <= g0 || g <= g1) nms.at<float>(i, j) = 0.0f;
-        }
-    }
-
-    // double threshold
-    QQueue<QPoint> q;
-    for (int i = 0; i < nms.rows; ++i)
-    {
-        for (int j = 0; j < nms.cols; ++j)
-        {
-            auto& x = nms.ptr<float>(i)[j];
-            if (x > high)
-            {
-                x = FLT_MAX;
-                // seeds
-                q.enqueue(QPoint(i, j));
-            }
-            if (x < low)
-                x = 0.0f;
-        }
-    }
-
-    // linking
-    while (!q.isEmpty())
-    {
-        auto h = q.dequeue();
-        for (int m = -1; m <= 1; ++m)
-            for (int n = -1; n <= 1; ++n)
-            {
-                auto i = h.y() + m;
-                auto j = h.x() + n;
-                if (i < 0 || i >= nms.rows || j < 0 || j >= nms.cols) continue;
-                auto& x = nms.ptr<float>(i)[j];
-                if (x == FLT_MAX || x == 0.0f) continue;
-                x = FLT_MAX;
-                q.enqueue(QPoint(i, j));
-            }
-    }
+        nmsRow(mag.ptr<float>(i - 1), mag.ptr<float>(i), mag.ptr<float>(i + 1),
+               dx.ptr<float>(i), dy.ptr<float>(i), nms.ptr<float>(i), mag.cols);
 
-    // clearing
-    for (int i = 0; i < nms.rows; ++i)
-        for (int j = 0; j < nms.cols; ++j)
-        {
-            auto& x = nms.ptr<float>(i)[j];
-            if (x < FLT_MAX) x = 0.0f;
-        }
+    hysteresis(nms, float(low), float(high), edges, scratch);
+    return max;
+}
 
-    convertScaleAbs(nms, edges, UCHAR_MAX / FLT_MAX);
+double Canny16bit(InputArray in, OutputArray edges, double threshold1, double threshold2, double gradientMax)
+{
+    HysteresisScratch scratch;
+    return Canny16bit(in, edges, threshold1, threshold2, gradientMax, scratch);
 }
 
 
@@ -148,25 +254,24 @@ bool testLine(const Vec4i& line,
               int layer,
               double minDist,
               double angleLim,
-              const QVector3D& size,
+              const Point3d& size,
               double zThickness)
 {
-    auto center = size / 2 * QVector3D(1, 1, zThickness);
+    auto center = Point3d(size.x / 2, size.y / 2, size.z / 2 * zThickness);
     auto qline = QLineF(line[0], line[1], line[2], line[3]);
 
     // test if the line's distance to image's center is greater than the threshold
     auto testDistance = [&](const QLineF& line)
     {
-        auto p1 = QVector3D(line.p1()), p2 = QVector3D(line.p2());
-        p1.setZ(layer * zThickness);
-        p2.setZ(layer * zThickness);
-        return QVector3D::crossProduct(p2 - center, p1 - center).length() / (p2 - p1).length() >= minDist;
+        auto p1 = Point3d(line.x1(), line.y1(), layer * zThickness);
+        auto p2 = Point3d(line.x2(), line.y2(), layer * zThickness);
+        return norm((p2 - center).cross(p1 - center)) / norm(p2 - p1) >= minDist;
     };
 
     // test if the line's orientation is horizontal or vertical (within threshold in degrees)
     auto testAngle = [&](const QLineF& line)
     {
-        if (size.x() > size.y())
+        if (size.x > size.y)
             return abs(line.angleTo(QLineF(0, 1, 0, 0))) <= angleLim ||
                     abs(line.angleTo(QLineF(0, -1, 0, 0))) <= angleLim;
         else
@@ -178,6 +283,519 @@ bool testLine(const Vec4i& line,
 }
 
 
+// parsed params of marker finding, see findMarkers
+struct MarkerParams
+{
+    int se1, se2, se3, houghDistanceRes, houghAngleRes, houghThreshold,
+            houghMinLineLength, houghMaxLineGap, lineWidth, threads;
+    double filterMinDistance, filterAngleLimit, zThickness, extendRatio, cannyMin, cannyMax, sigma,
+            voxelSize, detectScale, refineBand, modelTolerance;
+    bool volumeModel;
+    int modelStep, modelMinSegments, modelIterations, seed;
+
+    explicit MarkerParams(const QVariantMap& params)
+    {
+        se1 = params.value("se1", 11).toUInt();
+        se2 = params.value("se2", 5).toUInt();
+        se3 = params.value("se3", 21).toUInt();
+        houghDistanceRes = params.value("houghDistanceRes", 1).toUInt();
+        houghAngleRes = params.value("houghAngleRes", 180).toUInt();
+        houghThreshold = params.value("houghThreshold", 100).toUInt();
+        houghMinLineLength = params.value("houghMinLineLength", 100).toUInt();
+        houghMaxLineGap = params.value("houghMaxLineGap", 1).toUInt();
+        lineWidth = params.value("lineWidth", 3).toUInt();
+        threads = threadCount(params);
+
+        extendRatio = params.value("extendRatio", 0.2).toDouble();
+        filterMinDistance = params.value("filterMinDistance", 300.0).toDouble();
+        filterAngleLimit = params.value("angleLimit", 5.0).toDouble();
+        zThickness = params.value("zThickness", 2.0).toDouble();
+        cannyMin = params.value("cannyMin", 0.05).toDouble();
+        cannyMax = params.value("cannyMax", 0.15).toDouble();
+        sigma = params.value("sigma", 1.0).toDouble();
+        detectScale = params.value("detectScale", 1.0).toDouble();
+        refineBand = params.value("refineBand", 0.0).toDouble();
+        volumeModel = params.value("markerModel", "slice").toString() == "volume";
+        modelStep = qMax(1u, params.value("modelStep", 4).toUInt());
+        modelMinSegments = params.value("modelMinSegments", 3).toUInt();
+        modelIterations = params.value("modelIterations", 500).toUInt();
+        modelTolerance = params.value("modelTolerance", 5.0).toDouble();
+        seed = params.value("seed", 0).toInt();
+
+        // lengths in micrometers override those in voxels
+        voxelSize = params.value("voxelSize", 0.0).toDouble();
+        if (voxelSize > 0)
+        {
+            if (params.contains("minLineLengthUm"))
+                houghMinLineLength = qRound(params.value("minLineLengthUm").toDouble() / voxelSize);
+            if (params.contains("minDistanceUm"))
+                filterMinDistance = params.value("minDistanceUm").toDouble() / voxelSize;
+            if (params.contains("lineWidthUm"))
+                lineWidth = qMax(1, qRound(params.value("lineWidthUm").toDouble() / voxelSize));
+            if (params.contains("refineBandUm"))
+                refineBand = params.value("refineBandUm").toDouble() / voxelSize;
+            if (params.contains("detectVoxelSize"))
+                detectScale = voxelSize / params.value("detectVoxelSize").toDouble();
+        }
+        if (detectScale <= 0 || detectScale > 1)
+            detectScale = 1.0;
+        // by default the band covers the uncertainty of 2 coarse voxels
+        if (refineBand <= 0)
+            refineBand = 2.0 / detectScale;
+    }
+
+    // params for an image scaled by s in x & y
+    MarkerParams scaled(double s) const
+    {
+        auto scaledSize = [&](int k) {
+            return qMax(1, qRound(k * s));
+        };
+        auto q = *this;
+        q.se1 = scaledSize(se1);
+        q.se2 = scaledSize(se2);
+        q.houghThreshold = scaledSize(houghThreshold);
+        q.houghMinLineLength = scaledSize(houghMinLineLength);
+        q.houghMaxLineGap = scaledSize(houghMaxLineGap);
+        q.lineWidth = scaledSize(lineWidth);
+        q.filterMinDistance = filterMinDistance * s;
+        q.zThickness = zThickness * s;
+        q.sigma = qMax(sigma * s, 0.5);
+        return q;
+    }
+};
+
+// buffers of a marker finding thread, reused across slices
+struct MarkerScratch
+{
+    Mat smooth, edges, coarse, strip, patch;
+    vector<Vec4i> lines, coarseLines;
+    vector<Point> points;
+    HysteresisScratch hysteresis;
+};
+
+/*
+ * Detect marker lines in a z slice
+ *
+ * Steps 1-6 of findMarkers. The accepted lines are left in scratch.lines,
+ * in the order found by the hough transform. Returns the gradient maximum
+ * of the smoothed slice.
+ *
+ */
+
+static double detectSliceLines(const Mat& slice, int layer, const Point3d& size,
+                             const MarkerParams& p, MarkerScratch& scratch)
+{
+    QcTraceScope traceScope("detect lines");
+    auto k1 = getStructuringElement(MORPH_ELLIPSE, Size(p.se1, p.se1));
+    auto k2 = getStructuringElement(MORPH_ELLIPSE, Size(p.se2, p.se2));
+    auto gk = int(abs(p.sigma*3));
+    if (gk % 2 == 0) ++gk;
+    auto& smooth = scratch.smooth;
+    auto& edges = scratch.edges;
+    {
+        QcTraceScope closingScope("slice closing");
+        morphologyEx(slice, smooth, MORPH_CLOSE, k1);
+        GaussianBlur(smooth, smooth, Size(gk, gk), p.sigma);
+    }
+    // the canny function is only available after opencv 3.2
+    // so use the DIY canny instead
+    auto gradientMax = Canny16bit(smooth, edges, p.cannyMin, p.cannyMax, 0, scratch.hysteresis);
+    morphologyEx(edges, edges, MORPH_CLOSE, k2);
+    auto& lines = scratch.lines;
+    lines.clear();
+    {
+        QcTraceScope houghScope("hough");
+        HoughLinesP(edges, lines, p.houghDistanceRes, M_PI / p.houghAngleRes,
+                    p.houghThreshold, p.houghMinLineLength, p.houghMaxLineGap);
+    }
+    lines.erase(remove_if(lines.begin(), lines.end(), [&](const Vec4i& l) {
+        return !testLine(l, layer, p.filterMinDistance, p.filterAngleLimit, size, p.zThickness);
+    }), lines.end());
+    return gradientMax;
+}
+
+/*
+ * Refine lines found in a downsampled slice at the full resolution
+ *
+ * Each line is mapped to the slice, and the slice is resampled on a strip
+ * along it, refineBand voxels on both sides plus the margins of the filters.
+ * The edges are detected in the strip, with the thresholds relative to the
+ * gradient maximum of the whole slice, so that they don't depend on the
+ * contrast around the line. A line is fitted to the edge pixels in the band
+ * and the mapped end points are projected onto it. Lines without enough
+ * edge pixels in their band are kept as mapped. The cost is linear in the
+ * line length, whatever its orientation. The refined lines are left in
+ * scratch.lines.
+ *
+ * coarse: lines found in the slice scaled by scale in x & y;
+ *
+ * gradientMax: gradient maximum of the smoothed slice at the full resolution.
+ *
+ */
+
+static void refineSliceLines(const Mat& slice, const vector<Vec4i>& coarse, double scale, double gradientMax,
+                             const MarkerParams& p, MarkerScratch& scratch)
+{
+    QcTraceScope traceScope("refine lines");
+    auto k1 = getStructuringElement(MORPH_ELLIPSE, Size(p.se1, p.se1));
+    auto k2 = getStructuringElement(MORPH_ELLIPSE, Size(p.se2, p.se2));
+    auto gk = int(abs(p.sigma*3));
+    if (gk % 2 == 0) ++gk;
+    auto band = int(ceil(p.refineBand));
+    // reach of the closings, the blur & the sobel, kept out of the band
+    auto margin = p.se1 / 2 + gk / 2 + p.se2 / 2 + 1;
+    auto& lines = scratch.lines;
+    lines.clear();
+    for (size_t j = 0; j < coarse.size(); ++j)
+    {
+        // voxel centers of the coarse end points in the slice
+        Point2f p1((coarse[j][0] + 0.5f) / scale - 0.5f, (coarse[j][1] + 0.5f) / scale - 0.5f);
+        Point2f p2((coarse[j][2] + 0.5f) / scale - 0.5f, (coarse[j][3] + 0.5f) / scale - 0.5f);
+        Vec4i refined(qRound(p1.x), qRound(p1.y), qRound(p2.x), qRound(p2.y));
+        auto length = norm(p2 - p1);
+        if (length > 0)
+        {
+            // strip pixel (x, y) is at p1 + u * (x - margin) + n * (y - margin - band) in the slice
+            auto u = (p2 - p1) * float(1 / length);
+            auto n = Point2f(-u.y, u.x);
+            auto o = p1 - u * float(margin) - n * float(margin + band);
+            Matx23d m(u.x, n.x, o.x,
+                      u.y, n.y, o.y);
+            auto bandRect = Rect(margin, margin, int(ceil(length)) + 1, 2 * band + 1);
+            auto& strip = scratch.strip;
+            auto& smooth = scratch.smooth;
+            auto& edges = scratch.edges;
+            warpAffine(slice, strip, m, Size(bandRect.width + 2 * margin, bandRect.height + 2 * margin),
+                       INTER_LINEAR | WARP_INVERSE_MAP, BORDER_REPLICATE);
+            morphologyEx(strip, smooth, MORPH_CLOSE, k1);
+            GaussianBlur(smooth, smooth, Size(gk, gk), p.sigma);
+            Canny16bit(smooth, edges, p.cannyMin, p.cannyMax, gradientMax, scratch.hysteresis);
+            morphologyEx(edges, edges, MORPH_CLOSE, k2);
+            findNonZero(edges(bandRect), scratch.points);
+            // a marker gives edges on both of its sides, ask for at least a quarter of them
+            if (scratch.points.size() >= max(2.0, length / 2))
+            {
+                Vec4f fit;
+                fitLine(scratch.points, fit, DIST_HUBER, 0, 0.01, 0.01);
+                // back to the slice, the strip is only rotated & shifted
+                auto d = Point2f(u * fit[0] + n * fit[1]);
+                auto c = o + u * (fit[2] + margin) + n * (fit[3] + margin);
+                auto q1 = c + d * (p1 - c).dot(d);
+                auto q2 = c + d * (p2 - c).dot(d);
+                refined = Vec4i(qRound(q1.x), qRound(q1.y), qRound(q2.x), qRound(q2.y));
+            }
+        }
+        lines.push_back(refined);
+    }
+}
+
+/*
+ * Draw a thick line into a mask plane of some width
+ *
+ * The line is rasterized by cv::line as on a dense slice, but only on a
+ * patch around it, whose runs are added to the plane. Marker lines are
+ * close to the x or y axis, so the patch is a narrow band.
+ *
+ */
+
+static void drawMaskLine(QcMaskPlane& plane, V3DLONG width, Point p1, Point p2, int thickness, Mat& patch)
+{
+    // room for the round caps
+    auto r = thickness + 1;
+    auto box = Rect(Point(min(p1.x, p2.x) - r, min(p1.y, p2.y) - r),
+                    Point(max(p1.x, p2.x) + r + 1, max(p1.y, p2.y) + r + 1)) & Rect(0, 0, int(width), int(plane.rows()));
+    if (box.area() <= 0)
+        return;
+    patch.create(box.size(), CV_8U);
+    patch = 0;
+    line(patch, p1 - box.tl(), p2 - box.tl(), UCHAR_MAX, thickness);
+    plane.addDense(patch.data, patch.cols, patch.rows, patch.step, box.x, box.y);
+}
+
+// draw lines lengthened by extendRatio on both ends
+static void drawMarkerLines(QcMaskPlane& slice, V3DLONG width, const vector<Vec4i>& lines, const MarkerParams& p,
+                            Mat& patch)
+{
+    for (size_t j = 0; j < lines.size(); ++j)
+    {
+        // lengthen
+        auto p1 = Point2d(lines[j][0], lines[j][1]);
+        auto p2 = Point2d(lines[j][2], lines[j][3]);
+        auto d = p1 - p2;
+        p1 = p1 + d * p.extendRatio;
+        p2 = p2 - d * p.extendRatio;
+        // draw
+        drawMaskLine(slice, width, Point(int(p1.x), int(p1.y)), Point(int(p2.x), int(p2.y)), p.lineWidth, patch);
+    }
+}
+
+// a line found in a slice
+struct MarkerSegment
+{
+    Vec4i line;
+    int z;
+};
+
+/*
+ * A marker as a patch of a 3D plane
+ *
+ * Coordinates are in voxels with z multiplied by zThickness. The patch spans
+ * [tmin, tmax] along the line where it cuts a slice, and slices [z0, z1].
+ *
+ */
+struct MarkerPlane
+{
+    Vec3d normal;
+    double d, tmin, tmax;
+    int z0, z1;
+
+    double distance(const Vec3d& x) const
+    {
+        return abs(normal.dot(x) - d);
+    }
+    // unit direction of the line cutting a slice
+    Point2d direction() const
+    {
+        auto l = sqrt(normal[0] * normal[0] + normal[1] * normal[1]);
+        return Point2d(-normal[1] / l, normal[0] / l);
+    }
+    // the patch cut by slice z, as end points
+    void cut(int z, double zThickness, Point2d& p1, Point2d& p2) const
+    {
+        auto l2 = normal[0] * normal[0] + normal[1] * normal[1];
+        auto k = (d - normal[2] * z * zThickness) / l2;
+        auto p0 = Point2d(normal[0] * k, normal[1] * k);
+        auto u = direction();
+        p1 = p0 + u * tmin;
+        p2 = p0 + u * tmax;
+    }
+};
+
+// end points of segments in plane coordinates
+static void segmentPoints(const MarkerSegment& s, double zThickness, Vec3d& a, Vec3d& b)
+{
+    a = Vec3d(s.line[0], s.line[1], s.z * zThickness);
+    b = Vec3d(s.line[2], s.line[3], s.z * zThickness);
+}
+
+// least squares plane through the end points of segments, false if degenerate
+static bool fitPlane(const vector<MarkerSegment>& segments, const vector<int>& members,
+                     double zThickness, MarkerPlane& plane)
+{
+    Vec3d mean(0, 0, 0);
+    vector<Vec3d> points;
+    for (size_t i = 0; i < members.size(); ++i)
+    {
+        Vec3d a, b;
+        segmentPoints(segments[members[i]], zThickness, a, b);
+        points.push_back(a);
+        points.push_back(b);
+        mean += a + b;
+    }
+    mean *= 1.0 / points.size();
+    Matx33d cov = Matx33d::zeros();
+    for (size_t i = 0; i < points.size(); ++i)
+    {
+        auto x = points[i] - mean;
+        cov += x * x.t();
+    }
+    Mat values, vectors;
+    eigen(cov, values, vectors);
+    // the least varying direction, eigenvalues are in descending order
+    plane.normal = Vec3d(vectors.at<double>(2, 0), vectors.at<double>(2, 1), vectors.at<double>(2, 2));
+    plane.d = plane.normal.dot(mean);
+    // a plane parallel to the slices isn't a marker
+    return plane.normal[0] * plane.normal[0] + plane.normal[1] * plane.normal[1] > 0.25;
+}
+
+/*
+ * Fit marker planes to the segments found in a subset of slices
+ *
+ * Sequential RANSAC: a candidate plane goes through a segment & an end point
+ * of a segment in another slice, and is scored by the length of segments
+ * lying within modelTolerance of it. The best plane is refitted to its
+ * inliers by least squares, its inliers are removed, and it's repeated until
+ * no plane has modelMinSegments inliers. Random sampling is seeded, so the
+ * model is reproducible.
+ *
+ * step: the gap between the sampled slices, to extend the planes in z;
+ *
+ * depth: the number of slices.
+ *
+ */
+
+static vector<MarkerPlane> fitMarkerPlanes(const vector<MarkerSegment>& segments, int step, int depth,
+                                           const MarkerParams& p)
+{
+    vector<MarkerPlane> planes;
+    vector<int> remaining(segments.size());
+    for (size_t i = 0; i < segments.size(); ++i)
+        remaining[i] = int(i);
+    RNG rng(p.seed);
+    vector<int> inliers, best;
+
+    auto collectInliers = [&](const MarkerPlane& plane, vector<int>& out) {
+        out.clear();
+        double score = 0;
+        for (size_t i = 0; i < remaining.size(); ++i)
+        {
+            Vec3d a, b;
+            segmentPoints(segments[remaining[i]], p.zThickness, a, b);
+            if (plane.distance(a) <= p.modelTolerance && plane.distance(b) <= p.modelTolerance)
+            {
+                out.push_back(remaining[i]);
+                score += norm(a - b);
+            }
+        }
+        return score;
+    };
+
+    while (int(remaining.size()) >= max(2, p.modelMinSegments))
+    {
+        double bestScore = 0;
+        best.clear();
+        for (int it = 0; it < p.modelIterations; ++it)
+        {
+            auto& s1 = segments[remaining[rng.uniform(0, int(remaining.size()))]];
+            auto& s2 = segments[remaining[rng.uniform(0, int(remaining.size()))]];
+            if (s1.z == s2.z) continue;
+            Vec3d a, b, c, e;
+            segmentPoints(s1, p.zThickness, a, b);
+            segmentPoints(s2, p.zThickness, c, e);
+            auto n = (b - a).cross((rng.uniform(0, 2) ? c : e) - a);
+            if (norm(n) < 1e-6) continue;
+            MarkerPlane plane;
+            plane.normal = n * (1.0 / norm(n));
+            plane.d = plane.normal.dot(a);
+            auto score = collectInliers(plane, inliers);
+            if (score > bestScore)
+            {
+                bestScore = score;
+                best.swap(inliers);
+            }
+        }
+        if (best.empty() || int(best.size()) < p.modelMinSegments)
+            break;
+
+        MarkerPlane plane;
+        if (fitPlane(segments, best, p.zThickness, plane))
+        {
+            // the extent of the inliers, lengthened by extendRatio & the slice gap
+            auto u = plane.direction();
+            plane.tmin = DBL_MAX, plane.tmax = -DBL_MAX;
+            plane.z0 = depth, plane.z1 = -1;
+            for (size_t i = 0; i < best.size(); ++i)
+            {
+                auto& l = segments[best[i]].line;
+                auto t1 = u.dot(Point2d(l[0], l[1])), t2 = u.dot(Point2d(l[2], l[3]));
+                plane.tmin = min(plane.tmin, min(t1, t2));
+                plane.tmax = max(plane.tmax, max(t1, t2));
+                plane.z0 = min(plane.z0, segments[best[i]].z);
+                plane.z1 = max(plane.z1, segments[best[i]].z);
+            }
+            auto ext = (plane.tmax - plane.tmin) * p.extendRatio;
+            plane.tmin -= ext;
+            plane.tmax += ext;
+            plane.z0 = max(0, plane.z0 - step);
+            plane.z1 = min(depth - 1, plane.z1 + step);
+            planes.push_back(plane);
+        }
+
+        // drop the inliers even if the refit failed, so the loop ends
+        sort(best.begin(), best.end());
+        remaining.erase(remove_if(remaining.begin(), remaining.end(), [&](int i) {
+            return binary_search(best.begin(), best.end(), i);
+        }), remaining.end());
+    }
+    return planes;
+}
+
+// draw the cuts of marker planes by slice z
+static void drawMarkerPlanes(QcMaskPlane& slice, V3DLONG width, int z, const vector<MarkerPlane>& planes,
+                             const MarkerParams& p, Mat& patch)
+{
+    for (size_t j = 0; j < planes.size(); ++j)
+    {
+        if (z < planes[j].z0 || z > planes[j].z1) continue;
+        Point2d p1, p2;
+        planes[j].cut(z, p.zThickness, p1, p2);
+        drawMaskLine(slice, width, Point(qRound(p1.x), qRound(p1.y)), Point(qRound(p2.x), qRound(p2.y)),
+                     p.lineWidth, patch);
+    }
+}
+
+// finds & draws the marker lines of slices, each worker with its own scratch
+struct SliceMarkerFinder
+{
+    SliceMarkerFinder(const MarkerParams& p, const V3DLONG sz[3]):
+        p(p), s(p.detectScale), coarseParams(p.scaled(p.detectScale)), size(sz[0], sz[1], sz[2]),
+        coarseSize(qMax(1, qRound(sz[0] * s)), qMax(1, qRound(sz[1] * s)), sz[2]), scratch(p.threads) {}
+
+    // lines of slice i are left in the scratch of the worker
+    void detect(const Mat& inputSlice, V3DLONG i, int worker)
+    {
+        auto& sc = scratch[worker];
+        if (s < 1)
+        {
+            resize(inputSlice, sc.coarse, Size(int(coarseSize.x), int(coarseSize.y)), 0, 0, INTER_AREA);
+            auto gradientMax = detectSliceLines(sc.coarse, i, coarseSize, coarseParams, sc);
+            sc.coarseLines.swap(sc.lines);
+            // the slope of a smoothed edge per voxel goes with the width of the blur
+            refineSliceLines(inputSlice, sc.coarseLines, s, gradientMax * coarseParams.sigma / p.sigma, p, sc);
+        }
+        else
+            detectSliceLines(inputSlice, i, size, p, sc);
+    }
+
+    // each slice only draws its own lines, so the mask doesn't depend on the scheduling
+    void draw(const Mat& inputSlice, V3DLONG i, QcMaskPlane& outputSlice, int worker)
+    {
+        detect(inputSlice, i, worker);
+        outputSlice.reset(V3DLONG(size.y));
+        drawMarkerLines(outputSlice, V3DLONG(size.x), scratch[worker].lines, p, scratch[worker].patch);
+    }
+
+    const MarkerParams& p;
+    double s;
+    MarkerParams coarseParams;
+    Point3d size, coarseSize;
+    vector<MarkerScratch> scratch;
+};
+
+/*
+ * z interpolation of drawn mask planes, a closing by a column of slices
+ *
+ * A union then an intersection of the planes over the window of before &
+ * after slices of each slice, ignoring the slices out of the volume, same
+ * as the morphological closing of a dense mask by a column kernel.
+ *
+ * drawn: the drawn plane of a slice, asked for the slices in
+ * [z0 - 2 before, z1 + 2 after) within the volume;
+ *
+ * output: the closed planes of the slices [z0, z1).
+ *
+ */
+
+template <class Drawn>
+static void closeMaskZ(const Drawn& drawn, V3DLONG depth, V3DLONG before, V3DLONG after, V3DLONG z0, V3DLONG z1,
+                       QcMaskPlane* output, int threads)
+{
+    auto d0 = qMax(V3DLONG(0), z0 - before), d1 = qMin(depth, z1 + after);
+    vector<QcMaskPlane> dilated(d1 - d0);
+    parallelFor(d0, d1, threads, [&](V3DLONG z) {
+        vector<const QcMaskPlane*> window;
+        for (auto i = qMax(V3DLONG(0), z - before); i < qMin(depth, z + after + 1); ++i)
+            window.push_back(&drawn(i));
+        maskUnion(window, dilated[z - d0]);
+    });
+    parallelFor(z0, z1, threads, [&](V3DLONG z) {
+        vector<const QcMaskPlane*> window;
+        for (auto i = qMax(V3DLONG(0), z - before); i < qMin(depth, z + after + 1); ++i)
+            window.push_back(&dilated[i - d0]);
+        maskIntersection(window, output[z - z0]);
+    });
+}
+
 /*
  * Compute mask for markers
  *
@@ -195,10 +813,14 @@ bool testLine(const Vec4i& line,
  *
  * 6. Filter lines based on orientation and distance to the 3D image center;
  *
- * 7. Draw lines;
+ * 7. Draw lines, as runs of the mask, see QcMask;
  *
  * 8. z-axis wise interpolation using morphological closing.
  *
+ * With detectScale < 1, steps 1-6 run on slices downsampled in x & y, with
+ * the voxel sized params scaled accordingly, and the lines found are refined
+ * at the full resolution in narrow bands around them before drawing.
+ *
  * Params:
  *
  * se1: smoothing kernel size;
@@ -229,36 +851,39 @@ bool testLine(const Vec4i& line,
  *
  * cannyMin & cannyMax: canny thresholds, as ratios of max sobel edge gradient magnitude;
  *
- * sigma: gaussian filter param before sobel, kernel size as 3 times of this.
+ * sigma: gaussian filter param before sobel, kernel size as 3 times of this;
+ *
+ * threads: number of threads processing slices in parallel, all cores by default;
+ *
+ * detectScale: x & y scale of the slices to detect lines, 1 (no downsampling) by default;
+ *
+ * refineBand: half width in voxels of the band to refine a line, 2 coarse voxels by default;
+ *
+ * voxelSize: x & y voxel size of the input in micrometers, to give lengths in micrometers
+ * by minLineLengthUm, minDistanceUm, lineWidthUm, refineBandUm, and the detection resolution
+ * by detectVoxelSize instead of detectScale. They override their voxel counterparts;
+ *
+ * markerModel: slice (lines per slice & z interpolation, by default) or volume (3D planes);
+ *
+ * modelStep: the gap between slices to find lines in for the volume model;
+ *
+ * modelTolerance: the maximal distance in voxels of a line end point to its marker plane;
+ *
+ * modelMinSegments: the minimal number of lines to support a marker plane;
+ *
+ * modelIterations: number of RANSAC samples per marker plane;
+ *
+ * seed: seed of the RANSAC sampling.
  *
 */
 
-bool findMarkers(const QcImage& input, QcImage& output, const QVariantMap& params)
+bool findMarkers(const QcImage& input, QcMask& output, const QVariantMap& params)
 {
-    // used params
-    int se1, se2, se3, houghDistanceRes, houghAngleRes, houghThreshold,
-            houghMinLineLength, houghMaxLineGap, lineWidth;
-    double filterMinDistance, filterAngleLimit, zThickness, extendRatio, cannyMin, cannyMax, sigma;
-
+    QcTraceScope traceScope("findMarkers");
     // argument parsing
+    QScopedPointer<MarkerParams> p;
     try {
-        se1 = params.value("se1", 11).toUInt();
-        se2 = params.value("se1", 5).toUInt();
-        se3 = params.value("se1", 21).toUInt();
-        houghDistanceRes = params.value("houghDistanceRes", 1).toUInt();
-        houghAngleRes = params.value("houghAngleRes", 180).toUInt();
-        houghThreshold = params.value("houghThreshold", 100).toUInt();
-        houghMinLineLength = params.value("houghMinLineLength", 100).toUInt();
-        houghMaxLineGap = params.value("houghMaxLineGap", 1).toUInt();
-        lineWidth = params.value("lineWidth", 3).toUInt();
-
-        extendRatio = params.value("extendRatio", 0.2).toDouble();
-        filterMinDistance = params.value("filterMinDistance", 300.0).toDouble();
-        filterAngleLimit = params.value("angleLimit", 5.0).toDouble();
-        zThickness = params.value("zThickness", 2.0).toDouble();
-        cannyMin = params.value("cannyMin", 0.05).toDouble();
-        cannyMax = params.value("cannyMax", 0.15).toDouble();
-        sigma = params.value("sigma", 1.0).toDouble();
+        p.reset(new MarkerParams(params));
     }  catch (...) {
         cerr << "Argument Parsing Error. Please check the argument list." << endl;
         return false;
@@ -269,76 +894,44 @@ bool findMarkers(const QcImage& input, QcImage& output, const QVariantMap& param
     {
         const auto& sz = input.sz;
         output.clear();
-        output.create(sz, V3D_UINT8);
+        output.create(sz);
 
-        // use buffer as an opencv accessor
-        int cvtype;
-        switch (input.datatype)
-        {
-            case V3D_UINT8:
-                cvtype = CV_8U;
-                break;
-            case V3D_UINT16:
-                cvtype = CV_16U;
-                break;
-            case V3D_FLOAT32:
-                cvtype = CV_32F;
-                break;
-            default:
-                cvtype = CV_8U;
+        SliceMarkerFinder finder(*p, sz);
 
-        }
-        auto matInputBuffer = Mat(sz[2], sz[1] * sz[0], cvtype, (void*)input.buffer);
-        auto matOutputBuffer = Mat(sz[2], sz[1] * sz[0], CV_8U, (void*)output.buffer);
-
-        auto k1 = getStructuringElement(MORPH_ELLIPSE, Size(se1, se1));
-        auto k2 = getStructuringElement(MORPH_ELLIPSE, Size(se2, se2));
-        auto k3 = getStructuringElement(MORPH_RECT, Size(1, se3));
-        auto gk = int(abs(sigma*3));
-        if (gk % 2 == 0) ++gk;
-        // iterate over all slices to do the smotthing and sobel edge detection (with OPENCV)
-        for (int i = 0; i < sz[2]; ++i)
+        if (p->volumeModel)
         {
-            auto inputSlice = matInputBuffer.row(i).reshape(0, sz[1]);
-            auto outputSlice = matOutputBuffer.row(i).reshape(0, sz[1]);
-//            Mat smooth, grad_x, grad_y, edges, canny;
-            Mat smooth, edges;
-            morphologyEx(inputSlice, smooth, MORPH_CLOSE, k1);
-            GaussianBlur(smooth, smooth, Size(gk, gk), sigma);
-            // the canny function is only available after opencv 3.2
-            // so use the DIY canny instead
-//            Sobel(smooth, grad_x, CV_16S, 1, 0);
-//            Sobel(smooth, grad_y, CV_16S, 0, 1);
-//            magnitude(grad_x, grad_y, edges);
-//            double min, max;
-//            minMaxLoc(edges, &min, &max);
-//            Canny(grad_x, grad_y, edges, cannyMin * max, cannyMax * max, true);
-            Canny16bit(smooth, edges, cannyMin, cannyMax);
-            morphologyEx(edges, edges, MORPH_CLOSE, k2);
-            vector<Vec4i> lines;
-            HoughLinesP(edges, lines, houghDistanceRes, M_PI / houghAngleRes,
-                        houghThreshold, houghMinLineLength, houghMaxLineGap);
-
-            outputSlice = 0;
-            for (int j = 0; j < lines.size(); ++j)
-                if (testLine(lines[j], i, filterMinDistance, filterAngleLimit,
-                             QVector3D(sz[0], sz[1], sz[2]), zThickness))
+            // lines of the sampled slices, gathered in slice order so the model doesn't depend on the scheduling
+            auto step = p->modelStep;
+            vector<vector<Vec4i> > sampled((sz[2] + step - 1) / step);
+            parallelForWorker(0, sampled.size(), p->threads, [&](V3DLONG i, int worker) {
+                finder.detect(qcPlane(input, i * step), i * step, worker);
+                sampled[i] = finder.scratch[worker].lines;
+            });
+            vector<MarkerSegment> segments;
+            for (size_t i = 0; i < sampled.size(); ++i)
+                for (size_t j = 0; j < sampled[i].size(); ++j)
                 {
-                    // lengthen
-                    auto p1 = QVector2D(lines[j][0], lines[j][1]);
-                    auto p2 = QVector2D(lines[j][2], lines[j][3]);
-                    auto d = p1 - p2;
-                    p1 = p1 + d * extendRatio;
-                    p2 = p2 - d * extendRatio;
-                    // draw
-                    line(outputSlice, Point(p1.x(), p1.y()), Point(p2.x(), p2.y()), UCHAR_MAX, lineWidth);
+                    MarkerSegment seg = {sampled[i][j], int(i * step)};
+                    segments.push_back(seg);
                 }
-
+            auto planes = fitMarkerPlanes(segments, step, sz[2], *p);
+            parallelForWorker(0, sz[2], p->threads, [&](V3DLONG i, int worker) {
+                drawMarkerPlanes(output.planes[i], sz[0], i, planes, *p, finder.scratch[worker].patch);
+            });
+            return true;
         }
 
-        // z interpolation
-        morphologyEx(matOutputBuffer, matOutputBuffer, MORPH_CLOSE, k3);
+        // slices are independent until the z interpolation, so they're spread over threads.
+        vector<QcMaskPlane> drawn(sz[2]);
+        parallelForWorker(0, sz[2], p->threads, [&](V3DLONG i, int worker) {
+            finder.draw(qcPlane(input, i), i, drawn[i], worker);
+        });
 
+        // z interpolation
+        QcTraceScope closingScope("z closing");
+        auto before = qMax(p->se3, 1) / 2;
+        closeMaskZ([&](V3DLONG z) -> const QcMaskPlane& { return drawn[z]; }, sz[2], before,
+                   qMax(p->se3, 1) - 1 - before, 0, sz[2], output.planes.data(), p->threads);
         return true;
     }
     catch(...)
@@ -349,37 +942,162 @@ bool findMarkers(const QcImage& input, QcImage& output, const QVariantMap& param
     }
 }
 
-bool masking(const QcImage& input, QcImage& output, const QcImage& mask, bool invert)
+/*
+ * Marker finding of the slice model on a stream of slabs, see findMarkers
+ *
+ * Lines of each added slice are found & drawn at once. The z interpolation,
+ * a closing by se3 slices, is done as a max then a min over z on a window
+ * of drawn slices, same as on the whole mask, so the mask of a slice is
+ * final after lookahead() more slices are added. Only the window is kept,
+ * the slices before it are dropped as their masks are taken.
+ *
+ */
+
+MarkerStream::MarkerStream(const V3DLONG sz[4], const QVariantMap& params):
+    first(0), added(0)
+{
+    for (int i = 0; i < 3; ++i) this->sz[i] = sz[i];
+    p.reset(new MarkerParams(params));
+    if (p->volumeModel)
+        throw invalid_argument("Only the slice marker model works on slabs.");
+    finder.reset(new SliceMarkerFinder(*p, this->sz));
+    // anchor of the closing kernel, the slices it spans before & after
+    before = qMax(p->se3, 1) / 2;
+    after = qMax(p->se3, 1) - 1 - before;
+}
+
+MarkerStream::~MarkerStream()
+{
+}
+
+V3DLONG MarkerStream::lookahead() const
+{
+    return 2 * after;
+}
+
+V3DLONG MarkerStream::finished() const
+{
+    return added >= sz[2] ? sz[2] : qMax(V3DLONG(0), added - lookahead());
+}
+
+bool MarkerStream::addSlab(const QcImage& slab, V3DLONG z0)
+{
+    QcTraceScope traceScope("markers slab");
+    try
+    {
+        if (z0 != added || slab.sz[0] != sz[0] || slab.sz[1] != sz[1] || z0 + slab.sz[2] > sz[2])
+            throw invalid_argument("Slabs must be added in z order & match the volume.");
+        auto n = slab.sz[2];
+        drawn.resize(drawn.size() + n);
+        auto offset = V3DLONG(drawn.size()) - n;
+        parallelForWorker(0, n, p->threads, [&](V3DLONG i, int worker) {
+            finder->draw(qcPlane(slab, i), z0 + i, drawn[offset + i], worker);
+        });
+        added += n;
+        return true;
+    }
+    catch(exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        return false;
+    }
+}
+
+bool MarkerStream::takeMask(V3DLONG z0, V3DLONG z1, QcMask& mask)
 {
+    QcTraceScope traceScope("z closing");
     try
     {
-        const auto& sz = input.sz;
-        output.clear();
-        output.create(sz, input.datatype);
-        int cvtype;
-        switch (input.datatype)
+        if (qMax(V3DLONG(0), z0 - 2 * before) < first || z1 > finished() || z1 <= z0)
+            throw invalid_argument("The mask of the slices is not ready or already taken.");
+        V3DLONG msz[3] = {sz[0], sz[1], z1 - z0};
+        mask.create(msz);
+        closeMaskZ([&](V3DLONG z) -> const QcMaskPlane& { return drawn[z - first]; }, sz[2], before, after,
+                   z0, z1, mask.planes.data(), p->threads);
+
+        // drop the slices no later mask needs
+        while (first < z1 - 2 * before)
         {
-            case V3D_UINT8:
-                cvtype = CV_8U;
-                break;
-            case V3D_UINT16:
-                cvtype = CV_16U;
-                break;
-            case V3D_FLOAT32:
-                cvtype = CV_32F;
-                break;
-            default:
-                cvtype = CV_8U;
+            drawn.pop_front();
+            ++first;
         }
-        auto matInputBuffer = Mat(sz[2], sz[1] * sz[0], cvtype, (void*)input.buffer);
-        auto matOutputBuffer = Mat(sz[2], sz[1] * sz[0], cvtype, (void*)output.buffer);
-        auto matMaskBuffer = Mat(sz[2], sz[1] * sz[0], CV_8U, (void*)mask.buffer);
-        Mat matMask;
-        if (!invert)
-            matMask = matMaskBuffer;
+        return true;
+    }
+    catch(exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        mask.clear();
+        return false;
+    }
+}
+
+/*
+ * Keep the voxels where the mask is off (invert) or on (not invert), zero the rest
+ *
+ * Works on views of the size of the mask. A row is copied or zeroed span
+ * by span, on & off the runs of the mask, so the mask isn't read per voxel.
+ *
+ */
+
+template <class T>
+void maskView(const QcView<T>& input, const QcView<T>& output, const QcMask& mask, bool invert)
+{
+    auto span = [&](const T* in, T* out, V3DLONG x0, V3DLONG x1, bool keep) {
+        if (keep)
+            for (auto x = x0; x < x1; ++x)
+                out[x * output.stride[0]] = in[x * input.stride[0]];
         else
-            bitwise_not(matMaskBuffer, matMask);
-        bitwise_and(matInputBuffer, matInputBuffer, matOutputBuffer, matMask);
+            for (auto x = x0; x < x1; ++x)
+                out[x * output.stride[0]] = T(0);
+    };
+    for (V3DLONG z = 0; z < input.sz[2]; ++z)
+        for (V3DLONG y = 0; y < input.sz[1]; ++y)
+        {
+            auto in = input.row(y, z);
+            auto out = output.row(y, z);
+            const auto& plane = mask.planes[z];
+            V3DLONG x = 0;
+            for (auto r = plane.begin(y); r != plane.end(y); x = r->x1, ++r)
+            {
+                span(in, out, x, r->x0, invert);
+                span(in, out, r->x0, r->x1, !invert);
+            }
+            span(in, out, x, input.sz[0], invert);
+        }
+}
+
+struct MaskKernel
+{
+    const QcImage& input;
+    QcImage& output;
+    const QcMask& mask;
+    bool invert;
+
+    template <class T>
+    void operator()(QcTypeTag<T>)
+    {
+        maskView(QcView<T>(input), QcView<T>(output), mask, invert);
+    }
+};
+
+// the mask covers the image
+static bool maskFits(const QcMask& mask, const QcImage& image)
+{
+    return mask.sz[0] == image.sz[0] && mask.sz[1] == image.sz[1] && mask.sz[2] == image.sz[2];
+}
+
+bool masking(const QcImage& input, QcImage& output, const QcMask& mask, bool invert)
+{
+    QcTraceScope traceScope("masking");
+    try
+    {
+        if (!maskFits(mask, input))
+            throw invalid_argument("The mask doesn't match the image.");
+        output.clear();
+        output.create(input.sz, input.datatype);
+        MaskKernel kernel = {input, output, mask, invert};
+        if (!dispatchType(input.datatype, kernel))
+            throw invalid_argument("Unsupported pixel type.");
         return true;
     }
     catch(...)
@@ -390,39 +1108,187 @@ bool masking(const QcImage& input, QcImage& output, const QcImage& mask, bool in
     }
 }
 
-bool maxProjection8bit(const QcImage& input, QcImage& output)
+/*
+ * Mask a volume & project both sides of the mask in the same pass
+ *
+ * Each voxel is read once, written to the output with the marked voxels
+ * zeroed, and folded into the xy maximum projections of the marked &
+ * unmarked voxels, which are accumulated rather than reset, so slabs can
+ * be folded in one by one. Rows are split over threads by blocks, each
+ * thread owning the projection pixels of its block and reading it slice by
+ * slice, as in the projections, so the volume is read in z order. Each row
+ * goes span by span on & off the runs of the mask. The output may alias the
+ * input to mask in place.
+ *
+ */
+
+template <class T>
+void maskProjectView(const QcView<T>& input, const QcView<T>& output, const QcMask& mask,
+                     const QcView<T>& markerMax, const QcView<T>& removedMax, int threads)
 {
-    try
-    {
-        const auto& sz = input.sz;
-        output.clear();
-        output.create(sz, V3D_UINT8);
-        int cvtype;
-        switch (input.datatype)
+    auto blocks = (input.sz[1] + MASK_PROJECT_BLOCK_ROWS - 1) / MASK_PROJECT_BLOCK_ROWS;
+    parallelFor(0, blocks, threads, [&](V3DLONG block) {
+        auto y0 = block * MASK_PROJECT_BLOCK_ROWS, y1 = min(input.sz[1], y0 + MASK_PROJECT_BLOCK_ROWS);
+        for (V3DLONG z = 0; z < input.sz[2]; ++z)
         {
-            case V3D_UINT8:
-                cvtype = CV_8U;
-                break;
-            case V3D_UINT16:
-                cvtype = CV_16U;
-                break;
-            case V3D_FLOAT32:
-                cvtype = CV_32F;
-                break;
-            default:
-                cvtype = CV_8U;
+            const auto& plane = mask.planes[z];
+            for (auto y = y0; y < y1; ++y)
+            {
+                auto mk = markerMax.row(y, 0);
+                auto rm = removedMax.row(y, 0);
+                auto in = input.row(y, z);
+                auto out = output.row(y, z);
+                // off the markers, kept & projected as removed
+                auto off = [&](V3DLONG x0, V3DLONG x1) {
+                    for (auto x = x0; x < x1; ++x)
+                    {
+                        auto v = in[x * input.stride[0]];
+                        auto& b = rm[x * removedMax.stride[0]];
+                        out[x * output.stride[0]] = v;
+                        b = max(b, v);
+                    }
+                };
+                V3DLONG x = 0;
+                for (auto r = plane.begin(y); r != plane.end(y); x = r->x1, ++r)
+                {
+                    off(x, r->x0);
+                    for (auto i = r->x0; i < r->x1; ++i)
+                    {
+                        auto& a = mk[i * markerMax.stride[0]];
+                        a = max(a, in[i * input.stride[0]]);
+                        out[i * output.stride[0]] = T(0);
+                    }
+                }
+                off(x, input.sz[0]);
+            }
         }
-        auto matInputBuffer = Mat(sz[2], sz[1] * sz[0], cvtype, (void*)input.buffer);
-        auto matOutputBuffer = Mat(1, sz[1] * sz[0], CV_8U, (void*)output.buffer);
-        double max[matOutputBuffer.cols], maxmax = 0;
-        for (int i = 0; i < matOutputBuffer.cols; ++i)
+    });
+}
+
+struct MaskProjectKernel
+{
+    const QcImage& input;
+    QcImage& output;
+    const QcMask& mask;
+    Mat& markerMax;
+    Mat& removedMax;
+    int threads;
+
+    template <class T>
+    void operator()(QcTypeTag<T>)
+    {
+        auto planeView = [&](Mat& m) {
+            return QcView<T>((T*)m.data, m.cols, m.rows, 1, 1, m.step1(), m.rows * m.step1());
+        };
+        maskProjectView(QcView<T>(input), QcView<T>(output), mask,
+                        planeView(markerMax), planeView(removedMax), threads);
+    }
+};
+
+// stretch a projection to 8bit by its maximum
+void projectionTo8bit(const Mat& proj, QcImage& output)
+{
+    V3DLONG sz[4] = {proj.cols, proj.rows, 1, 1};
+    output.clear();
+    output.create(sz, V3D_UINT8);
+    double min, max;
+    minMaxLoc(proj, &min, &max);
+    auto out = qcPlane(output, 0);
+    proj.convertTo(out, CV_8U, max > 0 ? UCHAR_MAX / max : 0);
+}
+
+/*
+ * Remove markers & get the 8bit maximum projections of the markers & the rest
+ *
+ * Same as masking then maxProjection8bit on both sides of the mask, but in
+ * one read of the volume. The output may be the input itself.
+ *
+ * Params:
+ *
+ * input: image to remove markers from;
+ *
+ * output: image without markers;
+ *
+ * mask: the marker mask;
+ *
+ * markerProj & removedProj: 8bit xy projections of the markers & of the output;
+ *
+ * threads: number of threads.
+ *
+ */
+
+bool maskProject8bit(const QcImage& input, QcImage& output, const QcMask& mask,
+                     QcImage& markerProj, QcImage& removedProj, int threads)
+{
+    QcTraceScope traceScope("mask & project");
+    try
+    {
+        if (!maskFits(mask, input))
+            throw invalid_argument("The mask doesn't match the image.");
+        if (&output != &input)
         {
-            double min;
-            minMaxLoc(matInputBuffer.col(i), &min, max + i);
-            if (max[i] > maxmax) maxmax = max[i];
+            output.clear();
+            output.create(input.sz, input.datatype);
         }
-        for (int i = 0; i < matOutputBuffer.cols; ++i)
-            matOutputBuffer.at<uchar>(0, i) = max[i] * 255 / maxmax;
+        auto cvtype = qcCvType(input.datatype);
+        Mat markerMax = Mat::zeros(input.sz[1], input.sz[0], cvtype);
+        Mat removedMax = Mat::zeros(input.sz[1], input.sz[0], cvtype);
+        MaskProjectKernel kernel = {input, output, mask, markerMax, removedMax, threads};
+        if (!dispatchType(input.datatype, kernel))
+            throw invalid_argument("Unsupported pixel type.");
+        projectionTo8bit(markerMax, markerProj);
+        projectionTo8bit(removedMax, removedProj);
+        return true;
+    }
+    catch(...)
+    {
+        cerr << "ERROR: Unkown exception, probably related to OPENCV functions." << endl;
+        if (&output != &input)
+            output.clear();
+        markerProj.clear();
+        removedProj.clear();
+        return false;
+    }
+}
+
+/*
+ * Remove markers from a slab in place & fold it into running xy maximum projections
+ *
+ * markerMax & removedMax: projections of the pixel type of the slab & its xy
+ * size, zeroed before the first slab.
+ *
+ */
+
+bool maskProjectSlab(QcImage& slab, const QcMask& mask, Mat& markerMax, Mat& removedMax, int threads)
+{
+    QcTraceScope traceScope("mask & project slab");
+    try
+    {
+        if (!maskFits(mask, slab) || markerMax.cols != slab.sz[0] || markerMax.rows != slab.sz[1] ||
+                markerMax.size() != removedMax.size() || markerMax.depth() != qcCvType(slab.datatype))
+            throw invalid_argument("The mask or the projections don't match the slab.");
+        MaskProjectKernel kernel = {slab, slab, mask, markerMax, removedMax, threads};
+        if (!dispatchType(slab.datatype, kernel))
+            throw invalid_argument("Unsupported pixel type.");
+        return true;
+    }
+    catch(exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        return false;
+    }
+}
+
+// xy maximum projection stretched to 8bit by its maximum, see project
+bool maxProjection8bit(const QcImage& input, QcImage& output, int threads)
+{
+    QcTraceScope traceScope("maxProjection8bit");
+    try
+    {
+        QcImage proj;
+        if (!project(input, QVector<QcProjection>() << QcProjection(2, QC_PROJECT_MAX), &proj, threads))
+            throw runtime_error("Projection failed.");
+        projectionTo8bit(qcPlane(proj, 0), output);
         return true;
     }
     catch(...)
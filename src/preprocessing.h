@@ -6,13 +6,57 @@
 #ifndef PREPROCESSING_H
 #define PREPROCESSING_H
 
-#include <v3d_interface.h>
+#include "qcBasic.h"
 #include "TeraQCTypes.h"
+#include "runMask.h"
+#include "opencv2/core/core.hpp"
+#include <deque>
 
-bool findMarkers(const QcImage& input, QcImage& output, const QVariantMap& params);
+double Canny16bit(cv::InputArray in, cv::OutputArray edges, double threshold1, double threshold2,
+                  double gradientMax = 0);
 
-bool masking(const QcImage& input, QcImage& output, const QcImage& mask, bool invert=true);
+bool findMarkers(const QcImage& input, QcMask& output, const QVariantMap& params);
 
-bool maxProjection8bit(const QcImage& input, QcImage& output);
+struct MarkerParams;
+struct SliceMarkerFinder;
+
+// marker finding on slabs fed in z order, see findMarkers
+class MarkerStream
+{
+public:
+    // sz: dimensions of the whole volume
+    MarkerStream(const V3DLONG sz[4], const QVariantMap& params);
+    ~MarkerStream();
+
+    // slices to add after a slice before its mask is final
+    V3DLONG lookahead() const;
+    // number of slices from the first whose masks are final
+    V3DLONG finished() const;
+    // find & draw the markers of a slab, z0 is the z of its first plane
+    bool addSlab(const QcImage& slab, V3DLONG z0);
+    // the final mask of the slices [z0, z1), taken in z order
+    bool takeMask(V3DLONG z0, V3DLONG z1, QcMask& mask);
+
+private:
+    V3DLONG sz[3];
+    QScopedPointer<MarkerParams> p;
+    QScopedPointer<SliceMarkerFinder> finder;
+    // slices spanned by the z interpolation before & after a slice
+    V3DLONG before, after;
+    // drawn slices from z first
+    std::deque<QcMaskPlane> drawn;
+    V3DLONG first, added;
+};
+
+bool masking(const QcImage& input, QcImage& output, const QcMask& mask, bool invert=true);
+
+bool maxProjection8bit(const QcImage& input, QcImage& output, int threads=1);
+
+bool maskProject8bit(const QcImage& input, QcImage& output, const QcMask& mask,
+                     QcImage& markerProj, QcImage& removedProj, int threads=1);
+
+bool maskProjectSlab(QcImage& slab, const QcMask& mask, cv::Mat& markerMax, cv::Mat& removedMax, int threads=1);
+
+void projectionTo8bit(const cv::Mat& proj, QcImage& output);
 
 #endif // PREPROCESSING_H
@@ -0,0 +1,283 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "projection.h"
+#include "imageView.h"
+#include "parallelUtils.h"
+#include "trace.h"
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <algorithm>
+
+using namespace std;
+
+// rows of a block read by a thread at each z
+static const V3DLONG PROJECT_BLOCK_ROWS = 64;
+// locks guarding the shared rows of xz projections
+static const int PROJECT_LOCK_STRIPES = 64;
+
+// fold a row into a row of accumulators, the loops are simple enough to be vectorized
+template <class A, class T>
+static void foldRow(int op, A* acc, const T* row, V3DLONG n)
+{
+    switch (op)
+    {
+    case QC_PROJECT_MAX:
+        for (V3DLONG i = 0; i < n; ++i)
+            acc[i] = acc[i] < A(row[i]) ? A(row[i]) : acc[i];
+        break;
+    case QC_PROJECT_MIN:
+        for (V3DLONG i = 0; i < n; ++i)
+            acc[i] = acc[i] > A(row[i]) ? A(row[i]) : acc[i];
+        break;
+    default:
+        for (V3DLONG i = 0; i < n; ++i)
+            acc[i] += row[i];
+    }
+}
+
+// reduce a row to a value
+template <class A, class T>
+static A reduceRow(int op, const T* row, V3DLONG n, A init)
+{
+    auto acc = init;
+    switch (op)
+    {
+    case QC_PROJECT_MAX:
+        for (V3DLONG i = 0; i < n; ++i)
+            acc = acc < A(row[i]) ? A(row[i]) : acc;
+        break;
+    case QC_PROJECT_MIN:
+        for (V3DLONG i = 0; i < n; ++i)
+            acc = acc > A(row[i]) ? A(row[i]) : acc;
+        break;
+    default:
+        for (V3DLONG i = 0; i < n; ++i)
+            acc += row[i];
+    }
+    return acc;
+}
+
+// initial value of an accumulator
+template <class A>
+static A identity(int op)
+{
+    switch (op)
+    {
+    case QC_PROJECT_MAX:
+        return numeric_limits<A>::lowest();
+    case QC_PROJECT_MIN:
+        return numeric_limits<A>::max();
+    default:
+        return A(0);
+    }
+}
+
+/*
+ * A projection being accumulated
+ *
+ * Max & min are accumulated in the pixel type, in the output image, means
+ * as sums in double. Rows are z for yz & xz projections and y for xy ones.
+ */
+template <class T>
+struct ProjectionState
+{
+    QcProjection spec;
+    // the clipped slab along the projected axis
+    V3DLONG start, end;
+    // output dimensions
+    V3DLONG width, height;
+    T* value;
+    vector<double> sum;
+};
+
+/*
+ * Fold the rows [y0, y1) of slice z into a projection
+ *
+ * xy & yz rows are only touched by the thread owning the block, xz rows are
+ * shared by all blocks, so the block is reduced into the scratch row first
+ * and merged under a lock.
+ */
+template <class A, class T>
+static void foldBlock(const ProjectionState<T>& p, A* acc, const QcView<T>& view, V3DLONG y0, V3DLONG y1,
+                      V3DLONG z, vector<A>& scratch, mutex* locks)
+{
+    auto op = p.spec.op;
+    switch (p.spec.axis)
+    {
+    case 2:
+        if (z < p.start || z >= p.end) return;
+        for (V3DLONG y = y0; y < y1; ++y)
+            foldRow(op, acc + y * p.width, view.row(y, z), view.sz[0]);
+        break;
+    case 1:
+    {
+        auto a = max(y0, p.start), b = min(y1, p.end);
+        if (a >= b) return;
+        scratch.assign(view.sz[0], identity<A>(op));
+        for (V3DLONG y = a; y < b; ++y)
+            foldRow(op, scratch.data(), view.row(y, z), view.sz[0]);
+        lock_guard<mutex> lk(locks[z % PROJECT_LOCK_STRIPES]);
+        foldRow(op, acc + z * p.width, scratch.data(), view.sz[0]);
+        break;
+    }
+    default:
+        for (V3DLONG y = y0; y < y1; ++y)
+            acc[z * p.width + y] = reduceRow(op, view.row(y, z) + p.start, p.end - p.start, identity<A>(op));
+    }
+}
+
+template <class T>
+static void projectTyped(const QcImage& input, const QVector<QcProjection>& projections,
+                         QcImage outputs[], int threads)
+{
+    QcView<T> view(input);
+    const auto& sz = input.sz;
+    vector<ProjectionState<T> > states(projections.size());
+    for (int k = 0; k < projections.size(); ++k)
+    {
+        auto& p = states[k];
+        p.spec = projections.at(k);
+        if (p.spec.axis < 0 || p.spec.axis > 2)
+            throw invalid_argument("Illegal projection axis.");
+        auto len = sz[p.spec.axis];
+        p.start = 0;
+        p.end = len;
+        if (p.spec.end > p.spec.start)
+        {
+            p.start = qBound(V3DLONG(0), p.spec.start, len);
+            p.end = qBound(p.start, p.spec.end, len);
+        }
+        if (p.end <= p.start)
+            throw invalid_argument("Empty projection slab.");
+        p.width = p.spec.axis == 0 ? sz[1] : sz[0];
+        p.height = p.spec.axis == 2 ? sz[1] : sz[2];
+
+        V3DLONG osz[4] = {p.width, p.height, 1, 1};
+        outputs[k].clear();
+        if (p.spec.op == QC_PROJECT_MEAN)
+        {
+            outputs[k].create(osz, V3D_FLOAT32);
+            p.value = NULL;
+            p.sum.assign(p.width * p.height, 0.0);
+        }
+        else
+        {
+            outputs[k].create(osz, input.datatype);
+            p.value = (T*)outputs[k].buffer;
+            fill(p.value, p.value + p.width * p.height, identity<T>(p.spec.op));
+        }
+    }
+
+    // each thread takes blocks of rows & reads them through z, so slices are read sequentially
+    // in chunks, every voxel is read once for all the projections, and the accumulators don't
+    // grow with the number of threads
+    unique_ptr<mutex[]> locks(new mutex[PROJECT_LOCK_STRIPES]);
+    vector<vector<T> > scratchValue(qMax(threads, 1));
+    vector<vector<double> > scratchSum(qMax(threads, 1));
+    auto blocks = (sz[1] + PROJECT_BLOCK_ROWS - 1) / PROJECT_BLOCK_ROWS;
+    parallelForWorker(0, blocks, threads, [&](V3DLONG b, int worker) {
+        auto y0 = b * PROJECT_BLOCK_ROWS, y1 = min(sz[1], y0 + PROJECT_BLOCK_ROWS);
+        for (V3DLONG z = 0; z < sz[2]; ++z)
+            for (size_t k = 0; k < states.size(); ++k)
+            {
+                auto& p = states[k];
+                if (p.spec.op == QC_PROJECT_MEAN)
+                    foldBlock(p, p.sum.data(), view, y0, y1, z, scratchSum[worker], locks.get());
+                else
+                    foldBlock(p, p.value, view, y0, y1, z, scratchValue[worker], locks.get());
+            }
+    });
+
+    for (size_t k = 0; k < states.size(); ++k)
+    {
+        auto& p = states[k];
+        if (p.spec.op != QC_PROJECT_MEAN) continue;
+        auto out = (v3d_float32*)outputs[k].buffer;
+        auto n = double(p.end - p.start);
+        for (V3DLONG i = 0; i < p.width * p.height; ++i)
+            out[i] = v3d_float32(p.sum[i] / n);
+    }
+}
+
+struct ProjectKernel
+{
+    const QcImage& input;
+    const QVector<QcProjection>& projections;
+    QcImage* outputs;
+    int threads;
+
+    template <class T>
+    void operator()(QcTypeTag<T>)
+    {
+        projectTyped<T>(input, projections, outputs, threads);
+    }
+};
+
+// parse a projection from strings, axis as xy/xz/yz, op as max/min/mean, slab as start,end or empty
+bool parseProjection(const QString& axis, const QString& op, const QString& slab, QcProjection& output)
+{
+    auto a = axis.toLower();
+    if (a == "xy") output.axis = 2;
+    else if (a == "xz") output.axis = 1;
+    else if (a == "yz") output.axis = 0;
+    else return false;
+    auto o = op.toLower();
+    if (o == "max") output.op = QC_PROJECT_MAX;
+    else if (o == "min") output.op = QC_PROJECT_MIN;
+    else if (o == "mean") output.op = QC_PROJECT_MEAN;
+    else return false;
+    output.start = output.end = 0;
+    if (!slab.isEmpty())
+    {
+        auto parts = slab.split(',');
+        bool ok1, ok2;
+        if (parts.size() != 2) return false;
+        output.start = parts.at(0).toLongLong(&ok1);
+        output.end = parts.at(1).toLongLong(&ok2);
+        if (!ok1 || !ok2) return false;
+    }
+    return true;
+}
+
+/*
+ * Project a 3D image along its axes in one pass
+ *
+ * All the projections are accumulated while reading the image once, slices
+ * in blocks of rows, so the memory besides the outputs is a row per thread
+ * (plus a double sum per pixel of mean projections).
+ *
+ * Params:
+ *
+ * input: the image, the first channel is projected;
+ *
+ * projections: the projections to compute, see QcProjection;
+ *
+ * outputs: array of a 2D image per projection, in the input pixel type, float32 for means;
+ *
+ * threads: number of threads.
+ *
+ */
+
+bool project(const QcImage& input, const QVector<QcProjection>& projections,
+             QcImage outputs[], int threads)
+{
+    QcTraceScope traceScope("project");
+    try
+    {
+        ProjectKernel kernel = {input, projections, outputs, threads};
+        if (!dispatchType(input.datatype, kernel))
+            throw invalid_argument("Unsupported pixel type.");
+        return true;
+    }
+    catch(exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        for (int k = 0; k < projections.size(); ++k)
+            outputs[k].clear();
+        return false;
+    }
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef PROJECTION_H
+#define PROJECTION_H
+
+#include "qcBasic.h"
+#include "TeraQCTypes.h"
+
+enum QcProjectionOp { QC_PROJECT_MAX, QC_PROJECT_MIN, QC_PROJECT_MEAN };
+
+/*
+ * A projection of a 3D image along an axis
+ *
+ * axis: the collapsed axis, 0 (x) gives a yz image, 1 (y) a xz image and
+ * 2 (z) a xy image, always with z as the rows when z is kept;
+ *
+ * op: the reduction, see QcProjectionOp;
+ *
+ * start & end: the slab along the axis to project, the whole axis if end <= start.
+ */
+struct QcProjection
+{
+    QcProjection(int axis=2, int op=QC_PROJECT_MAX, V3DLONG start=0, V3DLONG end=0):
+        axis(axis), op(op), start(start), end(end) {}
+    int axis;
+    int op;
+    V3DLONG start, end;
+};
+
+bool parseProjection(const QString& axis, const QString& op, const QString& slab, QcProjection& output);
+
+bool project(const QcImage& input, const QVector<QcProjection>& projections,
+             QcImage outputs[], int threads=1);
+
+#endif // PROJECTION_H
@@ -0,0 +1,30 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef QCBASIC_H
+#define QCBASIC_H
+
+/*
+ * Basic types of the processing core
+ *
+ * The core only needs QtCore & these types. Built into the Vaa3D plugin
+ * (TERAQC_V3D defined), they're the Vaa3D basic data types, so images pass
+ * between Vaa3D & the core as they are. Otherwise the same types are
+ * defined here, so the library & the command line tool build without Vaa3D.
+ */
+
+#include <QtCore>
+
+#ifdef TERAQC_V3D
+#include <v3d_basicdatatype.h>
+#else
+typedef long long V3DLONG;
+typedef unsigned char v3d_uint8;
+typedef unsigned short v3d_uint16;
+typedef float v3d_float32;
+enum ImagePixelType { V3D_UNKNOWN, V3D_UINT8, V3D_UINT16, V3D_THREEBYTE, V3D_FLOAT32 };
+#endif
+
+#endif // QCBASIC_H
@@ -0,0 +1,393 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "regions.h"
+#include "imageView.h"
+#include "parallelUtils.h"
+#include "trace.h"
+#include <iostream>
+#include <algorithm>
+#include <cfloat>
+#include <climits>
+#include <cmath>
+
+using namespace std;
+
+RegionStats::RegionStats():
+    volume(0), sum(0), sumSq(0), max(-DBL_MAX), sx(0), sy(0), sz(0)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        lo[i] = LLONG_MAX;
+        hi[i] = LLONG_MIN;
+    }
+}
+
+void RegionStats::merge(const RegionStats& other)
+{
+    volume += other.volume;
+    sum += other.sum;
+    sumSq += other.sumSq;
+    max = qMax(max, other.max);
+    sx += other.sx;
+    sy += other.sy;
+    sz += other.sz;
+    for (int i = 0; i < 3; ++i)
+    {
+        lo[i] = qMin(lo[i], other.lo[i]);
+        hi[i] = qMax(hi[i], other.hi[i]);
+    }
+}
+
+RegionAccumulator::RegionAccumulator(double threshold):
+    threshold(threshold), firstZ(-1), lastZ(-1)
+{
+}
+
+int RegionAccumulator::find(int label) const
+{
+    while (parent[label] != label)
+    {
+        // path halving
+        parent[label] = parent[parent[label]];
+        label = parent[label];
+    }
+    return label;
+}
+
+void RegionAccumulator::unite(int a, int b)
+{
+    a = find(a);
+    b = find(b);
+    if (a == b) return;
+    if (b < a) swap(a, b);
+    parent[b] = a;
+}
+
+// unite overlapping runs of the same rows of 2 adjacent planes, both in y & x order
+void RegionAccumulator::link(const vector<Run>& upper, const vector<Run>& lower)
+{
+    size_t i = 0, j = 0;
+    while (i < upper.size() && j < lower.size())
+    {
+        const auto& a = upper[i];
+        const auto& b = lower[j];
+        if (a.y != b.y)
+        {
+            if (a.y < b.y) ++i;
+            else ++j;
+            continue;
+        }
+        if (a.x0 < b.x1 && b.x0 < a.x1)
+            unite(a.label, b.label);
+        if (a.x1 < b.x1) ++i;
+        else ++j;
+    }
+}
+
+template <class T>
+void RegionAccumulator::addPlane(const T* plane, V3DLONG width, V3DLONG height, V3DLONG z)
+{
+    // runs of the previous plane only touch this one if it's right above it
+    auto adjacent = lastZ >= 0 && z == lastZ + 1;
+    cur.clear();
+    size_t rowBegin = 0, upper = 0, above = 0;
+    for (V3DLONG y = 0; y < height; ++y)
+    {
+        auto rowStart = cur.size();
+        // runs of the same row in the previous plane
+        while (above < prev.size() && prev[above].y < y) ++above;
+        auto aboveEnd = above;
+        while (aboveEnd < prev.size() && prev[aboveEnd].y == y) ++aboveEnd;
+        if (!adjacent) above = aboveEnd = prev.size();
+        upper = rowBegin;
+
+        auto row = plane + y * width;
+        for (V3DLONG x = 0; x < width;)
+        {
+            if (!(row[x] > threshold))
+            {
+                ++x;
+                continue;
+            }
+            Run run = {x, x, y, -1};
+            double sum = 0, sumSq = 0, max = -DBL_MAX;
+            for (; x < width && row[x] > threshold; ++x)
+            {
+                double v = row[x];
+                sum += v;
+                sumSq += v * v;
+                max = max < v ? v : max;
+            }
+            run.x1 = x;
+
+            auto join = [&](const Run& other) {
+                if (run.label < 0) run.label = find(other.label);
+                else unite(run.label, other.label);
+            };
+            // the previous row
+            while (upper < rowStart && cur[upper].x1 <= run.x0) ++upper;
+            for (auto k = upper; k < rowStart && cur[k].x0 < run.x1; ++k)
+                join(cur[k]);
+            // the previous plane
+            while (above < aboveEnd && prev[above].x1 <= run.x0) ++above;
+            for (auto k = above; k < aboveEnd && prev[k].x0 < run.x1; ++k)
+                join(prev[k]);
+
+            if (run.label < 0)
+            {
+                run.label = int(parent.size());
+                parent.push_back(run.label);
+                stats.push_back(RegionStats());
+            }
+            auto& st = stats[run.label];
+            auto len = run.x1 - run.x0;
+            st.volume += len;
+            st.sum += sum;
+            st.sumSq += sumSq;
+            st.max = qMax(st.max, max);
+            st.sx += double(run.x0 + run.x1 - 1) * len / 2;
+            st.sy += double(y) * len;
+            st.sz += double(z) * len;
+            V3DLONG lo[3] = {run.x0, y, z}, hi[3] = {run.x1 - 1, y, z};
+            for (int i = 0; i < 3; ++i)
+            {
+                st.lo[i] = qMin(st.lo[i], lo[i]);
+                st.hi[i] = qMax(st.hi[i], hi[i]);
+            }
+            cur.push_back(run);
+        }
+        rowBegin = rowStart;
+        above = aboveEnd;
+    }
+    if (firstZ < 0)
+    {
+        first = cur;
+        firstZ = z;
+    }
+    prev.swap(cur);
+    lastZ = z;
+}
+
+template void RegionAccumulator::addPlane<v3d_uint8>(const v3d_uint8*, V3DLONG, V3DLONG, V3DLONG);
+template void RegionAccumulator::addPlane<v3d_uint16>(const v3d_uint16*, V3DLONG, V3DLONG, V3DLONG);
+template void RegionAccumulator::addPlane<v3d_float32>(const v3d_float32*, V3DLONG, V3DLONG, V3DLONG);
+
+// add the planes [za, zb) of an image, the image starts at z0
+struct AddPlanesKernel
+{
+    RegionAccumulator& acc;
+    const QcImage& img;
+    V3DLONG za, zb, z0;
+
+    template <class T>
+    void operator()(QcTypeTag<T>)
+    {
+        for (auto z = za; z < zb; ++z)
+            acc.addPlane((const T*)img.buffer + z * img.sz[0] * img.sz[1], img.sz[0], img.sz[1], z0 + z);
+    }
+};
+
+bool RegionAccumulator::addSlab(const QcImage& slab, V3DLONG z0)
+{
+    QcTraceScope traceScope("regions slab");
+    AddPlanesKernel kernel = {*this, slab, 0, slab.sz[2], z0};
+    return dispatchType(slab.datatype, kernel);
+}
+
+void RegionAccumulator::append(RegionAccumulator& next)
+{
+    if (next.isEmpty()) return;
+    if (isEmpty())
+    {
+        parent.swap(next.parent);
+        stats.swap(next.stats);
+        first.swap(next.first);
+        prev.swap(next.prev);
+        firstZ = next.firstZ;
+        lastZ = next.lastZ;
+    }
+    else
+    {
+        auto offset = int(parent.size());
+        for (size_t i = 0; i < next.parent.size(); ++i)
+            parent.push_back(next.parent[i] + offset);
+        stats.insert(stats.end(), next.stats.begin(), next.stats.end());
+        for (size_t i = 0; i < next.first.size(); ++i)
+            next.first[i].label += offset;
+        for (size_t i = 0; i < next.prev.size(); ++i)
+            next.prev[i].label += offset;
+        if (next.firstZ == lastZ + 1)
+            link(prev, next.first);
+        prev.swap(next.prev);
+        lastZ = next.lastZ;
+    }
+    next = RegionAccumulator(next.threshold);
+}
+
+void RegionAccumulator::regions(QVector<QcRegion>& output, qint64 minVolume) const
+{
+    output.clear();
+    vector<int> index(parent.size(), -1);
+    vector<RegionStats> merged;
+    for (size_t i = 0; i < parent.size(); ++i)
+    {
+        auto r = find(int(i));
+        if (index[r] < 0)
+        {
+            index[r] = int(merged.size());
+            merged.push_back(RegionStats());
+        }
+        merged[index[r]].merge(stats[i]);
+    }
+    for (size_t i = 0; i < merged.size(); ++i)
+    {
+        const auto& st = merged[i];
+        if (st.volume < minVolume) continue;
+        QcRegion region;
+        region.box = QcRoi(st.lo[0], st.lo[1], st.lo[2], st.hi[0] + 1, st.hi[1] + 1, st.hi[2] + 1);
+        region.volume = st.volume;
+        region.centroid[0] = st.sx / st.volume;
+        region.centroid[1] = st.sy / st.volume;
+        region.centroid[2] = st.sz / st.volume;
+        region.sum = st.sum;
+        region.mean = st.sum / st.volume;
+        region.stddev = sqrt(qMax(0.0, st.sumSq / st.volume - region.mean * region.mean));
+        region.max = st.max;
+        output.append(region);
+    }
+    stable_sort(output.begin(), output.end(), [](const QcRegion& a, const QcRegion& b) {
+        return a.sum > b.sum;
+    });
+}
+
+// nonzero voxels sampled at a regular stride
+struct SampleKernel
+{
+    const QcImage& input;
+    qint64 samples;
+    vector<float>& output;
+
+    template <class T>
+    void operator()(QcTypeTag<T>)
+    {
+        auto data = (const T*)input.buffer;
+        qint64 n = input.sz[0] * input.sz[1] * input.sz[2];
+        auto stride = qMax(qint64(1), n / samples);
+        for (qint64 i = 0; i < n; i += stride)
+            if (data[i] != 0)
+                output.push_back(float(data[i]));
+    }
+};
+
+/*
+ * Robust threshold of the background
+ *
+ * median + k * sigma, where sigma is estimated by the median absolute
+ * deviation of nonzero voxels sampled at a regular stride, so the masked
+ * voxels & the signal don't bias it.
+ *
+ */
+
+double adaptiveThreshold(const QcImage& input, double k, qint64 samples)
+{
+    vector<float> values;
+    SampleKernel kernel = {input, qMax(qint64(1), samples), values};
+    if (!dispatchType(input.datatype, kernel) || values.empty())
+        return 0;
+    auto mid = values.begin() + values.size() / 2;
+    nth_element(values.begin(), mid, values.end());
+    double median = *mid;
+    for (size_t i = 0; i < values.size(); ++i)
+        values[i] = float(abs(values[i] - median));
+    nth_element(values.begin(), mid, values.end());
+    return median + k * 1.4826 * *mid;
+}
+
+/*
+ * Extract regions with strong signals
+ *
+ * Voxels above the threshold are labeled as 3D connected components in
+ * 6-connectivity, with the statistics of each region gathered while
+ * labeling, see RegionAccumulator. The z axis is split into a slab per
+ * task, labeled in parallel & appended in order.
+ *
+ * Params:
+ *
+ * regionThreshold: the intensity threshold, adaptive if not given;
+ *
+ * regionK: for the adaptive threshold, the number of background sigmas above the median;
+ *
+ * regionMinVolume: the minimal number of voxels of a region;
+ *
+ * maxRegions: keep only the regions of the largest intensity sums, 0 for all;
+ *
+ * threads: number of threads, all cores by default.
+ *
+ * Output: regions by descending intensity sum.
+ *
+ */
+
+bool findRegions(const QcImage& input, QVector<QcRegion>& output, const QVariantMap& params)
+{
+    QcTraceScope traceScope("findRegions");
+    output.clear();
+    try
+    {
+        auto threads = threadCount(params);
+        auto minVolume = params.value("regionMinVolume", 27).toLongLong();
+        auto maxRegions = params.value("maxRegions", 0).toInt();
+        auto threshold = params.contains("regionThreshold") ?
+                    params.value("regionThreshold").toDouble() :
+                    adaptiveThreshold(input, params.value("regionK", 3.0).toDouble());
+
+        auto depth = input.sz[2];
+        auto tasks = qMin(depth, V3DLONG(qMax(1, threads) * 4));
+        if (tasks == 0)
+            throw invalid_argument("Empty image.");
+        vector<RegionAccumulator> slabs(tasks, RegionAccumulator(threshold));
+        AddPlanesKernel check = {slabs[0], input, 0, 0, 0};
+        if (!dispatchType(input.datatype, check))
+            throw invalid_argument("Unsupported pixel type.");
+        parallelFor(0, tasks, threads, [&](V3DLONG i) {
+            AddPlanesKernel kernel = {slabs[i], input, depth * i / tasks, depth * (i + 1) / tasks, 0};
+            dispatchType(input.datatype, kernel);
+        });
+        for (V3DLONG i = 1; i < tasks; ++i)
+            slabs[0].append(slabs[i]);
+        slabs[0].regions(output, minVolume);
+        if (maxRegions > 0 && output.size() > maxRegions)
+            output.resize(maxRegions);
+        return true;
+    }
+    catch(exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        output.clear();
+        return false;
+    }
+}
+
+// save regions as csv, a row per region in the order given
+bool writeRegions(const QString& path, const QVector<QcRegion>& regions)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+        cerr << "ERROR: Failed to write " << path.toStdString() << endl;
+        return false;
+    }
+    QTextStream out(&file);
+    out << "rank,x0,y0,z0,x1,y1,z1,volume,cx,cy,cz,sum,mean,stddev,max\n";
+    for (int i = 0; i < regions.size(); ++i)
+    {
+        const auto& r = regions.at(i);
+        out << i << ',' << r.box.start[0] << ',' << r.box.start[1] << ',' << r.box.start[2] << ','
+            << r.box.end[0] << ',' << r.box.end[1] << ',' << r.box.end[2] << ',' << r.volume << ','
+            << r.centroid[0] << ',' << r.centroid[1] << ',' << r.centroid[2] << ','
+            << r.sum << ',' << r.mean << ',' << r.stddev << ',' << r.max << '\n';
+    }
+    return true;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef REGIONS_H
+#define REGIONS_H
+
+#include "qcBasic.h"
+#include <vector>
+#include "TeraQCTypes.h"
+
+// a connected region of voxels above a threshold
+struct QcRegion
+{
+    // bounding box
+    QcRoi box;
+    // number of voxels
+    qint64 volume;
+    // mean x, y, z of the voxels
+    double centroid[3];
+    // intensity sum, mean, standard deviation & maximum
+    double sum, mean, stddev, max;
+};
+
+// statistics of a part of a region, merged into the region at last
+struct RegionStats
+{
+    RegionStats();
+    void merge(const RegionStats& other);
+
+    qint64 volume;
+    double sum, sumSq, max, sx, sy, sz;
+    V3DLONG lo[3], hi[3];
+};
+
+/*
+ * Incremental 3D connected components of voxels above a threshold
+ *
+ * Planes are fed in z order, each scanned into runs along x. Runs touching
+ * a run of the previous row or plane (6-connectivity) share its label, and
+ * labels joined by a run are united. Region statistics are accumulated per
+ * label as the runs are found, so the volume is read once and only the runs
+ * of the last plane are kept, besides the labels. Accumulators of
+ * consecutive slabs can be filled in parallel & appended in order.
+ */
+class RegionAccumulator
+{
+public:
+    explicit RegionAccumulator(double threshold=0);
+
+    void setThreshold(double threshold) { this->threshold = threshold; }
+    // add the planes of a slab, z0 is the z of its first plane, planes must follow the last added one
+    bool addSlab(const QcImage& slab, V3DLONG z0);
+    // join the accumulator of the slab following this one, next is emptied
+    void append(RegionAccumulator& next);
+    // regions of at least minVolume voxels, by descending intensity sum
+    void regions(QVector<QcRegion>& output, qint64 minVolume=1) const;
+    bool isEmpty() const { return lastZ < 0; }
+
+    // add a plane of the pixel type T, instantiated for the supported pixel types
+    template <class T>
+    void addPlane(const T* plane, V3DLONG width, V3DLONG height, V3DLONG z);
+
+private:
+    struct Run
+    {
+        V3DLONG x0, x1, y;
+        int label;
+    };
+
+    int find(int label) const;
+    void unite(int a, int b);
+    void link(const std::vector<Run>& upper, const std::vector<Run>& lower);
+
+    double threshold;
+    // union-find forest & statistics of the labels
+    mutable std::vector<int> parent;
+    std::vector<RegionStats> stats;
+    // runs of the first & the last plane, in y & x order
+    std::vector<Run> first, prev, cur;
+    V3DLONG firstZ, lastZ;
+};
+
+double adaptiveThreshold(const QcImage& input, double k, qint64 samples=1 << 20);
+
+bool findRegions(const QcImage& input, QVector<QcRegion>& output, const QVariantMap& params);
+
+bool writeRegions(const QString& path, const QVector<QcRegion>& regions);
+
+#endif // REGIONS_H
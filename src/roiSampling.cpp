@@ -4,18 +4,551 @@
 */
 
 #include "roiSampling.h"
+#include "imageView.h"
+#include "parallelUtils.h"
+#include "trace.h"
 #include "opencv2/opencv.hpp"
+#include <iostream>
+#include <algorithm>
+#include <random>
+#include <mutex>
 
 using namespace std;
 using namespace cv;
 
+// parsed params of local maxima finding, see findLocalMaxima
+struct PeakParams
+{
+    int radius, blockSize, threads, maxPeaks;
+    double sigma, threshold, prominence, minDistance;
+
+    explicit PeakParams(const QVariantMap& params)
+    {
+        radius = qMax(1u, params.value("peakRadius", 3).toUInt());
+        blockSize = qMax(1u, params.value("peakBlock", 16).toUInt());
+        maxPeaks = params.value("maxPeaks", 0).toUInt();
+        threads = threadCount(params);
+        sigma = params.value("peakSigma", 1.0).toDouble();
+        threshold = params.value("peakThreshold", 0.0).toDouble();
+        prominence = params.value("peakProminence", 0.0).toDouble();
+        minDistance = params.value("peakMinDistance", radius).toDouble();
+    }
+
+    // half size of the gaussian kernel
+    int smoothHalo() const
+    {
+        return sigma > 0 ? int(ceil(sigma * 3)) : 0;
+    }
+};
+
+/*
+ * Find the local maxima of a block of slices
+ *
+ * The slices [z0, z1) & a halo enough for the smoothing & the neighborhood
+ * are loaded as float, smoothed in xy & then in z, and filtered by max & min
+ * of the neighborhood in xy (dilation & erosion) & then in z. Halos are
+ * clipped at the volume borders, where the slices are replicated.
+ *
+ * plane: gives the z plane of a volume of depth slices.
+ *
+ */
+
+template <class Planes>
+static void blockMaxima(const Planes& plane, V3DLONG depth, V3DLONG z0, V3DLONG z1,
+                        const PeakParams& p, vector<QcPeak>& peaks)
+{
+    auto r = p.radius;
+    auto gh = p.smoothHalo();
+    auto gk = 2 * gh + 1;
+    // slices loaded, smoothed & filtered
+    auto l0 = max(V3DLONG(0), z0 - r - gh), l1 = min(depth, z1 + r + gh);
+    auto s0 = max(V3DLONG(0), z0 - r), s1 = min(depth, z1 + r);
+
+    vector<Mat> loaded(l1 - l0), smooth(s1 - s0), upper(s1 - s0), lower(s1 - s0);
+    for (auto z = l0; z < l1; ++z)
+    {
+        auto& m = loaded[z - l0];
+        plane(z).convertTo(m, CV_32F);
+        if (gk > 1)
+            GaussianBlur(m, m, Size(gk, gk), p.sigma);
+    }
+    auto kz = getGaussianKernel(gk, p.sigma, CV_32F);
+    auto k = getStructuringElement(MORPH_RECT, Size(2 * r + 1, 2 * r + 1));
+    for (auto z = s0; z < s1; ++z)
+    {
+        auto& m = smooth[z - s0];
+        m = Mat::zeros(loaded[0].size(), CV_32F);
+        for (int t = 0; t < gk; ++t)
+            scaleAdd(loaded[qBound(l0, z + t - gh, l1 - 1) - l0], kz.at<float>(t), m, m);
+        dilate(m, upper[z - s0], k);
+        erode(m, lower[z - s0], k);
+    }
+
+    Mat zmax, zmin;
+    for (auto z = z0; z < z1; ++z)
+    {
+        auto a = max(s0, z - r), b = min(s1, z + r + 1);
+        upper[a - s0].copyTo(zmax);
+        lower[a - s0].copyTo(zmin);
+        for (auto i = a + 1; i < b; ++i)
+        {
+            cv::max(zmax, upper[i - s0], zmax);
+            cv::min(zmin, lower[i - s0], zmin);
+        }
+        const auto& m = smooth[z - s0];
+        for (int y = 0; y < m.rows; ++y)
+        {
+            auto v = m.ptr<float>(y);
+            auto hi = zmax.ptr<float>(y);
+            auto lo = zmin.ptr<float>(y);
+            for (int x = 0; x < m.cols; ++x)
+                if (v[x] >= hi[x] && v[x] >= p.threshold && v[x] - lo[x] >= p.prominence && v[x] > lo[x])
+                {
+                    QcPeak peak = {{x, y, z}, v[x], v[x] - lo[x]};
+                    peaks.push_back(peak);
+                }
+        }
+    }
+}
+
+/*
+ * Keep peaks at least minDistance apart, the brighter ones first
+ *
+ * Accepted peaks are hashed into a grid of minDistance cells, so each peak
+ * is only checked against those in the 27 cells around it.
+ *
+ */
+
+static void suppressPeaks(vector<QcPeak>& peaks, double minDistance, int maxPeaks)
+{
+    stable_sort(peaks.begin(), peaks.end(), [](const QcPeak& a, const QcPeak& b) {
+        return a.intensity > b.intensity;
+    });
+    if (minDistance <= 0)
+    {
+        if (maxPeaks > 0 && int(peaks.size()) > maxPeaks)
+            peaks.resize(maxPeaks);
+        return;
+    }
+    auto cellKey = [](V3DLONG x, V3DLONG y, V3DLONG z) {
+        return (quint64(x & 0x1FFFFF) << 42) | (quint64(y & 0x1FFFFF) << 21) | quint64(z & 0x1FFFFF);
+    };
+    QHash<quint64, QVector<int> > grid;
+    vector<QcPeak> kept;
+    auto d2 = minDistance * minDistance;
+    for (size_t i = 0; i < peaks.size(); ++i)
+    {
+        const auto& p = peaks[i];
+        V3DLONG cell[3];
+        for (int d = 0; d < 3; ++d)
+            cell[d] = V3DLONG(p.pos[d] / minDistance);
+        auto isolated = true;
+        for (int dz = -1; dz <= 1 && isolated; ++dz)
+            for (int dy = -1; dy <= 1 && isolated; ++dy)
+                for (int dx = -1; dx <= 1 && isolated; ++dx)
+                {
+                    auto it = grid.constFind(cellKey(cell[0] + dx, cell[1] + dy, cell[2] + dz));
+                    if (it == grid.constEnd()) continue;
+                    for (int j = 0; j < it->size() && isolated; ++j)
+                    {
+                        const auto& q = kept[it->at(j)];
+                        double dist = 0;
+                        for (int d = 0; d < 3; ++d)
+                            dist += double(p.pos[d] - q.pos[d]) * (p.pos[d] - q.pos[d]);
+                        isolated = dist >= d2;
+                    }
+                }
+        if (!isolated) continue;
+        grid[cellKey(cell[0], cell[1], cell[2])].append(int(kept.size()));
+        kept.push_back(p);
+        if (maxPeaks > 0 && int(kept.size()) >= maxPeaks) break;
+    }
+    peaks.swap(kept);
+}
+
 /*
+ * Find strong signal sites as local maxima of the smoothed image
+ *
+ * Algorithm:
+ *
+ * 1. Gaussian smoothing in 3D;
+ *
+ * 2. Voxels that are the maximum of the (2 * peakRadius + 1)^3 cube around
+ * them, no less than peakThreshold, and at least peakProminence above the
+ * minimum of the cube are taken as peaks;
  *
+ * 3. Peaks closer than peakMinDistance to a brighter one are dropped.
  *
+ * Slices are processed in blocks of peakBlock slices on multiple threads,
+ * each with a halo, so memory is bounded by the block size & the number of
+ * threads, and the output by the number of peaks.
+ *
+ * Params:
+ *
+ * peakSigma: sigma of the gaussian smoothing, in voxels, 0 for no smoothing;
+ *
+ * peakRadius: radius of the neighborhood;
+ *
+ * peakThreshold: the minimal smoothed intensity of a peak;
+ *
+ * peakProminence: the minimal contrast of a peak to the minimum of its neighborhood;
+ *
+ * peakMinDistance: the minimal distance between peaks, peakRadius by default;
+ *
+ * maxPeaks: keep only the brightest peaks, 0 for all;
+ *
+ * peakBlock: number of slices in a block;
+ *
+ * threads: number of threads, all cores by default.
  *
 */
 
-bool findLocalMaxima(const QcImage& input, QcImage& output, const QVariantMap& params)
+bool findLocalMaxima(const QcImage& input, QVector<QcPeak>& output, const QVariantMap& params)
+{
+    QcTraceScope traceScope("findLocalMaxima");
+    output.clear();
+    QScopedPointer<PeakParams> p;
+    try {
+        p.reset(new PeakParams(params));
+    }  catch (...) {
+        cerr << "Argument Parsing Error. Please check the argument list." << endl;
+        return false;
+    }
+
+    try
+    {
+        auto blocks = (input.sz[2] + p->blockSize - 1) / p->blockSize;
+        vector<vector<QcPeak> > found(blocks);
+        parallelFor(0, blocks, p->threads, [&](V3DLONG i) {
+            auto z0 = i * p->blockSize;
+            blockMaxima([&input](V3DLONG z) { return qcPlane(input, z); }, input.sz[2],
+                        z0, min(input.sz[2], z0 + p->blockSize), *p, found[i]);
+        });
+        // gathered in block order so the result doesn't depend on the scheduling
+        vector<QcPeak> peaks;
+        for (size_t i = 0; i < found.size(); ++i)
+            peaks.insert(peaks.end(), found[i].begin(), found[i].end());
+        suppressPeaks(peaks, p->minDistance, p->maxPeaks);
+        output = QVector<QcPeak>::fromStdVector(peaks);
+        return true;
+    }
+    catch(...)
+    {
+        cerr << "ERROR: Unkown exception, probably related to OPENCV functions." << endl;
+        output.clear();
+        return false;
+    }
+}
+
+/*
+ * Local maxima finding on slabs fed in z order, see findLocalMaxima
+ *
+ * The volume is cut into the same blocks as findLocalMaxima. A block is
+ * processed once the slabs cover it & its halo, and the slabs are released
+ * once no later block needs them, so the result is the same as on the whole
+ * volume while only the slabs around the blocks in process are held.
+ *
+ */
+
+PeakStream::PeakStream(V3DLONG depth, const QVariantMap& params):
+    depth(depth), added(0), nextBlock(0)
+{
+    p.reset(new PeakParams(params));
+    halo = p->radius + p->smoothHalo();
+}
+
+PeakStream::~PeakStream()
+{
+}
+
+bool PeakStream::addSlab(const QSharedPointer<const QcImage>& slab, V3DLONG z0)
+{
+    QcTraceScope traceScope("peaks slab");
+    try
+    {
+        if (z0 != added || z0 + slab->sz[2] > depth)
+            throw invalid_argument("Slabs must be added in z order & within the volume.");
+        slabs.push_back(qMakePair(z0, slab));
+        added += slab->sz[2];
+
+        // blocks covered with their halos
+        auto blockSize = V3DLONG(p->blockSize);
+        auto blocks = (depth + blockSize - 1) / blockSize;
+        auto ready = nextBlock;
+        while (ready < blocks && min(depth, (ready + 1) * blockSize + halo) <= added)
+            ++ready;
+        if (ready == nextBlock)
+            return true;
+
+        auto plane = [this](V3DLONG z) -> Mat {
+            for (size_t i = 0; i < slabs.size(); ++i)
+                if (z < slabs[i].first + slabs[i].second->sz[2])
+                    return qcPlane(*slabs[i].second, z - slabs[i].first);
+            throw out_of_range("The plane of the local maxima block is not in the slabs.");
+        };
+        vector<vector<QcPeak> > blockPeaks(ready - nextBlock);
+        parallelFor(nextBlock, ready, p->threads, [&](V3DLONG i) {
+            blockMaxima(plane, depth, i * blockSize, min(depth, (i + 1) * blockSize), *p,
+                        blockPeaks[i - nextBlock]);
+        });
+        // gathered in block order so the result doesn't depend on the scheduling
+        for (size_t i = 0; i < blockPeaks.size(); ++i)
+            found.insert(found.end(), blockPeaks[i].begin(), blockPeaks[i].end());
+        nextBlock = ready;
+
+        // release the slabs before the halo of the next block
+        while (!slabs.empty() && slabs.front().first + slabs.front().second->sz[2] <= nextBlock * blockSize - halo)
+            slabs.pop_front();
+        return true;
+    }
+    catch(exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        return false;
+    }
+}
+
+bool PeakStream::peaks(QVector<QcPeak>& output)
+{
+    QcTraceScope traceScope("peaks");
+    output.clear();
+    if (added != depth)
+    {
+        cerr << "ERROR: Local maxima are only final after the whole volume is added." << endl;
+        return false;
+    }
+    suppressPeaks(found, p->minDistance, p->maxPeaks);
+    output = QVector<QcPeak>::fromStdVector(found);
+    slabs.clear();
+    return true;
+}
+
+// save peaks as csv, with x, y, z, intensity & contrast in columns
+bool writePeaks(const QString& path, const QVector<QcPeak>& peaks)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+        cerr << "ERROR: Failed to write " << path.toStdString() << endl;
+        return false;
+    }
+    QTextStream out(&file);
+    out << "x,y,z,intensity,contrast\n";
+    for (int i = 0; i < peaks.size(); ++i)
+    {
+        const auto& p = peaks.at(i);
+        out << p.pos[0] << ',' << p.pos[1] << ',' << p.pos[2] << ','
+            << p.intensity << ',' << p.contrast << '\n';
+    }
+    return true;
+}
+
+/*
+ * Draw random blocks from regions, mapped to a level of the pyramid
+ *
+ * The bounding box of each region is mapped from regionLevel to level, and
+ * blocks of sampleSize voxels are placed uniformly in it, clipped by the
+ * level. The random engine of a region is seeded by the seed & the region
+ * index, so the blocks of a region don't depend on the other regions.
+ *
+ * Params:
+ *
+ * samplesPerRegion: number of blocks per region;
+ *
+ * sampleSize: edge length of the blocks in voxels of level;
+ *
+ * seed: seed of the random positions.
+ *
+ */
+
+bool planBlockSamples(const TeraPyramid& pyramid, const QVector<QcRegion>& regions, int regionLevel,
+                      int level, const QVariantMap& params, QVector<QcBlockSample>& samples)
+{
+    samples.clear();
+    auto n = params.value("samplesPerRegion", 10).toInt();
+    auto size = params.value("sampleSize", 128).toLongLong();
+    auto seed = params.value("seed", 0).toULongLong();
+    if (n <= 0 || size <= 0 || regionLevel < 0 || regionLevel >= pyramid.levels() ||
+            level < 0 || level >= pyramid.levels())
+    {
+        cerr << "ERROR: Illegal sampling params." << endl;
+        return false;
+    }
+    const auto& dims = pyramid.level(level).sz;
+    for (int r = 0; r < regions.size(); ++r)
+    {
+        auto box = pyramid.mapRoi(regions.at(r).box, regionLevel, level);
+        mt19937_64 engine(seed * 0x9E3779B97F4A7C15ULL + r);
+        for (int i = 0; i < n; ++i)
+        {
+            QcBlockSample sample;
+            sample.region = r;
+            sample.index = i;
+            for (int d = 0; d < 3; ++d)
+            {
+                // starts keeping the block in the region, or centered on a region smaller than it
+                auto edge = qMin(size, dims[d]);
+                auto lo = box.start[d], hi = box.end[d] - edge;
+                if (hi < lo) lo = hi = (box.start[d] + box.end[d] - edge) / 2;
+                auto start = uniform_int_distribution<V3DLONG>(lo, hi)(engine);
+                start = qBound(V3DLONG(0), start, dims[d] - edge);
+                sample.box.start[d] = start;
+                sample.box.end[d] = start + edge;
+            }
+            samples.append(sample);
+        }
+    }
+    return true;
+}
+
+/*
+ * Load the blocks of samples at a level & pass them to a consumer
+ *
+ * Samples are grouped by the first block of the teraconvert level they
+ * touch, and groups are fetched concurrently, each in one task, so with a
+ * tile cache set on the pyramid a block is decoded once for all the samples
+ * in it. Only the blocks touched are read. consume is called from the
+ * fetching threads & must be thread safe; the image is only valid during
+ * the call.
+ *
+ * report: if not NULL, gets tiles (number of blocks in the level),
+ * touchedTiles & sampledVoxels.
+ *
+ */
+
+bool fetchBlockSamples(TeraPyramid& pyramid, int level, const QVector<QcBlockSample>& samples,
+                       const BlockConsumer& consume, int threads, QVariantMap* report)
+{
+    try
+    {
+        TeraManifest manifest;
+        if (!pyramid.manifest(level, manifest))
+            throw runtime_error("Failed to get the manifest of the sampling level.");
+
+        // the first block touched by each sample, -1 if none
+        QVector<int> first(samples.size(), -1);
+        QSet<int> touched;
+        qint64 voxels = 0;
+        for (int i = 0; i < samples.size(); ++i)
+        {
+            const auto& box = samples.at(i).box;
+            voxels += box.size(0) * box.size(1) * box.size(2);
+            for (int t = 0; t < manifest.tiles.size(); ++t)
+            {
+                const auto& tile = manifest.tiles.at(t);
+                auto tileBox = QcRoi(tile.origin[0], tile.origin[1], tile.origin[2],
+                        tile.origin[0] + tile.sz[0], tile.origin[1] + tile.sz[1], tile.origin[2] + tile.sz[2]);
+                if (tileBox.intersected(box).isEmpty()) continue;
+                if (first[i] < 0) first[i] = t;
+                touched.insert(t);
+            }
+        }
+
+        // consecutive samples of the same first block form a group
+        QVector<int> order(samples.size());
+        for (int i = 0; i < order.size(); ++i) order[i] = i;
+        stable_sort(order.begin(), order.end(), [&](int a, int b) { return first[a] < first[b]; });
+        QVector<int> groups;
+        for (int i = 0; i < order.size(); ++i)
+            if (i == 0 || first[order[i]] != first[order[i - 1]])
+                groups.append(i);
+        groups.append(order.size());
+
+        parallelFor(0, groups.size() - 1, threads, [&](V3DLONG g) {
+            QcImage block;
+            for (int i = groups[g]; i < groups[g + 1]; ++i)
+            {
+                const auto& sample = samples.at(order[i]);
+                if (!pyramid.loadRoi(level, sample.box, block))
+                    throw runtime_error("Failed to load a sampled block.");
+                consume(sample, block);
+            }
+        });
+
+        if (report)
+        {
+            (*report)["tiles"] = manifest.tiles.size();
+            (*report)["touchedTiles"] = touched.size();
+            (*report)["sampledVoxels"] = voxels;
+        }
+        return true;
+    }
+    catch(exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        return false;
+    }
+}
+
+// summarize the histogram of a sampled block
+QcBlockStats blockStats(const QcBlockSample& sample, const QcHistogram& hist)
+{
+    QcBlockStats stats;
+    stats.sample = sample;
+    stats.p1 = hist.percentile(1);
+    stats.p50 = hist.percentile(50);
+    stats.p99 = hist.percentile(99);
+    stats.mean = hist.mean();
+    stats.stddev = hist.stddev();
+    stats.snr = hist.snr();
+    stats.entropy = hist.entropy();
+    return stats;
+}
+
+/*
+ * Fetch sampled blocks & summarize each by its histogram, see fetchBlockSamples
+ *
+ * histBins: bins of the block histograms, a bin per value for integer pixels if 0;
+ * float blocks are binned over the range of their own values;
+ *
+ * consume: if not empty, also called with each block, from several threads.
+ *
+ */
+
+bool sampleBlockStats(TeraPyramid& pyramid, int level, const QVector<QcBlockSample>& samples, int histBins,
+                      int threads, QVector<QcBlockStats>& stats, QVariantMap* report, const BlockConsumer& consume)
+{
+    QcTraceScope traceScope("sampleBlockStats");
+    stats.clear();
+    mutex statsMutex;
+    auto ok = fetchBlockSamples(pyramid, level, samples, [&](const QcBlockSample& sample, const QcImage& block) {
+        auto hist = QcHistogram::forImage(block, histBins);
+        if (!computeHistogram(block, hist))
+            throw runtime_error("Failed to get the histogram of a sampled block.");
+        if (consume)
+            consume(sample, block);
+        lock_guard<mutex> lk(statsMutex);
+        stats.append(blockStats(sample, hist));
+    }, threads, report);
+    if (!ok)
+        stats.clear();
+    return ok;
+}
+
+// save block statistics as csv, sorted by region & block
+bool writeBlockStats(const QString& path, QVector<QcBlockStats> stats)
 {
-    return false;
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+        cerr << "ERROR: Failed to write " << path.toStdString() << endl;
+        return false;
+    }
+    sort(stats.begin(), stats.end(), [](const QcBlockStats& a, const QcBlockStats& b) {
+        return a.sample.region < b.sample.region ||
+                (a.sample.region == b.sample.region && a.sample.index < b.sample.index);
+    });
+    QTextStream out(&file);
+    out << "region,block,x0,y0,z0,x1,y1,z1,p1,p50,p99,mean,stddev,snr,entropy\n";
+    for (int i = 0; i < stats.size(); ++i)
+    {
+        const auto& s = stats.at(i);
+        const auto& box = s.sample.box;
+        out << s.sample.region << ',' << s.sample.index << ','
+            << box.start[0] << ',' << box.start[1] << ',' << box.start[2] << ','
+            << box.end[0] << ',' << box.end[1] << ',' << box.end[2] << ','
+            << s.p1 << ',' << s.p50 << ',' << s.p99 << ',' << s.mean << ','
+            << s.stddev << ',' << s.snr << ',' << s.entropy << '\n';
+    }
+    return true;
 }
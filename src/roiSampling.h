@@ -6,9 +6,83 @@
 #ifndef ROISAMPLING_H
 #define ROISAMPLING_H
 
-#include <v3d_interface.h>
+#include "qcBasic.h"
+#include <functional>
+#include <deque>
+#include <vector>
 #include "TeraQCTypes.h"
+#include "teraPyramid.h"
+#include "regions.h"
+#include "histogram.h"
 
-bool findLocalMaxima(const QcImage& input, QcImage& output, const QVariantMap& params);
+// a local maximum of the smoothed image
+struct QcPeak
+{
+    // x, y, z in voxels
+    V3DLONG pos[3];
+    // smoothed intensity
+    float intensity;
+    // smoothed intensity over the minimum of its neighborhood
+    float contrast;
+};
+
+bool findLocalMaxima(const QcImage& input, QVector<QcPeak>& output, const QVariantMap& params);
+
+struct PeakParams;
+
+// local maxima finding on slabs fed in z order, see findLocalMaxima
+class PeakStream
+{
+public:
+    // depth: number of slices of the whole volume
+    PeakStream(V3DLONG depth, const QVariantMap& params);
+    ~PeakStream();
+
+    // add a slab, z0 is the z of its first plane, it's kept only as long as it's needed
+    bool addSlab(const QSharedPointer<const QcImage>& slab, V3DLONG z0);
+    // peaks of the whole volume, after all the slabs are added
+    bool peaks(QVector<QcPeak>& output);
+
+private:
+    QScopedPointer<PeakParams> p;
+    V3DLONG depth, halo, added, nextBlock;
+    // slabs held & their z
+    std::deque<QPair<V3DLONG, QSharedPointer<const QcImage> > > slabs;
+    std::vector<QcPeak> found;
+};
+
+bool writePeaks(const QString& path, const QVector<QcPeak>& peaks);
+
+// a block drawn from a region
+struct QcBlockSample
+{
+    // index of the region & of the block in the region
+    int region, index;
+    // the block at the sampling level
+    QcRoi box;
+};
+
+typedef std::function<void(const QcBlockSample&, const QcImage&)> BlockConsumer;
+
+bool planBlockSamples(const TeraPyramid& pyramid, const QVector<QcRegion>& regions, int regionLevel,
+                      int level, const QVariantMap& params, QVector<QcBlockSample>& samples);
+
+bool fetchBlockSamples(TeraPyramid& pyramid, int level, const QVector<QcBlockSample>& samples,
+                       const BlockConsumer& consume, int threads, QVariantMap* report=NULL);
+
+// intensity summary of a sampled block
+struct QcBlockStats
+{
+    QcBlockSample sample;
+    double p1, p50, p99, mean, stddev, snr, entropy;
+};
+
+QcBlockStats blockStats(const QcBlockSample& sample, const QcHistogram& hist);
+
+bool sampleBlockStats(TeraPyramid& pyramid, int level, const QVector<QcBlockSample>& samples, int histBins,
+                      int threads, QVector<QcBlockStats>& stats, QVariantMap* report=NULL,
+                      const BlockConsumer& consume=BlockConsumer());
+
+bool writeBlockStats(const QString& path, QVector<QcBlockStats> stats);
 
 #endif // ROISAMPLING_H
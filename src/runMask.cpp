@@ -0,0 +1,301 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "runMask.h"
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+qint64 QcMaskPlane::count() const
+{
+    qint64 n = 0;
+    for (size_t i = 0; i < runs.size(); ++i)
+        n += runs[i].x1 - runs[i].x0;
+    return n;
+}
+
+void QcMaskPlane::fromDense(const v3d_uint8* plane, V3DLONG width, V3DLONG rows, V3DLONG step)
+{
+    reset(rows);
+    for (V3DLONG y = 0; y < rows; ++y)
+    {
+        auto row = plane + y * step;
+        for (V3DLONG x = 0; x < width;)
+        {
+            if (row[x] == 0)
+            {
+                ++x;
+                continue;
+            }
+            QcRun run = {qint32(x), 0};
+            while (x < width && row[x] != 0) ++x;
+            run.x1 = qint32(x);
+            runs.push_back(run);
+        }
+        rowStart[y + 1] = quint32(runs.size());
+    }
+}
+
+void QcMaskPlane::toDense(v3d_uint8* plane, V3DLONG width, V3DLONG step, v3d_uint8 value) const
+{
+    for (V3DLONG y = 0; y < rows(); ++y)
+    {
+        auto row = plane + y * step;
+        memset(row, 0, width);
+        for (auto r = begin(y); r != end(y); ++r)
+            memset(row + r->x0, value, r->x1 - r->x0);
+    }
+}
+
+// append the union of sorted runs to out, merging the overlapping & touching ones
+static void mergeSorted(const QcRun* a, const QcRun* aEnd, const QcRun* b, const QcRun* bEnd, vector<QcRun>& out)
+{
+    auto start = out.size();
+    while (a != aEnd || b != bEnd)
+    {
+        auto r = (b == bEnd || (a != aEnd && a->x0 <= b->x0)) ? *a++ : *b++;
+        if (out.size() > start && r.x0 <= out.back().x1)
+            out.back().x1 = max(out.back().x1, r.x1);
+        else
+            out.push_back(r);
+    }
+}
+
+void QcMaskPlane::addDense(const v3d_uint8* patch, V3DLONG width, V3DLONG rows, V3DLONG step, V3DLONG x0, V3DLONG y0)
+{
+    QcMaskPlane added;
+    added.fromDense(patch, width, rows, step);
+    if (added.runs.empty())
+        return;
+    for (size_t i = 0; i < added.runs.size(); ++i)
+    {
+        added.runs[i].x0 += qint32(x0);
+        added.runs[i].x1 += qint32(x0);
+    }
+    QcMaskPlane merged;
+    merged.reset(this->rows());
+    merged.runs.reserve(runs.size() + added.runs.size());
+    for (V3DLONG y = 0; y < this->rows(); ++y)
+    {
+        if (y >= y0 && y < y0 + rows)
+            mergeSorted(begin(y), end(y), added.begin(y - y0), added.end(y - y0), merged.runs);
+        else
+            merged.runs.insert(merged.runs.end(), begin(y), end(y));
+        merged.rowStart[y + 1] = quint32(merged.runs.size());
+    }
+    rowStart.swap(merged.rowStart);
+    runs.swap(merged.runs);
+}
+
+void maskUnion(const vector<const QcMaskPlane*>& planes, QcMaskPlane& output)
+{
+    auto rows = planes.empty() ? 0 : planes[0]->rows();
+    output.reset(rows);
+    vector<QcRun> row;
+    for (V3DLONG y = 0; y < rows; ++y)
+    {
+        row.clear();
+        for (size_t i = 0; i < planes.size(); ++i)
+            row.insert(row.end(), planes[i]->begin(y), planes[i]->end(y));
+        sort(row.begin(), row.end(), [](const QcRun& a, const QcRun& b) { return a.x0 < b.x0; });
+        mergeSorted(row.data(), row.data() + row.size(), NULL, NULL, output.runs);
+        output.rowStart[y + 1] = quint32(output.runs.size());
+    }
+}
+
+void maskIntersection(const vector<const QcMaskPlane*>& planes, QcMaskPlane& output)
+{
+    auto rows = planes.empty() ? 0 : planes[0]->rows();
+    output.reset(rows);
+    vector<QcRun> row, next;
+    for (V3DLONG y = 0; y < rows; ++y)
+    {
+        row.assign(planes[0]->begin(y), planes[0]->end(y));
+        for (size_t i = 1; i < planes.size() && !row.empty(); ++i)
+        {
+            next.clear();
+            auto a = row.begin();
+            auto b = planes[i]->begin(y), bEnd = planes[i]->end(y);
+            while (a != row.end() && b != bEnd)
+            {
+                QcRun r = {max(a->x0, b->x0), min(a->x1, b->x1)};
+                if (r.x0 < r.x1)
+                    next.push_back(r);
+                // move on from the run ending first
+                if (a->x1 < b->x1) ++a;
+                else ++b;
+            }
+            row.swap(next);
+        }
+        output.runs.insert(output.runs.end(), row.begin(), row.end());
+        output.rowStart[y + 1] = quint32(output.runs.size());
+    }
+}
+
+void QcMask::create(const V3DLONG sz[3])
+{
+    for (int i = 0; i < 3; ++i) this->sz[i] = sz[i];
+    planes.assign(sz[2], QcMaskPlane());
+    for (V3DLONG z = 0; z < sz[2]; ++z)
+        planes[z].reset(sz[1]);
+}
+
+void QcMask::clear()
+{
+    for (int i = 0; i < 3; ++i) sz[i] = 0;
+    vector<QcMaskPlane>().swap(planes);
+}
+
+qint64 QcMask::count() const
+{
+    qint64 n = 0;
+    for (size_t z = 0; z < planes.size(); ++z)
+        n += planes[z].count();
+    return n;
+}
+
+qint64 QcMask::bytes() const
+{
+    qint64 n = 0;
+    for (size_t z = 0; z < planes.size(); ++z)
+        n += planes[z].rowStart.size() * sizeof(quint32) + planes[z].runs.size() * sizeof(QcRun);
+    return n;
+}
+
+bool QcMask::toImage(QcImage& output, V3DLONG z0, V3DLONG z1) const
+{
+    if (z1 < 0)
+        z1 = sz[2];
+    if (z0 < 0 || z1 > sz[2] || z1 <= z0)
+    {
+        cerr << "ERROR: The planes are out of the mask." << endl;
+        return false;
+    }
+    V3DLONG osz[4] = {sz[0], sz[1], z1 - z0, 1};
+    output.clear();
+    output.create(osz, V3D_UINT8);
+    for (auto z = z0; z < z1; ++z)
+        planes[z].toDense(output.buffer + (z - z0) * sz[0] * sz[1], sz[0], sz[0]);
+    return true;
+}
+
+bool QcMask::fromImage(const QcImage& image)
+{
+    if (image.buffer == NULL || image.datatype != V3D_UINT8)
+    {
+        cerr << "ERROR: A mask is made of an 8bit image." << endl;
+        return false;
+    }
+    create(image.sz);
+    for (V3DLONG z = 0; z < sz[2]; ++z)
+        planes[z].fromDense(image.buffer + z * sz[0] * sz[1], sz[0], sz[1], sz[0]);
+    return true;
+}
+
+static const char QC_MASK_MAGIC[8] = {'T', 'E', 'R', 'A', 'Q', 'C', 'M', '1'};
+
+/*
+ * Save a mask as runs
+ *
+ * After the magic & the x, y, z dimensions as 64bit integers, each plane
+ * has its number of rows with runs, then for each of them its y, its
+ * number of runs & the runs, all as 32bit integers. An empty plane takes
+ * 4 bytes, and a run 8.
+ *
+ */
+
+bool saveMask(const QString& path, const QcMask& mask)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        cerr << "ERROR: Failed to write " << path.toStdString() << endl;
+        return false;
+    }
+    qint64 sz[3] = {mask.sz[0], mask.sz[1], mask.sz[2]};
+    bool ok = file.write(QC_MASK_MAGIC, sizeof(QC_MASK_MAGIC)) == sizeof(QC_MASK_MAGIC) &&
+            file.write((const char*)sz, sizeof(sz)) == sizeof(sz);
+    for (size_t z = 0; ok && z < mask.planes.size(); ++z)
+    {
+        const auto& plane = mask.planes[z];
+        quint32 rows = 0;
+        for (V3DLONG y = 0; y < plane.rows(); ++y)
+            if (plane.end(y) != plane.begin(y))
+                ++rows;
+        ok = file.write((const char*)&rows, sizeof(rows)) == sizeof(rows);
+        for (V3DLONG y = 0; ok && y < plane.rows(); ++y)
+        {
+            quint32 n = quint32(plane.end(y) - plane.begin(y));
+            if (n == 0) continue;
+            quint32 row[2] = {quint32(y), n};
+            ok = file.write((const char*)row, sizeof(row)) == sizeof(row) &&
+                    file.write((const char*)plane.begin(y), n * sizeof(QcRun)) == qint64(n * sizeof(QcRun));
+        }
+    }
+    if (!ok)
+        cerr << "ERROR: Failed to write " << path.toStdString() << endl;
+    return ok;
+}
+
+bool loadMask(const QString& path, QcMask& mask)
+{
+    try
+    {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly))
+            throw runtime_error("Failed to open " + path.toStdString());
+        auto read = [&](void* data, qint64 bytes) {
+            if (file.read((char*)data, bytes) != bytes)
+                throw runtime_error("Truncated mask file " + path.toStdString());
+        };
+        char magic[8];
+        qint64 dims[3];
+        read(magic, sizeof(magic));
+        if (memcmp(magic, QC_MASK_MAGIC, sizeof(magic)) != 0)
+            throw runtime_error("Not a mask file " + path.toStdString());
+        read(dims, sizeof(dims));
+        V3DLONG sz[3] = {V3DLONG(dims[0]), V3DLONG(dims[1]), V3DLONG(dims[2])};
+        if (sz[0] < 0 || sz[1] < 0 || sz[2] < 0)
+            throw runtime_error("Illegal mask file " + path.toStdString());
+        mask.create(sz);
+        for (V3DLONG z = 0; z < sz[2]; ++z)
+        {
+            auto& plane = mask.planes[z];
+            quint32 rows;
+            read(&rows, sizeof(rows));
+            V3DLONG last = -1;
+            for (quint32 i = 0; i < rows; ++i)
+            {
+                quint32 row[2];
+                read(row, sizeof(row));
+                if (V3DLONG(row[0]) <= last || V3DLONG(row[0]) >= sz[1])
+                    throw runtime_error("Illegal mask file " + path.toStdString());
+                // rows between are empty
+                for (auto y = last + 1; y < V3DLONG(row[0]); ++y)
+                    plane.rowStart[y + 1] = quint32(plane.runs.size());
+                auto start = plane.runs.size();
+                plane.runs.resize(start + row[1]);
+                read(plane.runs.data() + start, row[1] * sizeof(QcRun));
+                for (auto r = start; r < plane.runs.size(); ++r)
+                    if (plane.runs[r].x0 < 0 || plane.runs[r].x1 > sz[0] || plane.runs[r].x0 >= plane.runs[r].x1 ||
+                            (r > start && plane.runs[r].x0 <= plane.runs[r - 1].x1))
+                        throw runtime_error("Illegal mask file " + path.toStdString());
+                last = row[0];
+                plane.rowStart[last + 1] = quint32(plane.runs.size());
+            }
+            for (auto y = last + 1; y < sz[1]; ++y)
+                plane.rowStart[y + 1] = quint32(plane.runs.size());
+        }
+        return true;
+    }
+    catch (exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        mask.clear();
+        return false;
+    }
+}
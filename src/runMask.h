@@ -0,0 +1,91 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef RUNMASK_H
+#define RUNMASK_H
+
+#include "qcBasic.h"
+#include "TeraQCTypes.h"
+#include <vector>
+
+// marked voxels [x0, x1) of a row
+struct QcRun
+{
+    qint32 x0, x1;
+};
+
+// marked voxels of a z plane as runs per row, sorted & apart in each row
+struct QcMaskPlane
+{
+    // runs of row y are runs[rowStart[y]] to runs[rowStart[y + 1] - 1]
+    std::vector<quint32> rowStart;
+    std::vector<QcRun> runs;
+
+    // an empty plane of some rows
+    void reset(V3DLONG rows)
+    {
+        rowStart.assign(rows + 1, 0);
+        runs.clear();
+    }
+    V3DLONG rows() const { return rowStart.empty() ? 0 : V3DLONG(rowStart.size()) - 1; }
+    const QcRun* begin(V3DLONG y) const { return runs.data() + rowStart[y]; }
+    const QcRun* end(V3DLONG y) const { return runs.data() + rowStart[y + 1]; }
+    qint64 count() const;
+
+    // the nonzero voxels of a dense 8bit plane, step in bytes between its rows
+    void fromDense(const v3d_uint8* plane, V3DLONG width, V3DLONG rows, V3DLONG step);
+    // marked voxels set to value, the rest to 0
+    void toDense(v3d_uint8* plane, V3DLONG width, V3DLONG step, v3d_uint8 value=255) const;
+    // mark the nonzero voxels of a dense patch placed at x0, y0
+    void addDense(const v3d_uint8* patch, V3DLONG width, V3DLONG rows, V3DLONG step, V3DLONG x0, V3DLONG y0);
+};
+
+// voxels marked in any or all of planes of the same rows
+void maskUnion(const std::vector<const QcMaskPlane*>& planes, QcMaskPlane& output);
+
+void maskIntersection(const std::vector<const QcMaskPlane*>& planes, QcMaskPlane& output);
+
+/*
+ * Binary mask of a volume as runs of marked voxels per row
+ *
+ * A marker mask is mostly empty but for a few thin lines, so its runs take
+ * a tiny part of the byte per voxel of a dense 8bit mask, and kernels go
+ * through a row span by span, on & off the runs, instead of testing every
+ * voxel. Planes are separate, so they're built in parallel & handed over
+ * by slabs. Dense 8bit masks (255 for marked) are only made for saving as
+ * images, a slab at a time.
+ */
+class QcMask
+{
+public:
+    QcMask()
+    {
+        for (int i = 0; i < 3; ++i) sz[i] = 0;
+    }
+
+    // empty planes of x, y, z dimensions sz
+    void create(const V3DLONG sz[3]);
+    void clear();
+    bool isEmpty() const { return planes.empty(); }
+
+    // marked voxels
+    qint64 count() const;
+    // bytes of the runs & row starts
+    qint64 bytes() const;
+
+    // dense 8bit planes [z0, z1), z1 < 0 for all
+    bool toImage(QcImage& output, V3DLONG z0=0, V3DLONG z1=-1) const;
+    bool fromImage(const QcImage& image);
+
+    // dimensions
+    V3DLONG sz[3];
+    std::vector<QcMaskPlane> planes;
+};
+
+bool saveMask(const QString& path, const QcMask& mask);
+
+bool loadMask(const QString& path, QcMask& mask);
+
+#endif // RUNMASK_H
@@ -0,0 +1,190 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "slabWriter.h"
+#include "teraManifest.h"
+#include "tiffIO.h"
+#include "trace.h"
+#include <iostream>
+#include <cstring>
+
+using namespace std;
+
+/*
+ * Start a teraconvert resolution in the folder path
+ *
+ * Params:
+ *
+ * sz: x, y, z dimensions & channels of the volume
+ *
+ * tile: x, y, z dimensions of the blocks, the last ones are cut by the volume
+ *
+ * saver: saves each block as an image file
+ *
+ */
+
+bool TeraSlabWriter::open(const QString& path, const V3DLONG sz[4], int datatype, const V3DLONG tile[3],
+                          const Saver& saver)
+{
+    try
+    {
+        for (int i = 0; i < 4; ++i)
+            if (sz[i] <= 0 || (i < 3 && tile[i] <= 0))
+                throw invalid_argument("Empty volume or blocks to write.");
+        for (int i = 0; i < 4; ++i) this->sz[i] = sz[i];
+        for (int i = 0; i < 3; ++i) this->tile[i] = qMin(tile[i], sz[i]);
+        this->datatype = datatype;
+        this->saver = saver;
+        res = QDir(path).filePath(teraResolutionName(sz));
+        for (V3DLONG y = 0; y < sz[1]; y += this->tile[1])
+            for (V3DLONG x = 0; x < sz[0]; x += this->tile[0])
+            {
+                V3DLONG origin[3] = {x, y, 0};
+                if (!QDir().mkpath(QFileInfo(res + '/' + teraTilePath(sz, origin)).path()))
+                    throw runtime_error("Failed to create the folders of " + res.toStdString());
+            }
+        V3DLONG lsz[4] = {sz[0], sz[1], this->tile[2], sz[3]};
+        layer.clear();
+        layer.create(lsz, datatype);
+        layerZ0 = layerPlanes = planes = 0;
+        return true;
+    }
+    catch (exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        layer.clear();
+        return false;
+    }
+}
+
+// copy the planes of a slab into the layer, saving the layer whenever it's full
+bool TeraSlabWriter::write(const QcImage& slab)
+{
+    QcTraceScope traceScope("write blocks");
+    try
+    {
+        if (layer.buffer == NULL)
+            throw runtime_error("The teraconvert writer isn't open.");
+        if (slab.sz[0] != sz[0] || slab.sz[1] != sz[1] || slab.sz[3] != sz[3] || slab.datatype != datatype ||
+                planes + slab.sz[2] > sz[2])
+            throw invalid_argument("The slab doesn't fit the volume written.");
+        auto planeBytes = sz[0] * sz[1] * qcTypeSize(datatype);
+        for (V3DLONG z = 0; z < slab.sz[2]; ++z)
+        {
+            for (V3DLONG c = 0; c < sz[3]; ++c)
+                memcpy(layer.buffer + (c * layer.sz[2] + layerPlanes) * planeBytes,
+                       slab.buffer + (c * slab.sz[2] + z) * planeBytes, planeBytes);
+            ++planes;
+            // the last layer is cut by the volume
+            if (++layerPlanes == qMin(tile[2], sz[2] - layerZ0) && !flush())
+                throw runtime_error("Failed to save the blocks of " + res.toStdString());
+        }
+        return true;
+    }
+    catch (exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        return false;
+    }
+}
+
+// cut the layer into blocks & save them
+bool TeraSlabWriter::flush()
+{
+    auto bytes = qcTypeSize(datatype);
+    auto planeBytes = sz[0] * sz[1] * bytes;
+    QcImage block;
+    for (V3DLONG y0 = 0; y0 < sz[1]; y0 += tile[1])
+        for (V3DLONG x0 = 0; x0 < sz[0]; x0 += tile[0])
+        {
+            V3DLONG bsz[4] = {qMin(tile[0], sz[0] - x0), qMin(tile[1], sz[1] - y0), layerPlanes, sz[3]};
+            block.clear();
+            block.create(bsz, datatype);
+            auto rowBytes = bsz[0] * bytes;
+            auto dst = block.buffer;
+            for (V3DLONG c = 0; c < sz[3]; ++c)
+                for (V3DLONG z = 0; z < bsz[2]; ++z)
+                    for (V3DLONG y = 0; y < bsz[1]; ++y, dst += rowBytes)
+                        memcpy(dst, layer.buffer + (c * layer.sz[2] + z) * planeBytes +
+                               ((y0 + y) * sz[0] + x0) * bytes, rowBytes);
+            V3DLONG origin[3] = {x0, y0, layerZ0};
+            auto file = res + '/' + teraTilePath(sz, origin);
+            if (!saver(file.toStdString().c_str(), block))
+            {
+                cerr << "ERROR: Failed to save " << file.toStdString() << endl;
+                return false;
+            }
+        }
+    layerZ0 += layerPlanes;
+    layerPlanes = 0;
+    return true;
+}
+
+bool TeraSlabWriter::finish()
+{
+    if (planes != sz[2])
+    {
+        cerr << "ERROR: Only " << planes << " of " << sz[2] << " planes were written to "
+             << res.toStdString() << endl;
+        layer.clear();
+        return false;
+    }
+    layer.clear();
+    return true;
+}
+
+/*
+ * Open a writer of a volume saved slab by slab
+ *
+ * Params:
+ *
+ * path: the output without its extension, a tiff file <path>.tif or a
+ * teraconvert folder <path>
+ *
+ * sz: x, y, z dimensions & channels of the volume
+ *
+ * saver: saves the teraconvert blocks
+ *
+ * outputFormat: tiff, a multi-page tiff appended plane by plane, BigTIFF when
+ * it's too large for classic tiff; or teraconvert, blocks of outputTile. tiff by default.
+ *
+ * outputTile: x,y,z dimensions of the teraconvert blocks, 256,256,256 by default.
+ *
+ * compression: of the tiff, none, lzw, deflate, packbits or zstd, see TiffSlabWriter.
+ * none by default.
+ *
+ * Returns a null pointer if the writer can't be opened.
+ *
+ */
+
+QSharedPointer<SlabWriter> openSlabWriter(const QString& path, const V3DLONG sz[4], int datatype,
+                                          const QVariantMap& params, const Saver& saver)
+{
+    auto format = params.value("outputFormat", "tiff").toString().toLower();
+    if (format == "tiff" || format == "tif" || format == "bigtiff")
+    {
+        auto writer = QSharedPointer<TiffSlabWriter>(new TiffSlabWriter);
+        if (!writer->open((path + ".tif").toStdString().c_str(), sz, datatype,
+                          params.value("compression", "none").toString()))
+            return QSharedPointer<SlabWriter>();
+        return writer;
+    }
+    if (format == "teraconvert")
+    {
+        auto dims = params.value("outputTile", "256,256,256").toString().split(',');
+        if (dims.size() != 3)
+        {
+            cerr << "ERROR: Illegal outputTile. It should be given as x,y,z." << endl;
+            return QSharedPointer<SlabWriter>();
+        }
+        V3DLONG tile[3] = {dims[0].toLongLong(), dims[1].toLongLong(), dims[2].toLongLong()};
+        auto writer = QSharedPointer<TeraSlabWriter>(new TeraSlabWriter);
+        if (!writer->open(path, sz, datatype, tile, saver))
+            return QSharedPointer<SlabWriter>();
+        return writer;
+    }
+    cerr << "ERROR: Unknown outputFormat " << format.toStdString() << ". It should be tiff or teraconvert." << endl;
+    return QSharedPointer<SlabWriter>();
+}
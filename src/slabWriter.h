@@ -0,0 +1,72 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef SLABWRITER_H
+#define SLABWRITER_H
+
+#include "qcBasic.h"
+#include "TeraQCTypes.h"
+#include "loadUtils.h"
+
+/*
+ * A volume saved slab by slab while it's being produced
+ *
+ * Slabs come in z order, each with some z planes of the x, y size, channels
+ * & pixel type of the volume, so the volume never has to be in memory as a
+ * whole. Once all the planes are written, finish flushes what's buffered &
+ * closes the output.
+ */
+class SlabWriter
+{
+public:
+    virtual ~SlabWriter() {}
+
+    virtual bool write(const QcImage& slab) = 0;
+
+    virtual bool finish() = 0;
+
+    // z planes written so far
+    V3DLONG written() const { return planes; }
+
+protected:
+    SlabWriter(): planes(0) {}
+
+    V3DLONG planes;
+};
+
+/*
+ * Teraconvert blocks of a volume, saved as soon as a layer of them is complete
+ *
+ * The volume is one resolution RES(YxXxZ) in the output folder, cut into
+ * blocks of the tile size. Only a layer of blocks, as deep as a block, is
+ * buffered, and each block is saved by the saver when the layer is full.
+ */
+class TeraSlabWriter : public SlabWriter
+{
+public:
+    TeraSlabWriter(): datatype(V3D_UNKNOWN) {}
+
+    bool open(const QString& path, const V3DLONG sz[4], int datatype, const V3DLONG tile[3], const Saver& saver);
+
+    bool write(const QcImage& slab);
+
+    bool finish();
+
+protected:
+    bool flush();
+
+    QString res;
+    V3DLONG sz[4], tile[3];
+    int datatype;
+    Saver saver;
+    // planes of the layer being filled, starting at layerZ0
+    QcImage layer;
+    V3DLONG layerZ0, layerPlanes;
+};
+
+QSharedPointer<SlabWriter> openSlabWriter(const QString& path, const V3DLONG sz[4], int datatype,
+                                          const QVariantMap& params, const Saver& saver);
+
+#endif // SLABWRITER_H
@@ -0,0 +1,357 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "synthetic.h"
+#include "imageView.h"
+#include "parallelUtils.h"
+#include "teraManifest.h"
+#include <iostream>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+using namespace std;
+
+// parse x,y,z dimensions, keeping the defaults for missing or illegal ones
+static void parseSize(const QString& text, V3DLONG sz[3])
+{
+    auto items = text.split(',');
+    for (int i = 0; i < 3 && i < items.size(); ++i)
+    {
+        auto v = items.at(i).trimmed().toLongLong();
+        if (v > 0) sz[i] = v;
+    }
+}
+
+/*
+ * Plan a synthetic brain
+ *
+ * Marker lines run along the shorter of x & y near the ends of the longer
+ * one, as the fiducial lines of fMOST slices do, so they pass the distance &
+ * angle filters of findMarkers. Somas are spread uniformly. Random numbers
+ * come from mt19937 without the std distributions, whose output differs
+ * between standard libraries, so a seed gives the same brain everywhere.
+ *
+ * Params:
+ *
+ * synthSize: x,y,z dimensions of the finest level, 1024,1024,128 by default;
+ *
+ * synthTile: x,y,z dimensions of the blocks, 256,256,64 by default;
+ *
+ * synthLevels: number of levels, 3 by default;
+ *
+ * datatype: pixel type, 16bit by default;
+ *
+ * markers & somas: numbers of marker lines & somas, 4 & 200 by default;
+ *
+ * background & noise: mean & amplitude of the background, 120 & 20 by default;
+ *
+ * markerWidth & markerIntensity: 3 & 4000 by default;
+ *
+ * somaRadius: mean radius of the somas, 4 by default, intensities are in [3000, 20000);
+ *
+ * seed: seed of the brain.
+ *
+ */
+
+bool makeSynthetic(const QVariantMap& params, QcSynthetic& output)
+{
+    try
+    {
+        output = QcSynthetic();
+        output.sz[0] = output.sz[1] = 1024;
+        output.sz[2] = 128;
+        output.tile[0] = output.tile[1] = 256;
+        output.tile[2] = 64;
+        parseSize(params.value("synthSize").toString(), output.sz);
+        parseSize(params.value("synthTile").toString(), output.tile);
+        output.datatype = params.value("datatype", V3D_UINT16).toInt();
+        if (output.datatype != V3D_UINT8 && output.datatype != V3D_UINT16 && output.datatype != V3D_FLOAT32)
+            throw invalid_argument("Unsupported pixel type.");
+        // no level smaller than a voxel
+        auto maxLevels = 1;
+        while (maxLevels < 16 && (qMin(output.sz[0], qMin(output.sz[1], output.sz[2])) >> maxLevels) > 0)
+            ++maxLevels;
+        output.levels = qBound(1, params.value("synthLevels", 3).toInt(), maxLevels);
+        output.background = params.value("background", 120).toDouble();
+        output.noise = params.value("noise", 20).toDouble();
+        output.seed = params.value("seed", 0).toUInt();
+
+        mt19937 rng(output.seed);
+        auto uniform = [&](double a, double b) { return a + (b - a) * (rng() / 4294967296.0); };
+        const auto pi = 3.14159265358979323846;
+        auto vertical = output.sz[0] > output.sz[1];
+        auto longer = double(output.sz[vertical ? 0 : 1]);
+        auto shorter = double(output.sz[vertical ? 1 : 0]);
+        auto markers = qMax(0, params.value("markers", 4).toInt());
+        auto markerWidth = params.value("markerWidth", 3.0).toDouble();
+        auto markerIntensity = params.value("markerIntensity", 4000.0).toDouble();
+        for (int i = 0; i < markers; ++i)
+        {
+            // alternating ends of the longer axis, within 2 degrees of the shorter one
+            auto offset = uniform(0.3, 0.45) * longer * (i % 2 == 0 ? -1 : 1);
+            QcSynthLine line;
+            line.x = vertical ? longer / 2 + offset : shorter / 2;
+            line.y = vertical ? shorter / 2 : longer / 2 + offset;
+            line.angle = (vertical ? pi / 2 : 0) + uniform(-2, 2) * pi / 180;
+            line.width = markerWidth;
+            line.intensity = markerIntensity;
+            output.markers.append(line);
+        }
+        auto somas = qMax(0, params.value("somas", 200).toInt());
+        auto somaRadius = params.value("somaRadius", 4.0).toDouble();
+        for (int i = 0; i < somas; ++i)
+        {
+            QcSynthBlob blob;
+            blob.x = uniform(0, output.sz[0]);
+            blob.y = uniform(0, output.sz[1]);
+            blob.z = uniform(0, output.sz[2]);
+            blob.radius = somaRadius * uniform(0.5, 1.5);
+            blob.intensity = uniform(3000, 20000);
+            output.somas.append(blob);
+        }
+        return true;
+    }
+    catch (exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        output = QcSynthetic();
+        return false;
+    }
+}
+
+// 64bit finalizer of murmur3, spreading the bits of a key
+static inline quint64 mixBits(quint64 h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+struct SynthKernel
+{
+    const QcSynthetic& synth;
+    int level;
+    const QcRoi& roi;
+    QcImage& output;
+
+    template <class T>
+    void operator()(QcTypeTag<T>)
+    {
+        QcView<T> out(output);
+        auto nx = roi.size(0), ny = roi.size(1);
+        // voxel i of the level is centered at (i + 0.5) * f - 0.5 of the finest level
+        double f[3];
+        for (int d = 0; d < 3; ++d)
+            f[d] = double(synth.sz[d]) / synth.levelSize(level, d);
+        auto finest = [&](V3DLONG i, int d) { return (i + 0.5) * f[d] - 0.5; };
+
+        // markers go through all the planes, at least a voxel wide at coarse levels
+        vector<float> base(nx * ny, float(synth.background));
+        for (int k = 0; k < synth.markers.size(); ++k)
+        {
+            const auto& m = synth.markers.at(k);
+            auto half = qMax(m.width, f[0]) / 2;
+            auto sx = -sin(m.angle), sy = cos(m.angle);
+            for (V3DLONG y = 0; y < ny; ++y)
+            {
+                auto dy = (finest(roi.start[1] + y, 1) - m.y) * sy;
+                for (V3DLONG x = 0; x < nx; ++x)
+                    if (abs((finest(roi.start[0] + x, 0) - m.x) * sx + dy) <= half)
+                        base[y * nx + x] = float(qMax(double(base[y * nx + x]), synth.background + m.intensity));
+            }
+        }
+
+        // somas reaching the roi, cut at 3 sigma
+        QVector<int> reach;
+        for (int k = 0; k < synth.somas.size(); ++k)
+        {
+            const auto& b = synth.somas.at(k);
+            const double c[3] = {b.x, b.y, b.z};
+            auto in = true;
+            for (int d = 0; d < 3 && in; ++d)
+                in = c[d] + 3 * b.radius >= finest(roi.start[d], d) - f[d] &&
+                        c[d] - 3 * b.radius <= finest(roi.end[d] - 1, d) + f[d];
+            if (in) reach.append(k);
+        }
+
+        auto scale = synth.datatype == V3D_UINT8 ? 1.0 / 16 : 1.0;
+        auto maxValue = synth.datatype == V3D_UINT8 ? 255.0 : synth.datatype == V3D_UINT16 ? 65535.0 : 1e30;
+        auto seed = mixBits((quint64(synth.seed) << 8) ^ quint64(level));
+        vector<float> plane(nx * ny);
+        for (V3DLONG z = 0; z < roi.size(2); ++z)
+        {
+            auto gz = roi.start[2] + z;
+            auto cz = finest(gz, 2);
+            copy(base.begin(), base.end(), plane.begin());
+            for (int k = 0; k < reach.size(); ++k)
+            {
+                const auto& b = synth.somas.at(reach.at(k));
+                auto dz = cz - b.z;
+                auto cut = 3 * b.radius;
+                if (abs(dz) > cut) continue;
+                auto s = -0.5 / (b.radius * b.radius);
+                for (V3DLONG y = 0; y < ny; ++y)
+                {
+                    auto dy = finest(roi.start[1] + y, 1) - b.y;
+                    if (abs(dy) > cut) continue;
+                    for (V3DLONG x = 0; x < nx; ++x)
+                    {
+                        auto dx = finest(roi.start[0] + x, 0) - b.x;
+                        if (abs(dx) > cut) continue;
+                        plane[y * nx + x] += float(b.intensity * exp((dx * dx + dy * dy + dz * dz) * s));
+                    }
+                }
+            }
+            // noise of a voxel depends only on its coordinates at the level
+            auto zKey = mixBits(seed + quint64(gz));
+            for (V3DLONG y = 0; y < ny; ++y)
+            {
+                auto yKey = mixBits(zKey + quint64(roi.start[1] + y));
+                auto row = out.row(y, z);
+                for (V3DLONG x = 0; x < nx; ++x)
+                {
+                    auto h = mixBits(yKey + quint64(roi.start[0] + x));
+                    // triangular in [-1, 1]
+                    auto n = ((h & 0xffffffffULL) + (h >> 32)) / 4294967295.0 - 1.0;
+                    auto v = qBound(0.0, (plane[y * nx + x] + synth.noise * n) * scale, maxValue);
+                    row[x] = T(synth.datatype == V3D_FLOAT32 ? v : floor(v + 0.5));
+                }
+            }
+        }
+    }
+};
+
+/*
+ * Render a box of a level of a synthetic brain
+ *
+ * roi: the box in voxels of the level.
+ *
+ */
+
+bool renderSynthetic(const QcSynthetic& synth, int level, const QcRoi& roi, QcImage& output)
+{
+    try
+    {
+        if (level < 0 || level >= synth.levels || roi.isEmpty())
+            throw invalid_argument("Illegal level or empty region to render.");
+        output.clear();
+        V3DLONG sz[4] = {roi.size(0), roi.size(1), roi.size(2), 1};
+        output.create(sz, synth.datatype);
+        SynthKernel kernel = {synth, level, roi, output};
+        if (!dispatchType(synth.datatype, kernel))
+            throw invalid_argument("Unsupported pixel type.");
+        return true;
+    }
+    catch (exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        output.clear();
+        return false;
+    }
+}
+
+/*
+ * Write a synthetic brain as a teraconvert brain directory
+ *
+ * Each level is a RES(YxXxZ) folder of y slicing folders, x slicing folders
+ * in them & blocks named by their y_x_z origins. Blocks are rendered on a
+ * number of threads & saved one at a time, since the saver of a callback
+ * isn't assumed reentrant.
+ *
+ * Report: tiles, bytes, ms
+ *
+ */
+
+bool writeSynthetic(const QString& path, const QcSynthetic& synth, const Saver& saver, int threads,
+                    QVariantMap* report)
+{
+    try
+    {
+        QElapsedTimer timer;
+        timer.start();
+        if (!QDir().mkpath(path))
+            throw runtime_error("Failed to create " + path.toStdString());
+        auto dir = QDir(path);
+        qint64 tiles = 0, bytes = 0;
+        for (int level = 0; level < synth.levels; ++level)
+        {
+            V3DLONG sz[3], grid[3];
+            for (int d = 0; d < 3; ++d)
+            {
+                sz[d] = synth.levelSize(level, d);
+                grid[d] = (sz[d] + synth.tile[d] - 1) / synth.tile[d];
+            }
+            auto res = dir.filePath(teraResolutionName(sz));
+            for (V3DLONG y = 0; y < grid[1]; ++y)
+                for (V3DLONG x = 0; x < grid[0]; ++x)
+                {
+                    V3DLONG origin[3] = {x * synth.tile[0], y * synth.tile[1], 0};
+                    if (!QDir().mkpath(QFileInfo(res + '/' + teraTilePath(sz, origin)).path()))
+                        throw runtime_error("Failed to create the folders of " + res.toStdString());
+                }
+
+            mutex saveMutex;
+            parallelFor(0, grid[0] * grid[1] * grid[2], threads, [&](V3DLONG i) {
+                V3DLONG g[3] = {i % grid[0], i / grid[0] % grid[1], i / (grid[0] * grid[1])};
+                QcRoi roi;
+                for (int d = 0; d < 3; ++d)
+                {
+                    roi.start[d] = g[d] * synth.tile[d];
+                    roi.end[d] = qMin(sz[d], roi.start[d] + synth.tile[d]);
+                }
+                QcImage block;
+                if (!renderSynthetic(synth, level, roi, block))
+                    throw runtime_error("Rendering a synthetic block failed.");
+                auto file = res + '/' + teraTilePath(sz, roi.start);
+                lock_guard<mutex> lk(saveMutex);
+                if (!saver(file.toStdString().c_str(), block))
+                    throw runtime_error("Failed to save " + file.toStdString());
+                ++tiles;
+                bytes += roi.size(0) * roi.size(1) * roi.size(2) * qcTypeSize(synth.datatype);
+            });
+        }
+        if (report != NULL)
+        {
+            (*report)["tiles"] = tiles;
+            (*report)["bytes"] = bytes;
+            (*report)["ms"] = timer.elapsed();
+        }
+        return true;
+    }
+    catch (exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        return false;
+    }
+}
+
+// save the markers & somas of a synthetic brain as csv, in voxels of the finest level
+bool writeSyntheticTruth(const QString& path, const QcSynthetic& synth)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+        cerr << "ERROR: Failed to write " << path.toStdString() << endl;
+        return false;
+    }
+    QTextStream out(&file);
+    out << "kind,x,y,z,size,angle,intensity\n";
+    for (int i = 0; i < synth.markers.size(); ++i)
+    {
+        const auto& m = synth.markers.at(i);
+        out << "marker," << m.x << ',' << m.y << ",," << m.width << ',' << m.angle << ',' << m.intensity << '\n';
+    }
+    for (int i = 0; i < synth.somas.size(); ++i)
+    {
+        const auto& b = synth.somas.at(i);
+        out << "soma," << b.x << ',' << b.y << ',' << b.z << ',' << b.radius << ",," << b.intensity << '\n';
+    }
+    return true;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include "qcBasic.h"
+#include "TeraQCTypes.h"
+#include "loadUtils.h"
+
+// a straight marker line through all the z planes, in voxels of the finest level
+struct QcSynthLine
+{
+    // a point on the line & its direction in the xy plane in radians
+    double x, y, angle;
+    double width, intensity;
+};
+
+// a bright soma-like gaussian blob, in voxels of the finest level
+struct QcSynthBlob
+{
+    double x, y, z;
+    double radius, intensity;
+};
+
+/*
+ * A synthetic teraconvert brain
+ *
+ * Voxels are a function of their coordinates only, so any block of any
+ * level renders the same however the volume is cut, and the same spec & seed
+ * always give the same brain. Intensities are in 16bit units, scaled by 1/16
+ * for 8bit brains.
+ */
+struct QcSynthetic
+{
+    QcSynthetic():
+        levels(1), datatype(V3D_UINT16), background(0), noise(0), seed(0)
+    {
+        for(int i = 0; i < 3; ++i) sz[i] = tile[i] = 0;
+    }
+    // x, y, z dimensions of the finest level
+    V3DLONG sz[3];
+    // x, y, z dimensions of the blocks, the same at all levels
+    V3DLONG tile[3];
+    // number of levels, each half the size of the one before
+    int levels;
+    int datatype;
+    double background, noise;
+    quint32 seed;
+    QVector<QcSynthLine> markers;
+    QVector<QcSynthBlob> somas;
+
+    // x, y, z dimensions of a level
+    V3DLONG levelSize(int level, int axis) const { return qMax(V3DLONG(1), sz[axis] >> level); }
+};
+
+bool makeSynthetic(const QVariantMap& params, QcSynthetic& output);
+
+bool renderSynthetic(const QcSynthetic& synth, int level, const QcRoi& roi, QcImage& output);
+
+bool writeSynthetic(const QString& path, const QcSynthetic& synth, const Saver& saver, int threads=1,
+                    QVariantMap* report=NULL);
+
+bool writeSyntheticTruth(const QString& path, const QcSynthetic& synth);
+
+#endif // SYNTHETIC_H
@@ -0,0 +1,394 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "teraManifest.h"
+#include "trace.h"
+#include <iostream>
+
+using namespace std;
+
+static const char* MANIFEST_HEADER = "TeraQC-manifest";
+static const int MANIFEST_VERSION = 1;
+
+static qint64 modificationTime(const QString& path)
+{
+    return QFileInfo(path).lastModified().toMSecsSinceEpoch();
+}
+
+/*
+ * Infer the image size from the teraconvert resolution folder name
+ *
+ * The folder is named as RES(YxXxZ). sz is given in x, y, z, c order.
+ *
+ */
+
+bool parseTeraResolution(const QString& path, V3DLONG sz[4])
+{
+    QRegExp rx("^RES\\((\\d+)x(\\d+)x(\\d+)\\)$");
+    if (!rx.exactMatch(QDir(path).dirName()))
+        return false;
+    sz[0] = rx.cap(2).toLongLong();
+    sz[1] = rx.cap(1).toLongLong();
+    sz[2] = rx.cap(3).toLongLong();
+    sz[3] = 1;
+    return true;
+}
+
+// name of the folder of a resolution of x, y, z dimensions sz
+QString teraResolutionName(const V3DLONG sz[3])
+{
+    return QString("RES(%1x%2x%3)").arg(sz[1]).arg(sz[0]).arg(sz[2]);
+}
+
+/*
+ * Path of a block relative to the folder of its resolution
+ *
+ * Y/Y_X/Y_X_Z.tif, named by the origin of the block in the 0.1 unit of
+ * teraconvert, padded to the same width in a resolution so the blocks sort
+ * by name as they are scanned.
+ *
+ */
+
+QString teraTilePath(const V3DLONG sz[3], const V3DLONG origin[3])
+{
+    auto width = qMax(6, QString::number(qMax(sz[0], qMax(sz[1], sz[2])) * 10).size());
+    auto name = [&](V3DLONG o) { return QString("%1").arg(o * 10, width, 10, QChar('0')); };
+    auto y = name(origin[1]), x = y + '_' + name(origin[0]);
+    return y + '/' + x + '/' + x + '_' + name(origin[2]) + ".tif";
+}
+
+/*
+ * List all the blocks of a teraconvert resolution
+ *
+ * Teraconverted images are sorted by y, x, z slicing.
+ * The root folder contains all y slicings folder;
+ * each y folder slicing contains its x slicing folders;
+ * each x slicing folder contains the tif image blocks sorted by their z slicings.
+ *
+ * Only the file paths and slicing indices are known after the scan, the
+ * geometry of blocks is left as -1 for probing or loading to fill in.
+ *
+ */
+
+bool scanTeraconvert(const QString& path, TeraManifest& manifest)
+{
+    QcTraceScope traceScope("scan teraconvert");
+    try
+    {
+        auto dir = QDir(path);
+        if (!dir.exists() || !parseTeraResolution(path, manifest.sz))
+            throw invalid_argument("The path of the folder to load the "
+                                   "teraconvert data doesn't exist or is invalid.");
+        manifest.root = dir.absolutePath();
+        manifest.datatype = V3D_UNKNOWN;
+        manifest.tiles.clear();
+        manifest.dirs.clear();
+        manifest.dirs.append(qMakePair(QString("."), modificationTime(manifest.root)));
+
+        auto ySlicings = dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
+
+        for (int i = 0; i < ySlicings.size(); ++i, dir.cdUp())
+        {
+            // cd to subfolder for y
+            if (!dir.cd(ySlicings.at(i)))
+                throw runtime_error("Directory " + dir.filePath(ySlicings.at(i)).toStdString() +
+                      " doesn't exist.\nMaybe the directory is modified during reading.");
+            manifest.dirs.append(qMakePair(ySlicings.at(i), modificationTime(dir.absolutePath())));
+
+            auto xSlicings = dir.entryList(QDir::Dirs| QDir::NoDotAndDotDot, QDir::Name);
+
+            for (int j = 0; j < xSlicings.size(); ++j, dir.cdUp())
+            {
+                // cd to subfolder for x
+                if (!dir.cd(xSlicings.at(j)))
+                    throw runtime_error("Directory " + dir.filePath(xSlicings.at(j)).toStdString() +
+                            " doesn't exist.\nMaybe the directory is modified during reading.");
+                auto xPath = ySlicings.at(i) + '/' + xSlicings.at(j);
+                manifest.dirs.append(qMakePair(xPath, modificationTime(dir.absolutePath())));
+
+                auto blocks = dir.entryList(QDir::Files, QDir::Name);
+
+                for (int k = 0; k < blocks.size(); ++k)
+                {
+                    TeraTile tile;
+                    tile.path = xPath + '/' + blocks.at(k);
+                    tile.grid[0] = j;
+                    tile.grid[1] = i;
+                    tile.grid[2] = k;
+                    for (int d = 0; d < 3; ++d)
+                        tile.origin[d] = tile.sz[d] = -1;
+                    tile.datatype = V3D_UNKNOWN;
+                    manifest.tiles.append(tile);
+                }
+            }
+        }
+        return true;
+    }
+    catch (exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        manifest = TeraManifest();
+        return false;
+    }
+}
+
+/*
+ * Infer the geometry of all blocks by decoding a few of them
+ *
+ * Teraconvert slices a resolution on a regular grid, i.e. blocks in the
+ * same x slicing share their width, and so on. So it's enough to decode the
+ * blocks along the 3 axes starting from the first block; the origins are
+ * the accumulated sizes of the slicings before.
+ *
+ */
+
+bool probeTeraconvert(TeraManifest& manifest, const Loader& loader, int datatype)
+{
+    QcTraceScope traceScope("probe teraconvert");
+    QcImage block;
+    try
+    {
+        QVector<V3DLONG> len[3];
+        for (int i = 0; i < manifest.tiles.size(); ++i)
+            for (int d = 0; d < 3; ++d)
+                if (len[d].size() <= manifest.tiles[i].grid[d])
+                    len[d].resize(manifest.tiles[i].grid[d] + 1);
+
+        for (int i = 0; i < manifest.tiles.size(); ++i)
+        {
+            const auto& g = manifest.tiles[i].grid;
+            bool probe = false;
+            for (int d = 0; d < 3; ++d)
+                probe = probe || (g[(d + 1) % 3] == 0 && g[(d + 2) % 3] == 0);
+            if (!probe) continue;
+
+            auto imagePath = manifest.tilePath(i);
+            if (!loader(imagePath.toStdString().c_str(), block))
+                throw runtime_error("Failed to load image at " + imagePath.toStdString());
+            if (block.datatype != datatype)
+                throw runtime_error("Found inconsistent image pixel type in teraconvert data.");
+            for (int d = 0; d < 3; ++d)
+                if (g[(d + 1) % 3] == 0 && g[(d + 2) % 3] == 0)
+                    len[d][g[d]] = block.sz[d];
+            block.clear();
+        }
+
+        // accumulate the slicing sizes to origins
+        QVector<V3DLONG> start[3];
+        for (int d = 0; d < 3; ++d)
+        {
+            start[d].resize(len[d].size());
+            V3DLONG s = 0;
+            for (int i = 0; i < len[d].size(); ++i)
+            {
+                if (len[d][i] <= 0)
+                    throw runtime_error("Teraconvert blocks are not on a regular grid.");
+                start[d][i] = s;
+                s += len[d][i];
+            }
+            if (s > manifest.sz[d])
+                throw runtime_error("Image block exceeds the size inferred from the teraconvert folder name.");
+        }
+
+        for (int i = 0; i < manifest.tiles.size(); ++i)
+        {
+            auto& tile = manifest.tiles[i];
+            for (int d = 0; d < 3; ++d)
+            {
+                tile.origin[d] = start[d][tile.grid[d]];
+                tile.sz[d] = len[d][tile.grid[d]];
+            }
+            tile.datatype = datatype;
+        }
+        manifest.datatype = datatype;
+        return true;
+    }
+    catch (exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        block.clear();
+        return false;
+    }
+}
+
+/*
+ * Check a manifest against the folders it was built from
+ *
+ * A manifest is valid when all block geometries are known and none of the
+ * listed folders was modified after listing. Only the folder modification
+ * times are checked, which is much cheaper than listing them again.
+ *
+ */
+
+bool isTeraManifestValid(const TeraManifest& manifest)
+{
+    if (manifest.datatype == V3D_UNKNOWN || manifest.dirs.isEmpty())
+        return false;
+    for (int i = 0; i < manifest.tiles.size(); ++i)
+        for (int d = 0; d < 3; ++d)
+            if (manifest.tiles[i].origin[d] < 0 || manifest.tiles[i].sz[d] < 0)
+                return false;
+    auto root = QDir(manifest.root);
+    for (int i = 0; i < manifest.dirs.size(); ++i)
+    {
+        auto info = QFileInfo(root.filePath(manifest.dirs[i].first));
+        if (!info.isDir() || info.lastModified().toMSecsSinceEpoch() != manifest.dirs[i].second)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Path of a file cached for a resolution
+ *
+ * By default the file is stored beside the resolution folder (not in it,
+ * which would change the folder's modification time). When a cache
+ * directory is given, it's named by the hash of the resolution path.
+ *
+ */
+
+QString teraCacheFile(const QString& path, const QString& cacheDir, const QString& suffix)
+{
+    auto root = QDir(path).absolutePath();
+    if (cacheDir.isEmpty())
+        return root + suffix;
+    auto hash = QCryptographicHash::hash(root.toUtf8(), QCryptographicHash::Md5).toHex();
+    return QDir(cacheDir).filePath(QString(hash) + suffix);
+}
+
+QString teraManifestFile(const QString& path, const QString& cacheDir)
+{
+    return teraCacheFile(path, cacheDir, ".manifest");
+}
+
+/*
+ * Manifest file format
+ *
+ * A text file with one record per line:
+ *
+ * TeraQC-manifest <version>
+ * root <absolute path of the resolution>
+ * size <x> <y> <z> <c>
+ * datatype <pixel type>
+ * dir <modification time in ms> <folder relative to root>
+ * tile <origin x y z> <size x y z> <pixel type> <grid x y z> <file relative to root>
+ *
+ * Paths are the last field so they can contain spaces.
+ *
+ */
+
+bool readTeraManifest(const QString& file, TeraManifest& manifest)
+{
+    QFile f(file);
+    if (!f.open(QIODevice::ReadOnly | QIODevice::Text))
+        return false;
+    QTextStream in(&f);
+    in.setCodec("UTF-8");
+    manifest = TeraManifest();
+    auto header = in.readLine().split(' ');
+    if (header.size() != 2 || header[0] != MANIFEST_HEADER || header[1].toInt() != MANIFEST_VERSION)
+        return false;
+    while (!in.atEnd())
+    {
+        auto line = in.readLine();
+        auto key = line.section(' ', 0, 0);
+        if (key == "root")
+            manifest.root = line.section(' ', 1);
+        else if (key == "size")
+            for (int i = 0; i < 4; ++i)
+                manifest.sz[i] = line.section(' ', i + 1, i + 1).toLongLong();
+        else if (key == "datatype")
+            manifest.datatype = line.section(' ', 1, 1).toInt();
+        else if (key == "dir")
+            manifest.dirs.append(qMakePair(line.section(' ', 2),
+                                           line.section(' ', 1, 1).toLongLong()));
+        else if (key == "tile")
+        {
+            TeraTile tile;
+            for (int d = 0; d < 3; ++d)
+            {
+                tile.origin[d] = line.section(' ', d + 1, d + 1).toLongLong();
+                tile.sz[d] = line.section(' ', d + 4, d + 4).toLongLong();
+                tile.grid[d] = line.section(' ', d + 8, d + 8).toInt();
+            }
+            tile.datatype = line.section(' ', 7, 7).toInt();
+            tile.path = line.section(' ', 11);
+            manifest.tiles.append(tile);
+        }
+        else if (!key.isEmpty())
+            return false;
+    }
+    return true;
+}
+
+bool writeTeraManifest(const QString& file, const TeraManifest& manifest)
+{
+    // write to a temporary file first so a reader never sees a partial manifest
+    QFile f(file + ".tmp");
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+        return false;
+    {
+        QTextStream out(&f);
+        out.setCodec("UTF-8");
+        out << MANIFEST_HEADER << ' ' << MANIFEST_VERSION << '\n';
+        out << "root " << manifest.root << '\n';
+        out << "size " << manifest.sz[0] << ' ' << manifest.sz[1] << ' '
+            << manifest.sz[2] << ' ' << manifest.sz[3] << '\n';
+        out << "datatype " << manifest.datatype << '\n';
+        for (int i = 0; i < manifest.dirs.size(); ++i)
+            out << "dir " << manifest.dirs[i].second << ' ' << manifest.dirs[i].first << '\n';
+        for (int i = 0; i < manifest.tiles.size(); ++i)
+        {
+            const auto& t = manifest.tiles[i];
+            out << "tile " << t.origin[0] << ' ' << t.origin[1] << ' ' << t.origin[2] << ' '
+                << t.sz[0] << ' ' << t.sz[1] << ' ' << t.sz[2] << ' ' << t.datatype << ' '
+                << t.grid[0] << ' ' << t.grid[1] << ' ' << t.grid[2] << ' ' << t.path << '\n';
+        }
+    }
+    f.close();
+    if (f.error() != QFile::NoError)
+        return false;
+    QFile::remove(file);
+    return f.rename(file);
+}
+
+/*
+ * Get the manifest of a teraconvert resolution
+ *
+ * The cached manifest is used if it's still valid, otherwise the resolution
+ * is scanned & probed again and the manifest is cached for the next time.
+ * Failing to cache the manifest (e.g. a read-only data folder) is not an error.
+ *
+ * Params:
+ *
+ * path: path to the directory storing brain blocks of a resolution
+ *
+ * manifest: the manifest to fill
+ *
+ * loader: callback used to load images for probing
+ *
+ * datatype: expected pixel type of all blocks
+ *
+ * cacheDir: where to store the manifest, empty for beside the resolution folder
+ *
+ * cached: whether to use & cache the manifest, or else always scan & probe
+ *
+ */
+
+bool getTeraManifest(const QString& path, TeraManifest& manifest, const Loader& loader,
+                     int datatype, const QString& cacheDir, bool cached)
+{
+    auto file = teraManifestFile(path, cacheDir);
+    if (cached && readTeraManifest(file, manifest) &&
+            manifest.root == QDir(path).absolutePath() &&
+            manifest.datatype == datatype &&
+            isTeraManifestValid(manifest))
+        return true;
+    if (!scanTeraconvert(path, manifest) || !probeTeraconvert(manifest, loader, datatype))
+        return false;
+    if (cached && !writeTeraManifest(file, manifest))
+        cerr << "WARNING: Failed to cache the teraconvert manifest at " << file.toStdString() << endl;
+    return true;
+}
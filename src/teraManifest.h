@@ -0,0 +1,73 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef TERAMANIFEST_H
+#define TERAMANIFEST_H
+
+#include "qcBasic.h"
+#include "TeraQCTypes.h"
+#include "loadUtils.h"
+
+// a teraconvert image block, geometry in voxels of its resolution
+struct TeraTile
+{
+    // path relative to the resolution folder
+    QString path;
+    // index of its x, y, z slicing
+    int grid[3];
+    // x, y, z of the first voxel, -1 if unknown
+    V3DLONG origin[3];
+    // x, y, z dimensions, -1 if unknown
+    V3DLONG sz[3];
+    // pixel type
+    int datatype;
+};
+
+// index of all the blocks of a teraconvert resolution
+struct TeraManifest
+{
+    TeraManifest():
+        datatype(V3D_UNKNOWN)
+    {
+        for(int i = 0; i < 4; ++i) sz[i] = 0;
+    }
+    // absolute path of the resolution folder
+    QString root;
+    // dimensions inferred from the folder name
+    V3DLONG sz[4];
+    // pixel type
+    int datatype;
+    // blocks in the y, x, z reading order
+    QVector<TeraTile> tiles;
+    // listed folders relative to root & their modification time
+    QVector<QPair<QString, qint64> > dirs;
+
+    QString tilePath(int i) const { return QDir(root).filePath(tiles.at(i).path); }
+};
+
+bool parseTeraResolution(const QString& path, V3DLONG sz[4]);
+
+QString teraResolutionName(const V3DLONG sz[3]);
+
+QString teraTilePath(const V3DLONG sz[3], const V3DLONG origin[3]);
+
+bool scanTeraconvert(const QString& path, TeraManifest& manifest);
+
+bool probeTeraconvert(TeraManifest& manifest, const Loader& loader, int datatype);
+
+bool isTeraManifestValid(const TeraManifest& manifest);
+
+QString teraCacheFile(const QString& path, const QString& cacheDir, const QString& suffix);
+
+QString teraManifestFile(const QString& path, const QString& cacheDir=QString());
+
+bool readTeraManifest(const QString& file, TeraManifest& manifest);
+
+bool writeTeraManifest(const QString& file, const TeraManifest& manifest);
+
+bool getTeraManifest(const QString& path, TeraManifest& manifest, const Loader& loader,
+                     int datatype, const QString& cacheDir=QString(), bool cached=true);
+
+#endif // TERAMANIFEST_H
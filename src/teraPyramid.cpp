@@ -0,0 +1,169 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "teraPyramid.h"
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+TeraPyramid::TeraPyramid():
+    datatype(V3D_UNKNOWN), cache(NULL)
+{
+}
+
+// whether a directory holds teraconvert resolutions
+bool TeraPyramid::isPyramid(const QString& path)
+{
+    V3DLONG sz[4];
+    auto subdirs = QDir(path).entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
+    for (int i = 0; i < subdirs.size(); ++i)
+        if (parseTeraResolution(subdirs.at(i), sz))
+            return true;
+    return false;
+}
+
+/*
+ * Open a teraconvert brain directory
+ *
+ * All RES(YxXxZ) subfolders are taken as levels, other folders & files are
+ * ignored. Nothing is read from the levels until it's needed.
+ *
+ * Params:
+ *
+ * path: the brain directory holding RES(YxXxZ) folders
+ *
+ * loader: callback used to load images, must be reentrant if loadThreads > 1
+ *
+ * datatype: expected pixel type of all blocks
+ *
+ * params: loading params (loadThreads, prefetch, manifest, manifestDir), see loadTeraconvert
+ *
+ */
+
+bool TeraPyramid::open(const QString& path, const Loader& loader, int datatype, const QVariantMap& params)
+{
+    {
+        lock_guard<mutex> lk(manifestMutex);
+        manifests.clear();
+    }
+    levelList.clear();
+    root = QDir(path).absolutePath();
+    this->loader = loader;
+    this->planeLoader = ::planeLoader(loader);
+    this->datatype = datatype;
+    this->params = params;
+
+    auto dir = QDir(root);
+    auto subdirs = dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot, QDir::Name);
+    for (int i = 0; i < subdirs.size(); ++i)
+    {
+        TeraLevel level;
+        if (!parseTeraResolution(subdirs.at(i), level.sz))
+            continue;
+        level.path = dir.filePath(subdirs.at(i));
+        levelList.append(level);
+    }
+    if (levelList.isEmpty())
+    {
+        cerr << "ERROR: No teraconvert resolution found in " << path.toStdString() << endl;
+        return false;
+    }
+
+    // finest first
+    sort(levelList.begin(), levelList.end(), [](const TeraLevel& a, const TeraLevel& b) {
+        return a.sz[0] * a.sz[1] * a.sz[2] > b.sz[0] * b.sz[1] * b.sz[2];
+    });
+    return true;
+}
+
+// ratio of the dimensions of 2 levels along an axis
+double TeraPyramid::scale(int from, int to, int axis) const
+{
+    return double(levelList.at(to).sz[axis]) / levelList.at(from).sz[axis];
+}
+
+// map continuous coordinates between levels
+void TeraPyramid::mapPoint(const double in[3], int from, double out[3], int to) const
+{
+    for (int d = 0; d < 3; ++d)
+        out[d] = in[d] * scale(from, to, d);
+}
+
+/*
+ * Map a region between levels
+ *
+ * The mapped region covers all the voxels overlapping the region, clipped by
+ * the dimensions of the target level.
+ *
+ */
+
+QcRoi TeraPyramid::mapRoi(const QcRoi& roi, int from, int to) const
+{
+    QcRoi out;
+    for (int d = 0; d < 3; ++d)
+    {
+        auto s = scale(from, to, d);
+        out.start[d] = qBound(V3DLONG(0), V3DLONG(floor(roi.start[d] * s)), levelList.at(to).sz[d]);
+        out.end[d] = qBound(out.start[d], V3DLONG(ceil(roi.end[d] * s)), levelList.at(to).sz[d]);
+    }
+    return out;
+}
+
+/*
+ * Find the coarsest level giving enough voxels across a region
+ *
+ * The region is given in the coordinates of a level. The returned level is
+ * the coarsest where every axis of the mapped region has at least minVoxels
+ * voxels, or the finest level if none does.
+ *
+ */
+
+int TeraPyramid::coarsestLevelFor(const QcRoi& roi, int level, V3DLONG minVoxels) const
+{
+    for (int i = coarsest(); i > 0; --i)
+    {
+        auto mapped = mapRoi(roi, level, i);
+        if (mapped.size(0) >= minVoxels && mapped.size(1) >= minVoxels && mapped.size(2) >= minVoxels)
+            return i;
+    }
+    return 0;
+}
+
+// get the manifest of a level, probed & cached at the first time
+bool TeraPyramid::manifest(int level, TeraManifest& output)
+{
+    lock_guard<mutex> lk(manifestMutex);
+    auto it = manifests.find(level);
+    if (it == manifests.end())
+    {
+        TeraManifest m;
+        if (!getTeraManifest(levelList.at(level).path, m, loader, datatype, params.value("manifestDir").toString(),
+                             params.value("manifest", "y").toString().toLower().startsWith("y")))
+            return false;
+        it = manifests.insert(level, m);
+    }
+    output = it.value();
+    return true;
+}
+
+// load a whole level
+bool TeraPyramid::loadLevel(int level, QcImage& output)
+{
+    return loadTeraconvert(levelList.at(level).path, output, loader, datatype, params);
+}
+
+// load a region in the coordinates of a level
+bool TeraPyramid::loadRoi(int level, const QcRoi& roi, QcImage& output)
+{
+    TeraManifest m;
+    if (!manifest(level, m))
+    {
+        output.clear();
+        return false;
+    }
+    return loadTeraconvertRoi(m, roi, output, planeLoader, params.value("loadThreads", 1).toInt(), cache);
+}
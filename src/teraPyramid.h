@@ -0,0 +1,81 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef TERAPYRAMID_H
+#define TERAPYRAMID_H
+
+#include "qcBasic.h"
+#include <mutex>
+#include "TeraQCTypes.h"
+#include "loadUtils.h"
+#include "teraManifest.h"
+#include "tileCache.h"
+
+// a resolution level of a teraconvert brain
+struct TeraLevel
+{
+    // path of the RES(YxXxZ) folder
+    QString path;
+    // dimensions in x, y, z, c
+    V3DLONG sz[4];
+};
+
+/*
+ * Access layer over all the resolutions of a teraconvert brain directory
+ *
+ * Levels are sorted from the finest (0, usually the raw resolution) to the
+ * coarsest. Coordinates are mapped between levels by the ratio of their
+ * dimensions, with voxel i of a level covering [i, i + 1) in continuous
+ * coordinates. Manifests of the levels are got lazily and shared, so it's
+ * safe to load regions from several threads.
+ */
+class TeraPyramid
+{
+public:
+    TeraPyramid();
+
+    bool open(const QString& path, const Loader& loader, int datatype,
+              const QVariantMap& params=QVariantMap());
+
+    static bool isPyramid(const QString& path);
+
+    // set a loader with random access to pages, by default the whole image loader is adapted
+    void setPlaneLoader(const PlaneLoader& loader) { planeLoader = loader; }
+
+    // share decoded blocks through a cache when loading regions, NULL for no caching
+    void setCache(TileCache* cache) { this->cache = cache; }
+
+    int levels() const { return levelList.size(); }
+    int coarsest() const { return levelList.size() - 1; }
+    const TeraLevel& level(int i) const { return levelList.at(i); }
+    QString brainPath() const { return root; }
+
+    double scale(int from, int to, int axis) const;
+
+    void mapPoint(const double in[3], int from, double out[3], int to) const;
+
+    QcRoi mapRoi(const QcRoi& roi, int from, int to) const;
+
+    int coarsestLevelFor(const QcRoi& roi, int level, V3DLONG minVoxels) const;
+
+    bool manifest(int level, TeraManifest& output);
+
+    bool loadLevel(int level, QcImage& output);
+
+    bool loadRoi(int level, const QcRoi& roi, QcImage& output);
+
+protected:
+    QString root;
+    QVector<TeraLevel> levelList;
+    Loader loader;
+    PlaneLoader planeLoader;
+    int datatype;
+    QVariantMap params;
+    TileCache* cache;
+    QMap<int, TeraManifest> manifests;
+    std::mutex manifestMutex;
+};
+
+#endif // TERAPYRAMID_H
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "commands.h"
+#include "tiffIO.h"
+#include <iostream>
+#include <cstring>
+
+using namespace std;
+
+/*
+ * Command line tool of TeraQC, running the commands of the plugin without Vaa3D
+ *
+ * Usage: teraqc <command> [-i input] [-o output prefix] [-p key value ...]
+ *
+ * Images are read & written as (Big)TIFF, and pages of the teraconvert blocks
+ * are read directly, without decoding the whole block.
+ *
+ */
+
+static void usage()
+{
+    cout << "Usage: teraqc <command> [-i input] [-o output prefix] [-p key value ...]\n\n"
+         << commandHelp().toStdString();
+}
+
+// options of the command line, values of params may still start with -
+static bool isOption(const char* arg)
+{
+    return strcmp(arg, "-i") == 0 || strcmp(arg, "-o") == 0 || strcmp(arg, "-p") == 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0)
+    {
+        usage();
+        return argc < 2 ? 1 : 0;
+    }
+    QString command = argv[1], input, output;
+    QVariantMap params;
+    for (int i = 2; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+            input = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (strcmp(argv[i], "-p") == 0)
+        {
+            // key value pairs up to the next option
+            for (++i; i + 1 < argc && !isOption(argv[i]); i += 2)
+                params[argv[i]] = argv[i + 1];
+            --i;
+        }
+        else
+        {
+            cerr << "ERROR: Unexpected argument " << argv[i] << endl;
+            usage();
+            return 1;
+        }
+    }
+    if (!commandList().contains(command))
+    {
+        cerr << "ERROR: Unknown command " << argv[1] << endl;
+        usage();
+        return 1;
+    }
+
+    QcIO io;
+    io.loader = loadTiff;
+    io.planeLoader = loadTiffPlanes;
+    io.saver = saveTiff;
+    QcSession session;
+    return runCommand(command, input, output, params, io, session) ? 0 : 1;
+}
@@ -0,0 +1,304 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "tiffIO.h"
+#include "trace.h"
+#include <tiffio.h>
+#include <iostream>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+using namespace std;
+
+// closes a tiff when leaving the scope
+struct TiffFile
+{
+    explicit TiffFile(TIFF* tif): tif(tif) {}
+    ~TiffFile() { if (tif) TIFFClose(tif); }
+    TIFF* tif;
+};
+
+// pixel type of a tiff sample format, V3D_UNKNOWN if not supported
+static int tiffDatatype(uint16_t bits, uint16_t format)
+{
+    if (format == SAMPLEFORMAT_IEEEFP)
+        return bits == 32 ? V3D_FLOAT32 : V3D_UNKNOWN;
+    if (format != SAMPLEFORMAT_UINT)
+        return V3D_UNKNOWN;
+    switch (bits)
+    {
+    case 8:
+        return V3D_UINT8;
+    case 16:
+        return V3D_UINT16;
+    default:
+        return V3D_UNKNOWN;
+    }
+}
+
+// load a whole multi-page tiff, see loadTiffPlanes
+bool loadTiff(const char* path, QcImage& output)
+{
+    return loadTiffPlanes(path, 0, -1, output);
+}
+
+/*
+ * Load the pages [z0, z1) of a multi-page tiff as z planes
+ *
+ * All the pages up to z1 are taken from z0 (z1 < 0 for all the pages).
+ * Pages must be of the same size & sample format, stored in strips, with
+ * 8, 16bit unsigned or 32bit float samples. Samples of a pixel are split
+ * into channels. Only the directories are walked through before z0, so the
+ * planes of a block are loaded without decoding the pages before them.
+ *
+ */
+
+bool loadTiffPlanes(const char* path, V3DLONG z0, V3DLONG z1, QcImage& output)
+{
+    QcTraceScope traceScope("decode tiff");
+    try
+    {
+        TiffFile file(TIFFOpen(path, "r"));
+        auto tif = file.tif;
+        if (tif == NULL)
+            throw runtime_error(string("Failed to open ") + path);
+        V3DLONG pages = TIFFNumberOfDirectories(tif);
+        if (z1 < 0)
+            z1 = pages;
+        if (z0 < 0 || z1 > pages || z1 <= z0)
+            throw invalid_argument(string("The planes to load are out of ") + path);
+        if (!TIFFSetDirectory(tif, z0))
+            throw runtime_error(string("Failed to read ") + path);
+
+        uint32_t width = 0, height = 0;
+        uint16_t bits = 8, spp = 1, format = SAMPLEFORMAT_UINT, planar = PLANARCONFIG_CONTIG;
+        TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+        TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &format);
+        TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar);
+        auto datatype = tiffDatatype(bits, format);
+        if (datatype == V3D_UNKNOWN)
+            throw invalid_argument(string("Unsupported sample format of ") + path);
+        if (TIFFIsTiled(tif) || (spp > 1 && planar != PLANARCONFIG_CONTIG))
+            throw invalid_argument(string("Only tiffs of contiguous strips are supported, not ") + path);
+
+        V3DLONG sz[4] = {width, height, z1 - z0, spp};
+        output.clear();
+        output.create(sz, datatype);
+        auto bytes = qcTypeSize(datatype);
+        auto rowBytes = sz[0] * bytes;
+        auto planeBytes = rowBytes * sz[1];
+        auto channelBytes = planeBytes * sz[2];
+        traceScope.addRead(channelBytes * sz[3]);
+        vector<uchar> line(TIFFScanlineSize(tif));
+        for (auto z = z0; z < z1; ++z)
+        {
+            if (z > z0 && !TIFFReadDirectory(tif))
+                throw runtime_error(string("Failed to read ") + path);
+            uint32_t w = 0, h = 0;
+            TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &w);
+            TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &h);
+            if (w != width || h != height || TIFFScanlineSize(tif) != tmsize_t(line.size()))
+                throw invalid_argument(string("Pages of different sizes in ") + path);
+            auto plane = output.buffer + (z - z0) * planeBytes;
+            for (uint32_t y = 0; y < height; ++y)
+            {
+                if (TIFFReadScanline(tif, line.data(), y, 0) < 0)
+                    throw runtime_error(string("Failed to read ") + path);
+                if (spp == 1)
+                {
+                    memcpy(plane + y * rowBytes, line.data(), rowBytes);
+                    continue;
+                }
+                for (uint16_t c = 0; c < spp; ++c)
+                    for (uint32_t x = 0; x < width; ++x)
+                        memcpy(plane + c * channelBytes + y * rowBytes + x * bytes,
+                               line.data() + (x * spp + c) * bytes, bytes);
+            }
+        }
+        return true;
+    }
+    catch(exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        output.clear();
+        return false;
+    }
+}
+
+/*
+ * Save an image as a multi-page tiff, a page per z plane
+ *
+ * Channels are saved as samples of a pixel. Images too large for the 32bit
+ * offsets of classic tiffs are saved as BigTIFF.
+ *
+ */
+
+bool saveTiff(const char* path, const QcImage& image)
+{
+    TiffSlabWriter writer;
+    return writer.open(path, image.sz, image.datatype) && writer.write(image) && writer.finish();
+}
+
+// libtiff compression scheme of a name, -1 if unknown or not built into libtiff
+static int tiffCompression(const QString& name)
+{
+    int scheme = -1;
+    if (name.isEmpty() || name == "none")
+        scheme = COMPRESSION_NONE;
+    else if (name == "lzw")
+        scheme = COMPRESSION_LZW;
+    else if (name == "deflate" || name == "zip")
+        scheme = COMPRESSION_ADOBE_DEFLATE;
+    else if (name == "packbits")
+        scheme = COMPRESSION_PACKBITS;
+#ifdef COMPRESSION_ZSTD
+    else if (name == "zstd")
+        scheme = COMPRESSION_ZSTD;
+#endif
+    return scheme >= 0 && TIFFIsCODECConfigured(uint16_t(scheme)) ? scheme : -1;
+}
+
+TiffSlabWriter::~TiffSlabWriter()
+{
+    if (tif != NULL)
+        TIFFClose((TIFF*)tif);
+}
+
+/*
+ * Create the tiff of a volume
+ *
+ * Params:
+ *
+ * sz: x, y, z dimensions & channels of the volume, channels are saved as
+ * samples of a pixel
+ *
+ * compression: none, lzw, deflate, packbits or zstd (if libtiff has it).
+ * lzw, deflate & zstd encode the differences of neighbouring pixels, which
+ * makes smooth 16bit images much smaller, & deflate runs at its fastest
+ * level, so compression keeps up with the stages producing the planes. none
+ * by default.
+ *
+ */
+
+bool TiffSlabWriter::open(const char* path, const V3DLONG sz[4], int datatype, const QString& compression)
+{
+    try
+    {
+        if (tif != NULL)
+            throw runtime_error("The tiff writer is already open.");
+        if (datatype != V3D_UINT8 && datatype != V3D_UINT16 && datatype != V3D_FLOAT32)
+            throw invalid_argument("Unsupported pixel type to save.");
+        for (int i = 0; i < 4; ++i)
+            if (sz[i] <= 0)
+                throw invalid_argument("Empty image to save.");
+        this->compression = tiffCompression(compression.toLower());
+        if (this->compression < 0)
+            throw invalid_argument("Compression " + compression.toStdString() + " isn't supported by libtiff.");
+        for (int i = 0; i < 4; ++i) this->sz[i] = sz[i];
+        this->datatype = datatype;
+        this->path = path;
+        planes = 0;
+        // leave room for the directories
+        auto big = sz[0] * sz[1] * sz[2] * sz[3] * qcTypeSize(datatype) + sz[2] * 4096 >= (qint64(1) << 32);
+        tif = TIFFOpen(path, big ? "w8" : "w");
+        if (tif == NULL)
+            throw runtime_error(string("Failed to create ") + path);
+        return true;
+    }
+    catch(exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        return false;
+    }
+}
+
+// encode the planes of a slab as the next pages
+bool TiffSlabWriter::write(const QcImage& slab)
+{
+    QcTraceScope traceScope("encode tiff");
+    try
+    {
+        auto tif = (TIFF*)this->tif;
+        if (tif == NULL)
+            throw runtime_error("The tiff writer isn't open.");
+        if (slab.buffer == NULL || slab.sz[0] != sz[0] || slab.sz[1] != sz[1] || slab.sz[3] != sz[3] ||
+                slab.datatype != datatype || planes + slab.sz[2] > sz[2])
+            throw invalid_argument(string("The slab doesn't fit the volume written to ") + path);
+        auto bytes = qcTypeSize(datatype);
+        auto rowBytes = sz[0] * bytes;
+        auto planeBytes = rowBytes * sz[1];
+        auto channelBytes = planeBytes * slab.sz[2];
+        traceScope.addWritten(channelBytes * sz[3]);
+        vector<uchar> line(rowBytes * sz[3]);
+        vector<uint16_t> extra(qMax(V3DLONG(1), sz[3] - 1), EXTRASAMPLE_UNSPECIFIED);
+        for (V3DLONG z = 0; z < slab.sz[2]; ++z)
+        {
+            TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, uint32_t(sz[0]));
+            TIFFSetField(tif, TIFFTAG_IMAGELENGTH, uint32_t(sz[1]));
+            TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, uint16_t(bytes * 8));
+            TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, uint16_t(sz[3]));
+            TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, uint16_t(datatype == V3D_FLOAT32 ?
+                                                             SAMPLEFORMAT_IEEEFP : SAMPLEFORMAT_UINT));
+            if (sz[3] > 1)
+                TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, uint16_t(sz[3] - 1), extra.data());
+            TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+            TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+            TIFFSetField(tif, TIFFTAG_COMPRESSION, uint16_t(compression));
+            if (compression == COMPRESSION_LZW || compression == COMPRESSION_ADOBE_DEFLATE
+#ifdef COMPRESSION_ZSTD
+                    || compression == COMPRESSION_ZSTD
+#endif
+                    )
+                TIFFSetField(tif, TIFFTAG_PREDICTOR, uint16_t(datatype == V3D_FLOAT32 ?
+                                                              PREDICTOR_FLOATINGPOINT : PREDICTOR_HORIZONTAL));
+            if (compression == COMPRESSION_ADOBE_DEFLATE)
+                TIFFSetField(tif, TIFFTAG_ZIPQUALITY, 1);
+            TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tif, 0));
+            TIFFSetField(tif, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
+            TIFFSetField(tif, TIFFTAG_PAGENUMBER, uint16_t(planes), uint16_t(sz[2]));
+            auto plane = slab.buffer + z * planeBytes;
+            for (V3DLONG y = 0; y < sz[1]; ++y)
+            {
+                auto row = plane + y * rowBytes;
+                if (sz[3] > 1)
+                {
+                    for (V3DLONG c = 0; c < sz[3]; ++c)
+                        for (V3DLONG x = 0; x < sz[0]; ++x)
+                            memcpy(line.data() + (x * sz[3] + c) * bytes, row + c * channelBytes + x * bytes, bytes);
+                    row = line.data();
+                }
+                if (TIFFWriteScanline(tif, (void*)row, uint32_t(y), 0) < 0)
+                    throw runtime_error(string("Failed to write ") + path);
+            }
+            if (!TIFFWriteDirectory(tif))
+                throw runtime_error(string("Failed to write ") + path);
+            ++planes;
+        }
+        return true;
+    }
+    catch(exception& e)
+    {
+        cerr << "ERROR: " << e.what() << endl;
+        return false;
+    }
+}
+
+bool TiffSlabWriter::finish()
+{
+    if (tif == NULL)
+        return false;
+    TIFFClose((TIFF*)tif);
+    tif = NULL;
+    if (planes != sz[2])
+    {
+        cerr << "ERROR: Only " << planes << " of " << sz[2] << " planes were written to " << path << endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef TIFFIO_H
+#define TIFFIO_H
+
+#include "qcBasic.h"
+#include "TeraQCTypes.h"
+#include "slabWriter.h"
+#include <string>
+
+bool loadTiff(const char* path, QcImage& output);
+
+bool loadTiffPlanes(const char* path, V3DLONG z0, V3DLONG z1, QcImage& output);
+
+bool saveTiff(const char* path, const QcImage& image);
+
+/*
+ * A multi-page tiff written a page per z plane as the slabs come
+ *
+ * Pages are encoded & appended right away, so only a row of pixels is
+ * buffered. Volumes too large for the 32bit offsets of classic tiffs are
+ * written as BigTIFF, decided by their uncompressed size.
+ */
+class TiffSlabWriter : public SlabWriter
+{
+public:
+    TiffSlabWriter(): tif(NULL), datatype(V3D_UNKNOWN), compression(1) {}
+    ~TiffSlabWriter();
+
+    bool open(const char* path, const V3DLONG sz[4], int datatype, const QString& compression="none");
+
+    bool write(const QcImage& slab);
+
+    bool finish();
+
+protected:
+    // libtiff handle, opaque here so only tiffIO.cpp needs the libtiff headers
+    void* tif;
+    std::string path;
+    V3DLONG sz[4];
+    int datatype;
+    int compression;
+};
+
+#endif // TIFFIO_H
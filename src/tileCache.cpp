@@ -0,0 +1,81 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "tileCache.h"
+
+using namespace std;
+
+TileCache::TileCache(qint64 capacity):
+    maxBytes(capacity), usedBytes(0), hitCount(0), missCount(0), evictionCount(0)
+{
+}
+
+void TileCache::setCapacity(qint64 bytes)
+{
+    lock_guard<mutex> lk(m);
+    maxBytes = bytes;
+    evict();
+}
+
+/*
+ * Get a decoded block, decoding it with the callback on a miss
+ *
+ * Returns a null pointer if decoding failed. Blocks larger than the whole
+ * capacity are returned without being cached.
+ *
+ */
+
+TileCache::Tile TileCache::get(const TileKey& key, const function<bool(QcImage&)>& load)
+{
+    {
+        lock_guard<mutex> lk(m);
+        auto it = entries.find(key);
+        if (it != entries.end())
+        {
+            ++hitCount;
+            order.splice(order.begin(), order, it->pos);
+            return it->tile;
+        }
+        ++missCount;
+    }
+
+    // owned before loading, so it's freed if the loader throws
+    QSharedPointer<QcImage> img(new QcImage);
+    if (!load(*img))
+        return Tile();
+    Tile tile = img;
+    qint64 bytes = img->sz[0] * img->sz[1] * img->sz[2] * img->sz[3] * qcTypeSize(img->datatype);
+
+    lock_guard<mutex> lk(m);
+    if (bytes > maxBytes || entries.contains(key))
+        return tile;
+    order.push_front(key);
+    Entry entry = {tile, bytes, order.begin()};
+    entries.insert(key, entry);
+    usedBytes += bytes;
+    evict();
+    return tile;
+}
+
+void TileCache::clear()
+{
+    lock_guard<mutex> lk(m);
+    entries.clear();
+    order.clear();
+    usedBytes = 0;
+}
+
+// drop the least recently used blocks until within capacity, lock held by caller
+void TileCache::evict()
+{
+    while (usedBytes > maxBytes && !order.empty())
+    {
+        auto it = entries.find(order.back());
+        usedBytes -= it->bytes;
+        entries.erase(it);
+        order.pop_back();
+        ++evictionCount;
+    }
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include "qcBasic.h"
+#include <functional>
+#include <list>
+#include <mutex>
+#include "TeraQCTypes.h"
+
+// key of a decoded teraconvert block, the resolution folder & the block origin
+struct TileKey
+{
+    QString res;
+    V3DLONG origin[3];
+
+    bool operator==(const TileKey& other) const
+    {
+        return res == other.res && origin[0] == other.origin[0] &&
+                origin[1] == other.origin[1] && origin[2] == other.origin[2];
+    }
+};
+
+inline uint qHash(const TileKey& key)
+{
+    return qHash(key.res) ^ qHash(quint64(key.origin[0]) * 73856093ULL ^
+            quint64(key.origin[1]) * 19349663ULL ^ quint64(key.origin[2]) * 83492791ULL);
+}
+
+/*
+ * Memory bounded LRU cache of decoded teraconvert blocks
+ *
+ * Blocks are shared by pointer, so an evicted block stays valid for whoever
+ * still holds it and is freed when the last holder releases it. It's safe
+ * to use from several threads; decoding is done outside the lock, so 2 threads
+ * missing the same block at once may both decode it.
+ */
+class TileCache
+{
+public:
+    typedef QSharedPointer<const QcImage> Tile;
+
+    explicit TileCache(qint64 capacity=0);
+
+    void setCapacity(qint64 bytes);
+    qint64 capacity() const { return maxBytes; }
+
+    Tile get(const TileKey& key, const std::function<bool(QcImage&)>& load);
+
+    void clear();
+
+    // counters
+    qint64 hits() const { std::lock_guard<std::mutex> lk(m); return hitCount; }
+    qint64 misses() const { std::lock_guard<std::mutex> lk(m); return missCount; }
+    qint64 evictions() const { std::lock_guard<std::mutex> lk(m); return evictionCount; }
+    qint64 bytes() const { std::lock_guard<std::mutex> lk(m); return usedBytes; }
+
+protected:
+    void evict();
+
+    struct Entry
+    {
+        Tile tile;
+        qint64 bytes;
+        std::list<TileKey>::iterator pos;
+    };
+    // most recently used first
+    std::list<TileKey> order;
+    QHash<TileKey, Entry> entries;
+    qint64 maxBytes, usedBytes, hitCount, missCount, evictionCount;
+    mutable std::mutex m;
+};
+
+#endif // TILECACHE_H
@@ -0,0 +1,260 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#include "trace.h"
+#include "TeraQCTypes.h"
+#include <iostream>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <map>
+#ifdef Q_OS_WIN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+using namespace std;
+
+// a finished scope, times in microseconds since the trace started
+struct TraceEvent
+{
+    string name;
+    double start, duration, cpuMs;
+    qint64 bytesRead, bytesWritten, imageBytes, peakImageBytes;
+    int thread;
+};
+
+atomic<bool> QcTrace::enabled(false);
+
+static mutex traceMutex;
+static vector<TraceEvent> traceEvents;
+// threads in the order of their first event
+static vector<thread::id> traceThreads;
+static QElapsedTimer traceClock;
+// open scopes of each thread, innermost last
+static map<thread::id, vector<QcTraceScope*> > traceScopes;
+
+static atomic<qint64> imageBytes(0), peakImageBytes(0);
+
+void qcTrackImageBytes(qint64 delta)
+{
+    auto now = imageBytes.fetch_add(delta, memory_order_relaxed) + delta;
+    auto peak = peakImageBytes.load(memory_order_relaxed);
+    while (now > peak && !peakImageBytes.compare_exchange_weak(peak, now, memory_order_relaxed));
+}
+
+qint64 qcImageBytes()
+{
+    return imageBytes.load(memory_order_relaxed);
+}
+
+qint64 qcPeakImageBytes()
+{
+    return peakImageBytes.load(memory_order_relaxed);
+}
+
+double qcProcessCpuMs()
+{
+#ifdef Q_OS_WIN
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return 0;
+    // in 100ns
+    auto ticks = [](const FILETIME& t) { return (quint64(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+    return (ticks(kernel) + ticks(user)) / 1e4;
+#else
+    timespec t;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t) != 0)
+        return 0;
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+#endif
+}
+
+double qcThreadCpuMs()
+{
+#ifdef Q_OS_WIN
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0;
+    // in 100ns
+    auto ticks = [](const FILETIME& t) { return (quint64(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+    return (ticks(kernel) + ticks(user)) / 1e4;
+#else
+    timespec t;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t) != 0)
+        return 0;
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+#endif
+}
+
+double qcPeakRssMB()
+{
+#ifdef Q_OS_WIN
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize / 1048576.0;
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef Q_OS_MAC
+    // bytes on macOS, KB elsewhere
+    return usage.ru_maxrss / 1048576.0;
+#else
+    return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+}
+
+void QcTrace::start()
+{
+    lock_guard<mutex> lk(traceMutex);
+    traceEvents.clear();
+    traceThreads.clear();
+    traceClock.start();
+    enabled = true;
+}
+
+void QcTrace::stop()
+{
+    enabled = false;
+}
+
+double QcTrace::now()
+{
+    return traceClock.nsecsElapsed() / 1e3;
+}
+
+void QcTrace::record(const string& name, double start, double end, double cpuMs,
+                     qint64 bytesRead, qint64 bytesWritten)
+{
+    TraceEvent event;
+    event.name = name;
+    event.start = start;
+    event.duration = end - start;
+    event.cpuMs = cpuMs;
+    event.bytesRead = bytesRead;
+    event.bytesWritten = bytesWritten;
+    event.imageBytes = qcImageBytes();
+    event.peakImageBytes = qcPeakImageBytes();
+    auto id = this_thread::get_id();
+    lock_guard<mutex> lk(traceMutex);
+    auto it = find(traceThreads.begin(), traceThreads.end(), id);
+    event.thread = int(it - traceThreads.begin());
+    if (it == traceThreads.end())
+        traceThreads.push_back(id);
+    traceEvents.push_back(event);
+}
+
+void QcTrace::addCpu(double ms)
+{
+    lock_guard<mutex> lk(traceMutex);
+    auto it = traceScopes.find(this_thread::get_id());
+    if (it != traceScopes.end() && !it->second.empty())
+        it->second.back()->addCpu(ms);
+}
+
+void QcTraceScope::begin(const string& name)
+{
+    this->name = name;
+    {
+        lock_guard<mutex> lk(traceMutex);
+        traceScopes[this_thread::get_id()].push_back(this);
+    }
+    cpuStart = qcThreadCpuMs();
+    start = QcTrace::now();
+}
+
+void QcTraceScope::end()
+{
+    auto stop = QcTrace::now();
+    auto cpuMs = qcThreadCpuMs() - cpuStart + cpuOther;
+    {
+        // the other threads count for the enclosing scope too, as this thread's time does
+        lock_guard<mutex> lk(traceMutex);
+        auto it = traceScopes.find(this_thread::get_id());
+        auto& scopes = it->second;
+        scopes.erase(find(scopes.begin(), scopes.end(), this));
+        if (!scopes.empty())
+            scopes.back()->addCpu(cpuOther);
+        else
+            traceScopes.erase(it);
+    }
+    QcTrace::record(name, start, stop, cpuMs, bytesRead, bytesWritten);
+}
+
+// a json string literal
+static QString jsonString(const string& text)
+{
+    auto s = QString::fromStdString(text);
+    s.replace('\\', "\\\\").replace('"', "\\\"");
+    return '"' + s + '"';
+}
+
+/*
+ * Save the trace as a Chrome trace json file
+ *
+ * Each scope is a complete event ("X") of thread 1, 2.. in the order the
+ * threads were first seen, with its CPU time, bytes & image buffers as args,
+ * and the image buffers allocated are also a counter ("C") over time. The
+ * totals per scope name are under otherData.
+ *
+ */
+
+bool QcTrace::save(const QString& path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Text))
+    {
+        cerr << "ERROR: Failed to write " << path.toStdString() << endl;
+        return false;
+    }
+    lock_guard<mutex> lk(traceMutex);
+    QTextStream out(&file);
+    out.setRealNumberPrecision(3);
+    out.setRealNumberNotation(QTextStream::FixedNotation);
+    out << "{\"traceEvents\": [\n";
+    out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"TeraQC\"}}";
+    for (size_t i = 0; i < traceThreads.size(); ++i)
+        out << ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << i + 1
+            << ", \"args\": {\"name\": \"thread " << i + 1 << "\"}}";
+    QMap<QString, QVector<double> > totals;
+    for (size_t i = 0; i < traceEvents.size(); ++i)
+    {
+        const auto& e = traceEvents[i];
+        out << ",\n{\"name\": " << jsonString(e.name) << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.thread + 1
+            << ", \"ts\": " << e.start << ", \"dur\": " << e.duration << ", \"args\": {\"cpuMs\": " << e.cpuMs
+            << ", \"bytesRead\": " << e.bytesRead << ", \"bytesWritten\": " << e.bytesWritten
+            << ", \"imageMB\": " << e.imageBytes / 1048576.0 << ", \"peakImageMB\": "
+            << e.peakImageBytes / 1048576.0 << "}}";
+        out << ",\n{\"name\": \"image buffers\", \"ph\": \"C\", \"pid\": 1, \"ts\": " << e.start + e.duration
+            << ", \"args\": {\"MB\": " << e.imageBytes / 1048576.0 << "}}";
+        // count, wall ms, cpu ms, bytes read & written
+        auto& t = totals[QString::fromStdString(e.name)];
+        if (t.isEmpty()) t.resize(5);
+        t[0] += 1;
+        t[1] += e.duration / 1e3;
+        t[2] += e.cpuMs;
+        t[3] += e.bytesRead;
+        t[4] += e.bytesWritten;
+    }
+    out << "\n],\n\"displayTimeUnit\": \"ms\",\n\"otherData\": {\"peakRssMB\": " << qcPeakRssMB()
+        << ", \"peakImageMB\": " << qcPeakImageBytes() / 1048576.0 << ", \"totals\": {";
+    for (auto it = totals.constBegin(); it != totals.constEnd(); ++it)
+    {
+        const auto& t = it.value();
+        out << (it == totals.constBegin() ? "\n" : ",\n") << jsonString(it.key().toStdString())
+            << ": {\"count\": " << qint64(t[0]) << ", \"ms\": " << t[1] << ", \"cpuMs\": " << t[2]
+            << ", \"bytesRead\": " << qint64(t[3]) << ", \"bytesWritten\": " << qint64(t[4]) << "}";
+    }
+    out << "}}}\n";
+    return true;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2022 Zuohan Zhao
+ * SPDX-License-Identifier: Apache-2.0
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "qcBasic.h"
+#include <atomic>
+#include <string>
+
+/*
+ * Process wide trace of timed scopes, saved in the Chrome trace format
+ *
+ * Off by default. While off, a scope costs one relaxed atomic load, so
+ * scopes can stay in the kernels. While on, each scope is recorded when it
+ * ends, with its wall time, its CPU time (that of its thread, plus that of
+ * the threads it ran by parallelForWorker & runStages, so it shows how
+ * parallel a stage is, without the unrelated threads), the bytes it read & wrote,
+ * and the image buffers allocated, now & at their peak. Load the saved file
+ * in chrome://tracing or Perfetto.
+ */
+class QcTrace
+{
+public:
+    static bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+
+    // clear the events & start recording
+    static void start();
+
+    // stop recording, the events are kept for saving
+    static void stop();
+
+    static bool save(const QString& path);
+
+    // microseconds since start
+    static double now();
+
+    static void record(const std::string& name, double start, double end, double cpuMs,
+                       qint64 bytesRead, qint64 bytesWritten);
+
+    // add the CPU time of threads run for the innermost open scope of this thread
+    static void addCpu(double ms);
+
+protected:
+    static std::atomic<bool> enabled;
+};
+
+// a timed scope of the trace, named by a literal or a string copied only if tracing
+class QcTraceScope
+{
+public:
+    explicit QcTraceScope(const char* name):
+        active(QcTrace::isEnabled()), cpuOther(0), bytesRead(0), bytesWritten(0)
+    {
+        if (active) begin(name);
+    }
+    explicit QcTraceScope(const QString& name):
+        active(QcTrace::isEnabled()), cpuOther(0), bytesRead(0), bytesWritten(0)
+    {
+        if (active) begin(name.toStdString());
+    }
+    ~QcTraceScope()
+    {
+        if (active) end();
+    }
+    void addRead(qint64 bytes) { bytesRead += bytes; }
+    void addWritten(qint64 bytes) { bytesWritten += bytes; }
+    void addCpu(double ms) { cpuOther += ms; }
+
+protected:
+    void begin(const std::string& name);
+    void end();
+
+    bool active;
+    std::string name;
+    // cpuOther: CPU time of the other threads run for the scope
+    double start, cpuStart, cpuOther;
+    qint64 bytesRead, bytesWritten;
+
+private:
+    QcTraceScope(const QcTraceScope&);
+    QcTraceScope& operator=(const QcTraceScope&);
+};
+
+// CPU time of the process in ms, all threads
+double qcProcessCpuMs();
+
+// CPU time of the calling thread in ms
+double qcThreadCpuMs();
+
+// peak resident memory of the process in MB, 0 if unknown
+double qcPeakRssMB();
+
+// bytes of image buffers allocated now & at most so far
+qint64 qcImageBytes();
+
+qint64 qcPeakImageBytes();
+
+#endif // TRACE_H